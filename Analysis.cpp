@@ -0,0 +1,424 @@
+#include "Analysis.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define VECTOR_WORDS  (28U * 2U)   // ATmega644 interrupt vectors, 2 words each
+
+// Successor kinds (see successors)
+#define CF_END        1U           // Ends a basic block
+#define CF_UNKNOWN    2U           // May continue anywhere
+
+#define REACHED       1U
+#define LEADER        2U
+
+Analysis::Analysis()
+{
+	memset(flagsLive, FLAGS_ALL, sizeof(flagsLive));
+	memset(addrClass, ADDR_NONE, sizeof(addrClass));
+	memset(address, 0, sizeof(address));
+}
+
+// Flags read (use) and written (def) by an instruction. A flag only
+// partially written (Z of CPC, SBC, SBCI) is also read.
+static void flag_usage(const instructionDecode_t &insn, unsigned int &use, unsigned int &def)
+{
+	const unsigned int bit = (insn.arg1 < 6U) ? (1U << insn.arg1) : 0U;
+
+	use = 0U;
+	def = 0U;
+	switch (insn.opNum){
+		case  2: // ADD
+		case 17: // CP
+		case 19: // CPI
+		case 51: // NEG
+		case 83: // SUB
+		case 84: // SUBI
+			def = FLAGS_ALL;
+			break;
+		case  1: // ADC
+			use = FLAG_C;
+			def = FLAGS_ALL;
+			break;
+		case 18: // CPC
+		case 63: // SBC
+		case 64: // SBCI
+			use = FLAG_C | FLAG_Z;
+			def = FLAGS_ALL;
+			break;
+		case  3: // ADIW
+		case  6: // ASR
+		case 16: // COM
+		case 45: // LSR
+		case 68: // SBIW
+			def = FLAG_C | FLAG_Z | FLAG_N | FLAG_V | FLAG_S;
+			break;
+		case 62: // ROR
+			use = FLAG_C;
+			def = FLAG_C | FLAG_Z | FLAG_N | FLAG_V | FLAG_S;
+			break;
+		case  4: // AND
+		case  5: // ANDI
+		case 21: // DEC
+		case 22: // EOR
+		case 29: // INC
+		case 53: // OR
+		case 54: // ORI
+			def = FLAG_Z | FLAG_N | FLAG_V | FLAG_S;
+			break;
+		case 23: // FMUL
+		case 24: // FMULS
+		case 25: // FMULSU
+		case 48: // MUL
+		case 49: // MULS
+		case 50: // MULSU
+			def = FLAG_C | FLAG_Z;
+			break;
+		case  7: // BCLR
+		case 12: // BSET
+			def = bit;
+			break;
+		case  9: // BRBC
+		case 10: // BRBS
+			use = bit;
+			break;
+		case 28: // IN
+			use = (insn.arg2 == ports::SREG) ? FLAGS_ALL : 0U;
+			break;
+		case 41: // LDS
+			use = ((u16)insn.arg2 == IOBASE + ports::SREG) ? FLAGS_ALL : 0U;
+			break;
+		case 55: // OUT
+			def = (insn.arg1 == ports::SREG) ? FLAGS_ALL : 0U;
+			break;
+		case  0: // Illegal
+		case 14: // CALL
+		case 26: // ICALL
+		case 27: // IJMP
+		case 58: // RCALL
+		case 59: // RET
+		case 60: // RETI
+			use = FLAGS_ALL;
+			break;
+		default:
+			break;
+	}
+}
+
+// Registers an instruction may write, as a bit mask. Anything ending a
+// basic block does not matter here.
+static u32 reg_writes(const instructionDecode_t &insn)
+{
+	const u32 d = 1U << (insn.arg1 & 31U);
+
+	switch (insn.opNum){
+		case  7: case  9: case 10: case 11: case 12: case 13: case 15:
+		case 17: case 18: case 19: case 52: case 55: case 57: case 65:
+		case 71: case 72: case 76: case 79: case 81: case 82: case 86:
+			return 0U;
+		case  3: // ADIW
+		case 47: // MOVW
+		case 68: // SBIW
+			return d | (d << 1);
+		case 23: case 24: case 25: case 48: case 49: case 50: // Multiplies
+		case 42: // LPM
+			return 0x3U;
+		case 31: case 34: case 35: // LD from X
+			return d | (0x3U << 26);
+		case 73: case 77:          // ST to X with update
+			return 0x3U << 26;
+		case 32: case 36:          // LD from Y with update
+			return d | (0x3U << 28);
+		case 74: case 78:          // ST to Y with update
+			return 0x3U << 28;
+		case 33: case 38: case 44: // LD / LPM from Z with update
+			return d | (0x3U << 30);
+		case 75: case 80:          // ST to Z with update
+			return 0x3U << 30;
+		case  1: case  2: case  4: case  5: case  6: case  8: case 16:
+		case 21: case 22: case 28: case 29: case 37: case 39: case 40:
+		case 41: case 43: case 45: case 46: case 51: case 53: case 54:
+		case 56: case 62: case 63: case 64: case 83: case 84: case 85:
+			return d;
+		default:
+			return 0xFFFFFFFFU;
+	}
+}
+
+static unsigned int addr_class(u16 address)
+{
+	if (address >= SRAMBASE) return ADDR_SRAM;
+	if (address >= IOBASE)   return ADDR_IO;
+	return ADDR_REG;
+}
+
+// Static successors of the instruction at the address: the next
+// instruction and branch or skip targets in succ, the target of a call in
+// call (the call itself continues with the next instruction). Returns
+// CF_* flags, a target outside flash counts as unknown.
+unsigned int Analysis::successors(u16 address, u32 succ[2], u32 &call) const
+{
+	const instructionDecode_t &i = insn[address];
+	const u32 next = address + avr8::get_insn_size(i.opNum);
+	unsigned int kind = CF_END;
+
+	succ[0] = next;
+	succ[1] = NO_ADDRESS;
+	call = NO_ADDRESS;
+
+	switch (i.opNum){
+		case  9: // BRBC
+		case 10: // BRBS
+			succ[1] = (u16)(address + 1U + i.arg2);
+			break;
+		case 20: // CPSE
+		case 66: // SBIC
+		case 67: // SBIS
+		case 69: // SBRC
+		case 70: // SBRS
+			if (next < (progSize / 2))
+				succ[1] = next + avr8::get_insn_size(insn[next].opNum);
+			break;
+		case 61: // RJMP
+			succ[0] = (u16)(address + 1U + i.arg2);
+			break;
+		case 30: // JMP
+			succ[0] = (u16)i.arg2;
+			break;
+		case 14: // CALL
+			call = (u16)i.arg2;
+			break;
+		case 58: // RCALL
+			call = (u16)(address + 1U + i.arg2);
+			break;
+		case 26: // ICALL
+			kind |= CF_UNKNOWN;
+			break;
+		case 27: // IJMP
+		case 59: // RET
+		case 60: // RETI
+			succ[0] = NO_ADDRESS;
+			kind |= CF_UNKNOWN;
+			break;
+		case  0: // Illegal
+			succ[0] = NO_ADDRESS;
+			break;
+		default:
+			kind = 0U;
+			break;
+	}
+
+	for (unsigned int s = 0U; s < 2U; s++){
+		if (succ[s] != NO_ADDRESS && succ[s] >= (progSize / 2)){
+			succ[s] = NO_ADDRESS;
+			kind |= CF_UNKNOWN;
+		}
+	}
+	if (call != NO_ADDRESS && call >= (progSize / 2)){
+		call = NO_ADDRESS;
+		kind |= CF_UNKNOWN;
+	}
+	return kind;
+}
+
+// Backward flag liveness over all flash words, iterated up to the fixed
+// point (loops need a few more passes)
+void Analysis::liveness()
+{
+	unsigned int use, def;
+	u32 succ[2];
+	u32 call;
+	bool changed = true;
+
+	memset(liveIn, 0, sizeof(liveIn));
+
+	while (changed){
+		changed = false;
+		for (unsigned int a = (progSize / 2); a > 0U; a--){
+			const u16 i = a - 1U;
+			unsigned int out = 0U;
+
+			if ((successors(i, succ, call) & CF_UNKNOWN) != 0U){
+				out = FLAGS_ALL;
+			}
+			for (unsigned int s = 0U; s < 2U; s++){
+				if (succ[s] != NO_ADDRESS) out |= liveIn[succ[s]];
+			}
+			flagsLive[i] = out;
+
+			flag_usage(insn[i], use, def);
+			const u8 in = use | (out & ~def);
+			if (in != liveIn[i]){
+				liveIn[i] = in;
+				changed = true;
+			}
+		}
+	}
+}
+
+// Basic blocks of the code reachable from the entry points
+void Analysis::findBlocks(u16 entry)
+{
+	std::vector<u16> work;
+	u32 succ[2];
+	u32 call;
+
+	memset(reached, 0, sizeof(reached));
+	blocks.clear();
+
+	for (u16 v = 0U; v < VECTOR_WORDS; v += 2U){
+		work.push_back(v);
+		reached[v] |= LEADER;
+	}
+	work.push_back(entry);
+	reached[entry] |= LEADER;
+
+	while (!work.empty()){
+		const u16 a = work.back();
+		work.pop_back();
+		if ((reached[a] & REACHED) != 0U) continue;
+		reached[a] |= REACHED;
+
+		const unsigned int kind = successors(a, succ, call);
+		if (call != NO_ADDRESS){
+			reached[call] |= LEADER;
+			work.push_back(call);
+		}
+		for (unsigned int s = 0U; s < 2U; s++){
+			if (succ[s] == NO_ADDRESS) continue;
+			if ((kind & CF_END) != 0U) reached[succ[s]] |= LEADER;
+			work.push_back(succ[s]);
+		}
+	}
+
+	for (u32 a = 0U; a < (progSize / 2); ){
+		if ((reached[a] & REACHED) == 0U){
+			a++;
+			continue;
+		}
+
+		cfgBlock_t block;
+		u32 i = a;
+		unsigned int kind;
+		for (;;){
+			kind = successors(i, block.succ, block.call);
+			const u32 next = i + avr8::get_insn_size(insn[i].opNum);
+			if (kind != 0U || next >= (progSize / 2) ||
+			    reached[next] != REACHED){
+				break;
+			}
+			i = next;
+		}
+		block.start = a;
+		block.end = i + avr8::get_insn_size(insn[i].opNum);
+		block.indirect = (kind & CF_UNKNOWN) != 0U;
+		blocks.push_back(block);
+		constAddresses(block);
+		a = block.end;
+	}
+}
+
+// Tracks the values LDI puts in the Y and Z pointers through a block, to
+// find the addresses of LDD and STD
+void Analysis::constAddresses(const cfgBlock_t &block)
+{
+	int ptr[4] = { -1, -1, -1, -1 }; // r28 - r31
+	u32 a = block.start;
+
+	while (a < block.end){
+		const instructionDecode_t &i = insn[a];
+		const u32 writes = reg_writes(i);
+		int base = -1;
+
+		if (i.opNum == 37 || i.opNum == 79) base = 0; // Y+q
+		if (i.opNum == 39 || i.opNum == 81) base = 2; // Z+q
+		if (base >= 0 && ptr[base] >= 0 && ptr[base + 1] >= 0){
+			address[a] = (ptr[base] | (ptr[base + 1] << 8)) + i.arg2;
+			addrClass[a] = addr_class(address[a]);
+		}
+
+		for (unsigned int r = 0U; r < 4U; r++){
+			if ((writes & (1U << (28U + r))) != 0U) ptr[r] = -1;
+		}
+		if (i.opNum == 40 && i.arg1 >= 28U) ptr[i.arg1 - 28U] = (u8)i.arg2; // LDI
+
+		a += avr8::get_insn_size(i.opNum);
+	}
+}
+
+void Analysis::run(const instructionDecode_t *decoded, u16 entry)
+{
+	memcpy(insn, decoded, sizeof(insn));
+	memset(addrClass, ADDR_NONE, sizeof(addrClass));
+	memset(address, 0, sizeof(address));
+
+	// LDS and STS anywhere, LDD and STD in reachable code (findBlocks)
+	for (unsigned int a = 0U; a < (progSize / 2); a++){
+		if (insn[a].opNum == 41 || insn[a].opNum == 82){
+			address[a] = (u16)insn[a].arg2;
+			addrClass[a] = addr_class(address[a]);
+		}
+	}
+
+	liveness();
+	findBlocks(entry);
+}
+
+static const char *flag_names(unsigned int flags, char *buf)
+{
+	const char names[] = "CZNVSH";
+	unsigned int n = 0U;
+
+	for (unsigned int b = 0U; b < 6U; b++){
+		if ((flags & (1U << b)) != 0U) buf[n++] = names[b];
+	}
+	if (n == 0U) buf[n++] = '-';
+	buf[n] = '\0';
+	return buf;
+}
+
+// Graphviz dot of the CFG. Each block lists its instructions (byte
+// addresses, like avr-objdump) with the flags live after them and the
+// class of constant data addresses. Calls are dashed, blocks left through
+// RET, RETI, IJMP or ICALL are drawn bold.
+bool Analysis::dumpCFG(const char *filename) const
+{
+	static const char *const classes[] = { "", "reg", "io", "sram" };
+	FILE *f = fopen(filename, "w");
+	char text[64];
+	char flags[8];
+
+	if (f == NULL){
+		return false;
+	}
+
+	fprintf(f, "digraph cfg {\n");
+	fprintf(f, "\tnode [shape=box fontname=\"monospace\"];\n");
+	for (size_t b = 0U; b < blocks.size(); b++){
+		const cfgBlock_t &block = blocks[b];
+
+		fprintf(f, "\tb%04x [label=\"", block.start);
+		for (u32 a = block.start; a < block.end; a += avr8::get_insn_size(insn[a].opNum)){
+			const instructionDecode_t &i = insn[a];
+			avr8::disassemble(i, text, sizeof(text));
+			fprintf(f, "%05x: %-28s", a * 2U, text);
+			if (flagsLive[a] != FLAGS_ALL)
+				fprintf(f, " live=%s", flag_names(flagsLive[a], flags));
+			if (addrClass[a] != ADDR_NONE)
+				fprintf(f, " [%s 0x%04x]", classes[addrClass[a]], address[a]);
+			fprintf(f, "\\l");
+		}
+		fprintf(f, "\"%s];\n", block.indirect ? " style=bold" : "");
+
+		for (unsigned int s = 0U; s < 2U; s++){
+			if (block.succ[s] != NO_ADDRESS && (reached[block.succ[s]] & REACHED) != 0U)
+				fprintf(f, "\tb%04x -> b%04x;\n", block.start, block.succ[s]);
+		}
+		if (block.call != NO_ADDRESS)
+			fprintf(f, "\tb%04x -> b%04x [style=dashed];\n", block.start, block.call);
+	}
+	fprintf(f, "}\n");
+
+	fclose(f);
+	return true;
+}
@@ -0,0 +1,69 @@
+#ifndef ANALYSIS_H
+#define ANALYSIS_H
+
+// Static analysis of the decoded program.
+//
+// Splits the code reachable from the reset and interrupt vectors into basic
+// blocks linked by a control flow graph, computes which SREG flags are live
+// after each instruction, and classifies the targets of LDS / STS and of
+// LDD / STD with a pointer known within the block (register file, I/O or
+// SRAM). avr8::specialize uses the results to pick handlers which skip dead
+// flag updates or the data address range checks.
+//
+// The liveness is computed over every flash word, not only the reachable
+// code, so code only entered through IJMP / ICALL (jump tables, function
+// pointers) is covered as well. Anything leaving to an unknown place (RET,
+// RETI, IJMP, ICALL, CALL, RCALL) counts as reading all flags. SREG read
+// through a pointer (LD, LDD) is not considered.
+
+#include "avr8.h"
+
+#define FLAG_C      0x01U
+#define FLAG_Z      0x02U
+#define FLAG_N      0x04U
+#define FLAG_V      0x08U
+#define FLAG_S      0x10U
+#define FLAG_H      0x20U
+#define FLAGS_ALL   0x3FU      // The arithmetic flags, neither T nor I
+
+#define ADDR_NONE   0U         // Not a data access with a known address
+#define ADDR_REG    1U         // Register file (0x0000 - 0x001F)
+#define ADDR_IO     2U         // I/O (0x0020 - 0x00FF)
+#define ADDR_SRAM   3U         // SRAM (0x0100 - )
+
+#define NO_ADDRESS  0xFFFFFFFFU
+
+struct cfgBlock_t {
+	u16 start;     // Word address of the first instruction
+	u16 end;       // Word address following the last instruction
+	u32 succ[2];   // Word addresses of the successor blocks, NO_ADDRESS if none
+	u32 call;      // Word address called by the last instruction, NO_ADDRESS if none
+	bool indirect; // Left through RET, RETI, IJMP or ICALL
+};
+
+struct Analysis {
+	Analysis();
+
+	void run(const instructionDecode_t *decoded, u16 entry);
+	bool dumpCFG(const char *filename) const;
+
+	// SREG flags (FLAG_*) live after the instruction at each word address
+	u8  flagsLive[progSize / 2];
+	// Class (ADDR_*) and address of the data accessed at each word address
+	u8  addrClass[progSize / 2];
+	u16 address[progSize / 2];
+
+	std::vector<cfgBlock_t> blocks;
+
+private:
+	void liveness();
+	void findBlocks(u16 entry);
+	void constAddresses(const cfgBlock_t &block);
+	unsigned int successors(u16 address, u32 succ[2], u32 &call) const;
+
+	instructionDecode_t insn[progSize / 2];
+	u8  liveIn[progSize / 2];
+	u8  reached[progSize / 2];
+};
+
+#endif // ANALYSIS_H
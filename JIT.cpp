@@ -0,0 +1,512 @@
+// JIT.cpp
+//
+// Basic-block translator for the AVR core, x86-64 code generation.
+//
+// Generated blocks follow the "void block(u8 *regs)" prototype. Register
+// use within a block, chosen to be volatile on both the SysV and the Win64
+// calling conventions:
+//
+//   r8   AVR register file (regs); SREG is at a fixed offset from it
+//   r9d  AVR SREG, loaded on entry and stored on exit
+//   r10  Host flags -> SREG translation table
+//   eax, edx: scratch
+//
+// Flags are produced by the equivalent x86 operation, captured with
+// pushfq, and translated by a table lookup: the x86 CF, ZF, SF, OF and AF
+// flags match the AVR C, Z, N, V and H flags for all the translated
+// instructions (S is N ^ V).
+
+#include <stdio.h>
+#include <string.h>
+#if defined(_WIN32)
+	#include <windows.h>
+#else
+	#include <sys/mman.h>
+#endif
+#include "JIT.h"
+
+// SREG location relative to the register file (the register file and the
+// I/O space are contiguous in avr8).
+#define SREG_OFFSET   (32U + ports::SREG)
+
+// AVR SREG bits
+#define F_C   0x01U
+#define F_Z   0x02U
+#define F_N   0x04U
+#define F_V   0x08U
+#define F_S   0x10U
+#define F_H   0x20U
+
+// Host flags (after pushfq) to AVR SREG bits. Index is the flags register
+// masked with 0x8D1 (OF, SF, ZF, AF, CF).
+#define HOST_FLAGS_MASK 0x8D1U
+struct flagTable_t {
+	u8 flags[HOST_FLAGS_MASK + 1U];
+};
+
+static constexpr flagTable_t makeFlagTable()
+{
+	flagTable_t table = {};
+	for (unsigned int i = 0U; i <= HOST_FLAGS_MASK; i++)
+	{
+		unsigned int c = (i >> 0) & 1U;
+		unsigned int h = (i >> 4) & 1U;
+		unsigned int z = (i >> 6) & 1U;
+		unsigned int n = (i >> 7) & 1U;
+		unsigned int v = (i >> 11) & 1U;
+		table.flags[i] = (c * F_C) | (z * F_Z) | (n * F_N) | (v * F_V) |
+		                 ((n ^ v) * F_S) | (h * F_H);
+	}
+	return table;
+}
+
+static constexpr flagTable_t flagTable = makeFlagTable();
+
+// x86 ALU operation numbers (the /n field of the 0x80 group and bits 3-5
+// of the register forms)
+enum { ALU_ADD = 0, ALU_OR, ALU_ADC, ALU_SBB, ALU_AND, ALU_SUB, ALU_XOR, ALU_CMP };
+
+
+
+// Code emitters. All AVR register accesses are [r8 + disp8].
+
+static inline void emit(u8 *&p, u8 b)
+{
+	*p++ = b;
+}
+
+// movzx edx, byte [r8 + reg]
+static inline void emitLoad(u8 *&p, u8 reg)
+{
+	emit(p, 0x41); emit(p, 0x0F); emit(p, 0xB6); emit(p, 0x50); emit(p, reg);
+}
+
+// mov byte [r8 + reg], dl
+static inline void emitStore(u8 *&p, u8 reg)
+{
+	emit(p, 0x41); emit(p, 0x88); emit(p, 0x50); emit(p, reg);
+}
+
+// movzx edx, word [r8 + reg]
+static inline void emitLoad16(u8 *&p, u8 reg)
+{
+	emit(p, 0x41); emit(p, 0x0F); emit(p, 0xB7); emit(p, 0x50); emit(p, reg);
+}
+
+// mov word [r8 + reg], dx
+static inline void emitStore16(u8 *&p, u8 reg)
+{
+	emit(p, 0x66); emit(p, 0x41); emit(p, 0x89); emit(p, 0x50); emit(p, reg);
+}
+
+// <op> dl, byte [r8 + reg]
+static inline void emitAluReg(u8 *&p, unsigned int op, u8 reg)
+{
+	emit(p, 0x41); emit(p, (op << 3) | 0x02U); emit(p, 0x50); emit(p, reg);
+}
+
+// <op> dl, imm8
+static inline void emitAluImm(u8 *&p, unsigned int op, u8 imm)
+{
+	emit(p, 0x80); emit(p, 0xC2 | (op << 3)); emit(p, imm);
+}
+
+// <op> dx, imm16 (only add and sub are used)
+static inline void emitAluImm16(u8 *&p, unsigned int op, u16 imm)
+{
+	emit(p, 0x66); emit(p, 0x81); emit(p, 0xC2 | (op << 3));
+	emit(p, imm & 0xFFU); emit(p, imm >> 8);
+}
+
+// bt r9d, 0 (AVR carry into host carry)
+static inline void emitCarryIn(u8 *&p)
+{
+	emit(p, 0x41); emit(p, 0x0F); emit(p, 0xBA); emit(p, 0xE1); emit(p, 0x00);
+}
+
+// Merges the host flags into SREG for the bits in 'mask'
+static inline void emitFlags(u8 *&p, u8 mask)
+{
+	emit(p, 0x9C);                                           // pushfq
+	emit(p, 0x58);                                           // pop rax
+	emit(p, 0x25); emit(p, HOST_FLAGS_MASK & 0xFFU);         // and eax, HOST_FLAGS_MASK
+	emit(p, HOST_FLAGS_MASK >> 8); emit(p, 0x00); emit(p, 0x00);
+	emit(p, 0x41); emit(p, 0x0F); emit(p, 0xB6); emit(p, 0x04); emit(p, 0x02); // movzx eax, byte [r10 + rax]
+	emit(p, 0x83); emit(p, 0xE0); emit(p, mask);             // and eax, mask
+	emit(p, 0x41); emit(p, 0x83); emit(p, 0xE1); emit(p, (u8)(~mask)); // and r9d, ~mask
+	emit(p, 0x41); emit(p, 0x09); emit(p, 0xC1);             // or r9d, eax
+}
+
+// SBC, SBCI and CPC: Z is only cleared if the result is nonzero
+static inline void emitClearZ(u8 *&p)
+{
+	emit(p, 0x84); emit(p, 0xD2);                            // test dl, dl
+	emit(p, 0x74); emit(p, 0x04);                            // jz +4
+	emit(p, 0x41); emit(p, 0x83); emit(p, 0xE1); emit(p, (u8)(~F_Z)); // and r9d, ~F_Z
+}
+
+
+
+// Returns the cycles of a translatable instruction, 0 if it can not be
+// translated. Opcode numbers are those of instructionList (avr8.cpp), the
+// specialised variants count as their plain instruction.
+static unsigned int insnCycles(u8 opNum)
+{
+	switch (avr8::specializedBase(opNum))
+	{
+		case  1: // ADC
+		case  2: // ADD
+		case  4: // AND
+		case  5: // ANDI
+		case 16: // COM
+		case 17: // CP
+		case 18: // CPC
+		case 19: // CPI
+		case 21: // DEC
+		case 22: // EOR
+		case 29: // INC
+		case 40: // LDI
+		case 46: // MOV
+		case 47: // MOVW
+		case 51: // NEG
+		case 52: // NOP
+		case 53: // OR
+		case 54: // ORI
+		case 63: // SBC
+		case 64: // SBCI
+		case 83: // SUB
+		case 84: // SUBI
+		case 85: // SWAP
+			return 1U;
+		case  3: // ADIW
+		case 68: // SBIW
+			return 2U;
+		default:
+			return 0U;
+	}
+}
+
+// Translates a single instruction
+static void emitInsn(u8 *&p, const instructionDecode_t &insn)
+{
+	const u8 d = insn.arg1;
+	const u8 r = (u8)(insn.arg2);
+	// Flag-free variants (avr8::specialize) translate as the plain
+	// instruction, without the flag update
+	const u8 op = avr8::specializedBase(insn.opNum);
+	const bool flags = (op == insn.opNum);
+
+	switch (op)
+	{
+		case  1: // ADC Rd,Rr
+			emitLoad(p, d); emitCarryIn(p); emitAluReg(p, ALU_ADC, r);
+			if (flags) emitFlags(p, F_C | F_Z | F_N | F_V | F_S | F_H);
+			emitStore(p, d);
+			break;
+
+		case  2: // ADD Rd,Rr
+			emitLoad(p, d); emitAluReg(p, ALU_ADD, r);
+			if (flags) emitFlags(p, F_C | F_Z | F_N | F_V | F_S | F_H);
+			emitStore(p, d);
+			break;
+
+		case  3: // ADIW Rd+1:Rd,K
+			emitLoad16(p, d); emitAluImm16(p, ALU_ADD, r);
+			emitFlags(p, F_C | F_Z | F_N | F_V | F_S);
+			emitStore16(p, d);
+			break;
+
+		case  4: // AND Rd,Rr
+			emitLoad(p, d); emitAluReg(p, ALU_AND, r);
+			if (flags) emitFlags(p, F_Z | F_N | F_V | F_S);
+			emitStore(p, d);
+			break;
+
+		case  5: // ANDI Rd,K
+			emitLoad(p, d); emitAluImm(p, ALU_AND, r);
+			if (flags) emitFlags(p, F_Z | F_N | F_V | F_S);
+			emitStore(p, d);
+			break;
+
+		case 16: // COM Rd
+			emitLoad(p, d); emitAluImm(p, ALU_XOR, 0xFFU);
+			emitFlags(p, F_Z | F_N | F_V | F_S);
+			emit(p, 0x41); emit(p, 0x83); emit(p, 0xC9); emit(p, F_C); // or r9d, F_C
+			emitStore(p, d);
+			break;
+
+		case 17: // CP Rd,Rr
+			emitLoad(p, d); emitAluReg(p, ALU_CMP, r);
+			emitFlags(p, F_C | F_Z | F_N | F_V | F_S | F_H);
+			break;
+
+		case 18: // CPC Rd,Rr
+			emitLoad(p, d); emitCarryIn(p); emitAluReg(p, ALU_SBB, r);
+			emitFlags(p, F_C | F_N | F_V | F_S | F_H);
+			emitClearZ(p);
+			break;
+
+		case 19: // CPI Rd,K
+			emitLoad(p, d); emitAluImm(p, ALU_CMP, r);
+			emitFlags(p, F_C | F_Z | F_N | F_V | F_S | F_H);
+			break;
+
+		case 21: // DEC Rd
+			emitLoad(p, d); emit(p, 0xFE); emit(p, 0xCA);     // dec dl
+			if (flags) emitFlags(p, F_Z | F_N | F_V | F_S);
+			emitStore(p, d);
+			break;
+
+		case 22: // EOR Rd,Rr
+			emitLoad(p, d); emitAluReg(p, ALU_XOR, r);
+			if (flags) emitFlags(p, F_Z | F_N | F_V | F_S);
+			emitStore(p, d);
+			break;
+
+		case 29: // INC Rd
+			emitLoad(p, d); emit(p, 0xFE); emit(p, 0xC2);     // inc dl
+			if (flags) emitFlags(p, F_Z | F_N | F_V | F_S);
+			emitStore(p, d);
+			break;
+
+		case 40: // LDI Rd,K
+			emit(p, 0x41); emit(p, 0xC6); emit(p, 0x40); emit(p, d); emit(p, r); // mov byte [r8 + d], K
+			break;
+
+		case 46: // MOV Rd,Rr
+			emitLoad(p, r); emitStore(p, d);
+			break;
+
+		case 47: // MOVW Rd+1:Rd,Rr+1:Rr
+			emitLoad16(p, r); emitStore16(p, d);
+			break;
+
+		case 51: // NEG Rd
+			emit(p, 0x31); emit(p, 0xD2);                     // xor edx, edx
+			emitAluReg(p, ALU_SUB, d);
+			emitFlags(p, F_C | F_Z | F_N | F_V | F_S | F_H);
+			emitStore(p, d);
+			break;
+
+		case 52: // NOP
+			break;
+
+		case 53: // OR Rd,Rr
+			emitLoad(p, d); emitAluReg(p, ALU_OR, r);
+			if (flags) emitFlags(p, F_Z | F_N | F_V | F_S);
+			emitStore(p, d);
+			break;
+
+		case 54: // ORI Rd,K
+			emitLoad(p, d); emitAluImm(p, ALU_OR, r);
+			if (flags) emitFlags(p, F_Z | F_N | F_V | F_S);
+			emitStore(p, d);
+			break;
+
+		case 63: // SBC Rd,Rr
+			emitLoad(p, d); emitCarryIn(p); emitAluReg(p, ALU_SBB, r);
+			if (flags) emitFlags(p, F_C | F_N | F_V | F_S | F_H);
+			if (flags) emitClearZ(p);
+			emitStore(p, d);
+			break;
+
+		case 64: // SBCI Rd,K
+			emitLoad(p, d); emitCarryIn(p); emitAluImm(p, ALU_SBB, r);
+			if (flags) emitFlags(p, F_C | F_N | F_V | F_S | F_H);
+			if (flags) emitClearZ(p);
+			emitStore(p, d);
+			break;
+
+		case 68: // SBIW Rd+1:Rd,K
+			emitLoad16(p, d); emitAluImm16(p, ALU_SUB, r);
+			emitFlags(p, F_C | F_Z | F_N | F_V | F_S);
+			emitStore16(p, d);
+			break;
+
+		case 83: // SUB Rd,Rr
+			emitLoad(p, d); emitAluReg(p, ALU_SUB, r);
+			if (flags) emitFlags(p, F_C | F_Z | F_N | F_V | F_S | F_H);
+			emitStore(p, d);
+			break;
+
+		case 84: // SUBI Rd,K
+			emitLoad(p, d); emitAluImm(p, ALU_SUB, r);
+			if (flags) emitFlags(p, F_C | F_Z | F_N | F_V | F_S | F_H);
+			emitStore(p, d);
+			break;
+
+		case 85: // SWAP Rd
+			emitLoad(p, d); emit(p, 0xC0); emit(p, 0xC2); emit(p, 0x04); // rol dl, 4
+			emitStore(p, d);
+			break;
+	}
+}
+
+// Worst case size of a translated instruction (with the flag merge)
+#define JIT_MAX_INSN_CODE  48U
+// Prologue and epilogue
+#define JIT_FRAME_CODE     32U
+
+
+
+JIT::JIT() : code(NULL), codeUsed(0), blockCount(0)
+{
+	memset(entry, 0, sizeof(entry));
+}
+
+JIT::~JIT()
+{
+	if (code == NULL)
+		return;
+#if defined(_WIN32)
+	VirtualFree(code, 0, MEM_RELEASE);
+#else
+	munmap(code, JIT_CODE_SIZE);
+#endif
+}
+
+bool JIT::init()
+{
+	if (code != NULL)
+		return true;
+#if defined(_WIN32)
+	code = (u8*)VirtualAlloc(NULL, JIT_CODE_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
+#else
+	void *mem = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	code = (mem == MAP_FAILED) ? NULL : (u8*)mem;
+#endif
+	if (code == NULL)
+	{
+		fprintf(stderr, "JIT: Unable to allocate executable memory, running interpreted.\n");
+		return false;
+	}
+	flush();
+	return true;
+}
+
+void JIT::flush()
+{
+	memset(entry, 0, sizeof(entry));
+	codeUsed = 0;
+	blockCount = 0;
+}
+
+// Translates every block of the flash
+void JIT::translate(const instructionDecode_t *decoded)
+{
+	flush();
+	translateRange(decoded, 0U, progSize / 2);
+}
+
+// Drops the blocks covering the given word address (which was rewritten by
+// SPM and decoded again), then translates the surroundings again.
+void JIT::invalidate(const instructionDecode_t *decoded, u16 address)
+{
+	if (code == NULL)
+		return;
+
+	unsigned int from = (address >= JIT_MAX_INSNS * 2U) ? (address - JIT_MAX_INSNS * 2U) : 0U;
+	unsigned int to   = address + JIT_MAX_INSNS * 2U;
+	if (to > progSize / 2)
+		to = progSize / 2;
+
+	for (unsigned int i = from; i <= address; i++)
+	{
+		if (entry[i] != 0U && blocks[entry[i] - 1U].end >= address)
+			entry[i] = 0U;
+	}
+
+	translateRange(decoded, from, to);
+}
+
+// Looks for block leaders in the range (instructions which may be
+// translated following ones which may not) and translates them
+void JIT::translateRange(const instructionDecode_t *decoded, unsigned int from, unsigned int to)
+{
+	if (code == NULL)
+		return;
+
+	unsigned int run = 0U;
+	unsigned int pc  = from;
+
+	while (pc < to)
+	{
+		if (insnCycles(decoded[pc].opNum) == 0U)
+		{
+			run = 0U;
+		}
+		else
+		{
+			if ((run % JIT_MAX_INSNS) == 0U && entry[pc] == 0U)
+			{
+				if (!translateBlock(decoded, pc))
+				{
+					// Out of space: start over with a clean cache
+					translate(decoded);
+					return;
+				}
+			}
+			run++;
+		}
+		pc += avr8::get_insn_size(decoded[pc].opNum);
+	}
+}
+
+// Translates a block starting at 'start'. Returns false if the cache is
+// full, true otherwise (also if the run was too short for a block).
+bool JIT::translateBlock(const instructionDecode_t *decoded, u16 start)
+{
+	unsigned int count = 0U;
+	unsigned int cycles = 0U;
+
+	while ((start + count) < (progSize / 2) && count < JIT_MAX_INSNS)
+	{
+		unsigned int c = insnCycles(decoded[start + count].opNum);
+		if (c == 0U)
+			break;
+		cycles += c;
+		count++;
+	}
+	if (count < JIT_MIN_INSNS)
+		return true;
+
+	if (blockCount >= JIT_MAX_BLOCKS ||
+	    (codeUsed + JIT_FRAME_CODE + count * JIT_MAX_INSN_CODE) > JIT_CODE_SIZE)
+		return false;
+
+	u8 *p = code + codeUsed;
+	u8 *begin = p;
+
+	// Prologue
+#if defined(_WIN32)
+	emit(p, 0x49); emit(p, 0x89); emit(p, 0xC8);             // mov r8, rcx
+#else
+	emit(p, 0x49); emit(p, 0x89); emit(p, 0xF8);             // mov r8, rdi
+#endif
+	emit(p, 0x49); emit(p, 0xBA);                            // mov r10, flagTable
+	uint64_t table = (uint64_t)(uintptr_t)flagTable.flags;
+	for (unsigned int i = 0U; i < 8U; i++)
+		emit(p, (u8)(table >> (i * 8U)));
+	emit(p, 0x45); emit(p, 0x0F); emit(p, 0xB6); emit(p, 0x48); emit(p, SREG_OFFSET); // movzx r9d, byte [r8 + SREG]
+
+	for (unsigned int i = 0U; i < count; i++)
+		emitInsn(p, decoded[start + i]);
+
+	// Epilogue
+	emit(p, 0x45); emit(p, 0x88); emit(p, 0x48); emit(p, SREG_OFFSET); // mov byte [r8 + SREG], r9b
+	emit(p, 0xC3);                                           // ret
+
+	codeUsed += (u32)(p - begin);
+	codeUsed = (codeUsed + 15U) & ~15U;
+
+	jitBlock_t &blk = blocks[blockCount];
+	blk.code   = (jitCode_t)(void*)begin;
+	blk.start  = start;
+	blk.end    = start + count;
+	blk.last   = start + count - 1U;
+	blk.cycles = cycles;
+	blockCount++;
+	entry[start] = blockCount;
+
+	return true;
+}
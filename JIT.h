@@ -0,0 +1,57 @@
+#ifndef JIT_H
+#define JIT_H
+
+// Basic-block translator for the AVR core (x86-64 hosts only).
+//
+// Straight-line runs of register-only instructions (ALU ops, LDI, MOV,
+// MOVW, ADIW, SBIW...) are translated into native code operating directly
+// on the register file and SREG. Anything touching memory, I/O or the
+// program counter ends a block and is left to the interpreter, so a block
+// never has side effects on the hardware emulation other than consuming
+// its (statically known) cycles. See avr8::jit_exec for how blocks are
+// entered with exact cycle accounting.
+
+#include "avr8.h"
+
+#if !defined(__x86_64__) && !defined(_M_X64)
+	#error "The JIT requires an x86-64 host, build without JIT=1"
+#endif
+
+#define JIT_MIN_INSNS    3U        // Shorter runs are not worth a block
+#define JIT_MAX_INSNS    32U       // Block length limit (instructions)
+#define JIT_MAX_BLOCKS   16384U
+#define JIT_CODE_SIZE    0x400000U // Executable memory for translated code
+
+typedef void (*jitCode_t)(u8 *regs);
+
+struct jitBlock_t {
+	jitCode_t code;
+	u16  start;    // Word address of the first instruction
+	u16  end;      // Word address following the last instruction
+	u16  last;     // Word address of the last instruction
+	u8   cycles;   // Cycles consumed by the whole block
+};
+
+struct JIT {
+	JIT();
+	~JIT();
+
+	bool init();
+	void flush();
+	void translate(const instructionDecode_t *decoded);
+	void invalidate(const instructionDecode_t *decoded, u16 address);
+
+	// Block index + 1 for each word address a block starts at, 0 if none
+	u16 entry[progSize / 2];
+	jitBlock_t blocks[JIT_MAX_BLOCKS];
+
+private:
+	void translateRange(const instructionDecode_t *decoded, unsigned int from, unsigned int to);
+	bool translateBlock(const instructionDecode_t *decoded, u16 start);
+
+	u8  *code;
+	u32  codeUsed;
+	u32  blockCount;
+};
+
+#endif // JIT_H
@@ -0,0 +1,311 @@
+#include "Movie.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define MOVIE_MAGIC    0x564D5A55U // "UZMV"
+#define MOVIE_VERSION  1U
+
+#define MOVIE_STATE  'S'
+#define MOVIE_KEYS   'K'
+#define MOVIE_INPUT  'I'
+
+struct movieHeader_t {
+	u32 magic;
+	u16 version;
+	u16 keyInterval;          // Frames between keyframes
+	u64 romHash;              // Movie::hash of the flash at the start
+	u32 seed;
+	u32 frames;
+	u64 indexOffset;          // 0: not closed, the index is rebuilt (open)
+};
+
+Movie::Movie() :
+	seed(0U), frames(0U), file(NULL), runLength(0U), romHash(0U), pos(0U), end(0U),
+	checked(0U)
+{
+	runButtons[0] = runButtons[1] = 0U;
+}
+
+Movie::~Movie()
+{
+	close();
+}
+
+// FNV-1a
+u64 Movie::hash(const void *data, size_t size)
+{
+	const u8 *p = (const u8*)data;
+	u64 h = 14695981039346656037ULL;
+	for (size_t i = 0U; i < size; i++) {
+		h ^= p[i];
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+bool Movie::create(const char *filename, u64 romHash, u32 seed)
+{
+	file = fopen(filename, "wb");
+	if (file == NULL)
+		return false;
+	this->romHash = romHash;
+	this->seed = seed;
+	frames = 0U;
+	runLength = 0U;
+	index.clear();
+
+	// The index offset and frame count are filled in by close()
+	write_header(0U);
+	return true;
+}
+
+void Movie::write_header(u64 indexOffset)
+{
+	movieHeader_t head;
+	memset(&head, 0, sizeof(head));
+	head.magic = MOVIE_MAGIC;
+	head.version = MOVIE_VERSION;
+	head.keyInterval = MOVIE_KEY_INTERVAL;
+	head.romHash = romHash;
+	head.seed = seed;
+	head.frames = frames;
+	head.indexOffset = indexOffset;
+	fwrite(&head, sizeof(head), 1, file);
+}
+
+void Movie::put_varint(u32 value)
+{
+	while (value >= 0x80U) {
+		fputc((int)((value & 0x7FU) | 0x80U), file);
+		value >>= 7;
+	}
+	fputc((int)value, file);
+}
+
+// Writes the pending run of identical frames
+void Movie::flush()
+{
+	if (runLength == 0U)
+		return;
+	fputc(MOVIE_INPUT, file);
+	put_varint(runLength);
+	fwrite(runButtons, sizeof(runButtons), 1, file);
+	runLength = 0U;
+}
+
+// Scancode queued for the keyboard on the current frame
+void Movie::key(u8 code)
+{
+	if (file != NULL)
+		pendingKeys.push_back(code);
+}
+
+void Movie::frame(const u32 buttons[2])
+{
+	if (file == NULL)
+		return;
+	if (runLength != 0U && (!pendingKeys.empty() ||
+	    buttons[0] != runButtons[0] || buttons[1] != runButtons[1]))
+		flush();
+	if (!pendingKeys.empty()) {
+		fputc(MOVIE_KEYS, file);
+		put_varint((u32)pendingKeys.size());
+		fwrite(pendingKeys.data(), 1, pendingKeys.size(), file);
+		pendingKeys.clear();
+	}
+	runButtons[0] = buttons[0];
+	runButtons[1] = buttons[1];
+	runLength ++;
+	frames ++;
+}
+
+// A keyframe is due (before the next frame)
+bool Movie::wantState() const
+{
+	return file != NULL && (frames % MOVIE_KEY_INTERVAL) == 0U &&
+	       index.size() == frames / MOVIE_KEY_INTERVAL;
+}
+
+void Movie::state(const u8 *data, size_t size)
+{
+	flush();
+	index.push_back((u64)ftell(file));
+	fputc(MOVIE_STATE, file);
+	const u32 size32 = (u32)size;
+	fwrite(&size32, sizeof(size32), 1, file);
+	fwrite(data, 1, size, file);
+}
+
+void Movie::close()
+{
+	if (file == NULL)
+		return;
+	flush();
+
+	const u64 indexOffset = (u64)ftell(file);
+	const u32 count = (u32)index.size();
+	fwrite(&count, sizeof(count), 1, file);
+	fwrite(index.data(), sizeof(u64), index.size(), file);
+	fseek(file, 0L, SEEK_SET);
+	write_header(indexOffset);
+	fclose(file);
+	file = NULL;
+}
+
+bool Movie::get_varint(u32 &value)
+{
+	unsigned int shift = 0U;
+	value = 0U;
+	while (pos < end && shift < 32U) {
+		const u8 b = data[pos++];
+		value |= (u32)(b & 0x7FU) << shift;
+		if ((b & 0x80U) == 0U)
+			return true;
+		shift += 7U;
+	}
+	return false;
+}
+
+bool Movie::open(const char *filename, u64 romHash)
+{
+	FILE *f = fopen(filename, "rb");
+	if (f == NULL)
+		return false;
+	fseek(f, 0L, SEEK_END);
+	const long size = ftell(f);
+	fseek(f, 0L, SEEK_SET);
+	data.resize((size > 0) ? size : 0);
+	const bool read = (size > 0) && fread(data.data(), 1, size, f) == (size_t)size;
+	fclose(f);
+
+	movieHeader_t head;
+	if (!read || data.size() < sizeof(head))
+		return false;
+	memcpy(&head, data.data(), sizeof(head));
+	if (head.magic != MOVIE_MAGIC || head.version != MOVIE_VERSION ||
+	    head.keyInterval != MOVIE_KEY_INTERVAL || head.romHash != romHash)
+		return false;
+	seed = head.seed;
+	frames = 0U;
+	runLength = 0U;
+	index.clear();
+
+	u32 count = 0U;
+	if (head.indexOffset >= sizeof(head) &&
+	    head.indexOffset + sizeof(count) <= data.size()) {
+		memcpy(&count, &data[head.indexOffset], sizeof(count));
+	}
+	if (count != 0U && head.indexOffset + sizeof(count) + count * sizeof(u64) <= data.size()) {
+		index.resize(count);
+		memcpy(index.data(), &data[head.indexOffset + sizeof(count)], count * sizeof(u64));
+		end = head.indexOffset;
+	} else {
+		// Recording was not closed: find the keyframes
+		end = data.size();
+		pos = sizeof(head);
+		size_t valid = pos;
+		u32 value;
+		while (pos < end) {
+			const size_t chunk = pos;
+			const u8 type = data[pos++];
+			if (type == MOVIE_STATE && pos + sizeof(value) <= end) {
+				memcpy(&value, &data[pos], sizeof(value));
+				pos += sizeof(value) + value;
+				if (pos > end)
+					break;
+				index.push_back(chunk);
+			} else if (type == MOVIE_KEYS && get_varint(value) && pos + value <= end) {
+				pos += value;
+			} else if (type == MOVIE_INPUT && get_varint(value) &&
+			           pos + sizeof(runButtons) <= end) {
+				pos += sizeof(runButtons);
+			} else {
+				break;
+			}
+			valid = pos;
+		}
+		end = valid;
+	}
+	pos = sizeof(head);
+	checked = 0U;
+	return true;
+}
+
+// Input of the next frame, false at the end of the movie
+bool Movie::next(u32 buttons[2])
+{
+	keys.clear();
+	while (runLength == 0U) {
+		if (pos >= end)
+			return false;
+		const u8 type = data[pos++];
+		u32 value;
+		if (type == MOVIE_STATE) {
+			if (pos + sizeof(value) > end)
+				return false;
+			memcpy(&value, &data[pos], sizeof(value));
+			pos += sizeof(value) + value;
+		} else if (type == MOVIE_KEYS && get_varint(value) && pos + value <= end) {
+			keys.insert(keys.end(), &data[pos], &data[pos] + value);
+			pos += value;
+		} else if (type == MOVIE_INPUT && get_varint(value) &&
+		           pos + sizeof(runButtons) <= end) {
+			memcpy(runButtons, &data[pos], sizeof(runButtons));
+			pos += sizeof(runButtons);
+			runLength = value;
+		} else {
+			return false;
+		}
+	}
+	buttons[0] = runButtons[0];
+	buttons[1] = runButtons[1];
+	runLength --;
+	frames ++;
+	return true;
+}
+
+// State of the keyframe, NULL if the chunk is damaged
+const u8 *Movie::stateAt(size_t key, size_t &size) const
+{
+	const size_t at = index[key];
+	u32 value;
+	if (at + 1U + sizeof(value) > end || data[at] != MOVIE_STATE)
+		return NULL;
+	memcpy(&value, &data[at + 1U], sizeof(value));
+	if (at + 1U + sizeof(value) + value > end)
+		return NULL;
+	size = value;
+	return &data[at + 1U + sizeof(value)];
+}
+
+// State of the last keyframe at or before the frame, NULL if there is none.
+// Replay continues from the frame of that keyframe.
+const u8 *Movie::seek(u32 frame, size_t &size)
+{
+	if (index.empty())
+		return NULL;
+	size_t key = frame / MOVIE_KEY_INTERVAL;
+	if (key >= index.size())
+		key = index.size() - 1U;
+
+	const u8 *state = stateAt(key, size);
+	if (state == NULL)
+		return NULL;
+	pos = (state - data.data()) + size;
+	runLength = 0U;
+	frames = key * MOVIE_KEY_INTERVAL;
+	checked = key + 1U;
+	return state;
+}
+
+// State recorded before the frame next() returns next if it is a keyframe,
+// once, else NULL
+const u8 *Movie::keyState(size_t &size)
+{
+	const size_t key = frames / MOVIE_KEY_INTERVAL;
+	if ((frames % MOVIE_KEY_INTERVAL) != 0U || key < checked || key >= index.size())
+		return NULL;
+	checked = key + 1U;
+	return stateAt(key, size);
+}
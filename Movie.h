@@ -0,0 +1,72 @@
+#ifndef MOVIE_H
+#define MOVIE_H
+
+// Input movies (--capture, --loadcap), replacing the former .cap files.
+//
+// A movie holds the input of every frame: both controllers (with the mouse
+// deltas, see avr8::buttons) and the Uzebox keyboard scancodes, run-length
+// encoded. With the ROM hash and the watchdog entropy seed this replays the
+// session exactly. Every MOVIE_KEY_INTERVAL frames a savestate is stored,
+// listed in an index at the end of the file: seeking to frame N loads the
+// state of frame N - N % MOVIE_KEY_INTERVAL and replays from there.
+//
+// File layout (host byte order):
+//
+//   movieHeader_t
+//   chunks: MOVIE_STATE  u32 size, state (avr8::saveState)
+//           MOVIE_KEYS   count (varint), scancodes queued on the next frame
+//           MOVIE_INPUT  frames (varint), u32 buttons[2] held on each of them
+//   index:  u32 count, u64 offset of the MOVIE_STATE chunk of each keyframe
+
+#include "avr8.h"
+
+#include <vector>
+
+#define MOVIE_KEY_INTERVAL  600U  // Frames per keyframe (10 seconds)
+
+class Movie {
+public:
+	Movie();
+	~Movie();
+
+	static u64 hash(const void *data, size_t size);
+
+	// Recording
+	bool create(const char *filename, u64 romHash, u32 seed);
+	void key(u8 code);
+	void frame(const u32 buttons[2]);
+	bool wantState() const;
+	void state(const u8 *data, size_t size);
+	void close();
+
+	// Replay. open() fails on a movie of an other ROM.
+	bool open(const char *filename, u64 romHash);
+	bool next(u32 buttons[2]);
+	const u8 *seek(u32 frame, size_t &size);
+	const u8 *keyState(size_t &size);
+	std::vector<u8> keys;     // Scancodes queued on the frame next() returned
+
+	u32 seed;                 // Watchdog entropy seed (avr8::randomSeed)
+	u32 frames;               // Recorded / replayed so far
+
+private:
+	void write_header(u64 indexOffset);
+	void flush();
+	void put_varint(u32 value);
+	bool get_varint(u32 &value);
+	const u8 *stateAt(size_t key, size_t &size) const;
+
+	FILE *file;               // Recording
+	u32 runButtons[2];        // Input of the frames not written yet
+	u32 runLength;
+	std::vector<u8> pendingKeys;
+	std::vector<u64> index;   // Offset of each keyframe
+	u64 romHash;
+
+	std::vector<u8> data;     // Replay: the whole file
+	size_t pos;               // Next chunk
+	size_t end;               // Of the chunks (index offset)
+	size_t checked;           // Keyframes keyState() returned or seeked to
+};
+
+#endif // MOVIE_H
@@ -0,0 +1,157 @@
+#include "Presenter.h"
+#include "Scaler.h"
+
+#include <stdio.h>
+#include <string.h>
+
+Presenter::Presenter() :
+	dropped(0U), renderer(NULL), texture(NULL), scaler(NULL),
+	orientation(-1), mirror(SDL_FLIP_NONE),
+	in(0U), pending(1U), work(2U), fresh(false),
+	back(0U), ready(1U), front(2U), scaledFresh(false),
+	quit(false), thread(NULL), lock(NULL), wake(NULL)
+{
+}
+
+Presenter::~Presenter()
+{
+	if (thread != NULL) {
+		SDL_LockMutex(lock);
+		quit = true;
+		SDL_CondSignal(wake);
+		SDL_UnlockMutex(lock);
+		SDL_WaitThread(thread, NULL);
+	}
+	if (wake != NULL) SDL_DestroyCond(wake);
+	if (lock != NULL) SDL_DestroyMutex(lock);
+	delete scaler;
+	if (texture != NULL) SDL_DestroyTexture(texture);
+	if (renderer != NULL) SDL_DestroyRenderer(renderer);
+}
+
+bool Presenter::init(SDL_Window *window, int flags, int width, int height,
+                     SDL_Surface *surface, int scalerMode,
+                     int orientation, SDL_RendererFlip mirror)
+{
+	this->orientation = orientation;
+	this->mirror = mirror;
+
+	renderer = SDL_CreateRenderer(window, -1, flags);
+	if (renderer == NULL) {
+		fprintf(stderr, "CreateRenderer failed: %s\n", SDL_GetError());
+		return false;
+	}
+
+	SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "nearest");
+	SDL_RenderSetLogicalSize(renderer, width, height);
+
+	texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888,
+		SDL_TEXTUREACCESS_STREAMING, surface->w, surface->h);
+	if (texture == NULL) {
+		fprintf(stderr, "CreateTexture failed: %s\n", SDL_GetError());
+		return false;
+	}
+
+	SDL_RenderClear(renderer);
+	SDL_RenderCopy(renderer, texture, NULL, NULL);
+	SDL_RenderPresent(renderer);
+
+#ifdef ENABLE_SCALER
+	scaler = new Scaler(surface, renderer);
+	scaler->SetScaler(scalerMode);
+#else
+	(void)scalerMode;
+#endif
+	if (scaler == NULL || !scaler->activeScaler)
+		return true;
+
+	// Scaled on the worker, the scaler expects rows without padding
+	const size_t size = (size_t)surface->w * surface->h;
+	const size_t scale = (size_t)scaler->currentTextureScale;
+	for (unsigned int i = 0U; i < PRESENTER_BUFFERS; i++) {
+		frames[i].resize(size);
+		scaled[i].resize(size * scale * scale);
+	}
+	lock = SDL_CreateMutex();
+	wake = SDL_CreateCond();
+	if (lock != NULL && wake != NULL)
+		thread = SDL_CreateThread(scale_stub, "scaler", this);
+	return true;
+}
+
+void Presenter::show(SDL_Texture *shown)
+{
+	SDL_RenderClear(renderer);
+	if (orientation != -1 || mirror)
+		SDL_RenderCopyEx(renderer, shown, NULL, NULL, orientation, NULL, mirror);
+	else
+		SDL_RenderCopy(renderer, shown, NULL, NULL);
+	// Waits for vsync if enabled
+	SDL_RenderPresent(renderer);
+}
+
+void Presenter::scale()
+{
+	SDL_LockMutex(lock);
+	while (!quit) {
+		if (!fresh) {
+			SDL_CondWait(wake, lock);
+			continue;
+		}
+		// frame() leaves work and back alone
+		const unsigned int frame = pending;
+		pending = work;
+		work = frame;
+		fresh = false;
+		SDL_UnlockMutex(lock);
+		scaler->Scale(frames[work].data(), scaled[back].data());
+		SDL_LockMutex(lock);
+		const unsigned int done = back;
+		back = ready;
+		ready = done;
+		scaledFresh = true;
+	}
+	SDL_UnlockMutex(lock);
+}
+
+void Presenter::frame(const SDL_Surface *surface)
+{
+	if (scaler == NULL || !scaler->activeScaler) {
+		SDL_UpdateTexture(texture, NULL, surface->pixels, surface->pitch);
+		show(texture);
+		return;
+	}
+	if (thread == NULL) {
+		scaler->ApplyScalerIfNeeded();
+		show(scaler->scaledTexture);
+		return;
+	}
+
+	u32 *dest = frames[in].data();
+	for (int y = 0; y < surface->h; y++, dest += surface->w)
+		memcpy(dest, (const u8*)surface->pixels + y * surface->pitch, surface->w * sizeof(u32));
+
+	SDL_LockMutex(lock);
+	const unsigned int filled = in;
+	in = pending;
+	pending = filled;
+	if (fresh)
+		dropped.fetch_add(1U, std::memory_order_relaxed);
+	fresh = true;
+	SDL_CondSignal(wake);
+	const bool shown = scaledFresh;
+	if (shown) {
+		const unsigned int latest = ready;
+		ready = front;
+		front = latest;
+		scaledFresh = false;
+	}
+	SDL_UnlockMutex(lock);
+
+	// Only once the worker scaled a new frame
+	if (shown) {
+		SDL_UpdateTexture(scaler->scaledTexture, NULL, scaled[front].data(),
+			surface->w * scaler->currentTextureScale * sizeof(u32));
+		show(scaler->scaledTexture);
+	}
+}
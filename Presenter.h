@@ -0,0 +1,68 @@
+#ifndef PRESENTER_H
+#define PRESENTER_H
+
+// Presentation of the frames (see avr8::init_gui).
+//
+// SDL only supports a renderer on the thread of its window, so the texture
+// upload and the present stay on the emulation thread. The scaler, which
+// takes most of the time of a frame shown, runs on a worker thread: frame()
+// copies the frame for it and shows the latest frame it scaled, usually
+// the previous one. Both ways go through three buffers, the one being
+// filled, the latest complete one and the one being read, swapped under a
+// lock held for a few assignments only. A frame the worker had no time for
+// is replaced by the next one (dropped).
+//
+// Unscaled, or without threads, frame() uploads and presents directly.
+
+#include "avr8.h"
+
+#include <atomic>
+#include <vector>
+
+#define PRESENTER_BUFFERS  3U
+
+class Scaler;
+
+class Presenter {
+public:
+	Presenter();
+	~Presenter();
+
+	// Creates the renderer of the window for frames the size and format of
+	// the surface, shown at the logical size
+	bool init(SDL_Window *window, int flags, int width, int height,
+	          SDL_Surface *surface, int scalerMode,
+	          int orientation, SDL_RendererFlip mirror);
+	// Shows the frame or hands it to the worker, which it never waits for
+	void frame(const SDL_Surface *surface);
+
+	std::atomic<u32> dropped; // Frames replaced before they were scaled
+
+private:
+	void show(SDL_Texture *shown);
+	void scale();
+	static int scale_stub(void *self) { ((Presenter*)self)->scale(); return 0; }
+
+	SDL_Renderer *renderer;
+	SDL_Texture *texture;
+	Scaler *scaler;             // Output scaling, NULL if not enabled
+	int orientation;            // Rotation in degrees, -1: none
+	SDL_RendererFlip mirror;
+
+	std::vector<u32> frames[PRESENTER_BUFFERS]; // Unscaled
+	unsigned int in;            // Filled by frame()
+	unsigned int pending;       // Latest complete frame
+	unsigned int work;          // Scaled by the worker
+	bool fresh;                 // pending not scaled yet
+	std::vector<u32> scaled[PRESENTER_BUFFERS];
+	unsigned int back;          // Filled by the worker
+	unsigned int ready;         // Latest scaled frame
+	unsigned int front;         // Uploaded by frame()
+	bool scaledFresh;           // ready not shown yet
+	bool quit;
+	SDL_Thread *thread;         // NULL: scaled by frame()
+	SDL_mutex *lock;
+	SDL_cond *wake;
+};
+
+#endif // PRESENTER_H
@@ -0,0 +1,799 @@
+#include "Profile.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <map>
+
+#define PROFILE_TOP  100U     // Source lines and instructions listed at most
+#define PROFILE_IRQ  0xFFFFU  // Call site of an interrupt frame
+
+// ELF32 (little endian) layout, only what is needed for the symbols
+#define SHT_SYMTAB      2U
+#define SHF_EXECINSTR   4U
+#define STT_FUNC        2U
+#define STT_SECTION     3U
+#define STT_FILE        4U
+#define STB_GLOBAL      1U
+
+// DWARF line number program opcodes and forms
+#define DW_LNS_copy              1U
+#define DW_LNS_advance_pc        2U
+#define DW_LNS_advance_line      3U
+#define DW_LNS_set_file          4U
+#define DW_LNS_const_add_pc      8U
+#define DW_LNS_fixed_advance_pc  9U
+#define DW_LNE_end_sequence      1U
+#define DW_LNE_set_address       2U
+#define DW_LNE_define_file       3U
+#define DW_LNCT_path             1U
+#define DW_LNCT_directory_index  2U
+#define DW_FORM_block            0x09U
+#define DW_FORM_data1            0x0bU
+#define DW_FORM_data2            0x05U
+#define DW_FORM_data4            0x06U
+#define DW_FORM_data8            0x07U
+#define DW_FORM_data16           0x1eU
+#define DW_FORM_line_strp        0x1fU
+#define DW_FORM_string           0x08U
+#define DW_FORM_strp             0x0eU
+#define DW_FORM_udata            0x0fU
+
+static inline u32 rd16(const u8 *p) { return p[0] | (p[1] << 8); }
+static inline u32 rd32(const u8 *p) { return p[0] | (p[1] << 8) | (p[2] << 16) | ((u32)p[3] << 24); }
+static inline u64 rd64(const u8 *p) { return rd32(p) | ((u64)rd32(p + 4) << 32); }
+
+// LEB128, not reading past end
+static u64 uleb(const u8 *&p, const u8 *end)
+{
+	u64 value = 0U;
+	unsigned int shift = 0U;
+	while (p < end) {
+		const u8 b = *p++;
+		if (shift < 64U)
+			value |= (u64)(b & 0x7FU) << shift;
+		shift += 7U;
+		if ((b & 0x80U) == 0U)
+			break;
+	}
+	return value;
+}
+
+static s64 sleb(const u8 *&p, const u8 *end)
+{
+	s64 value = 0;
+	unsigned int shift = 0U;
+	u8 b = 0U;
+	while (p < end) {
+		b = *p++;
+		if (shift < 64U)
+			value |= (s64)(b & 0x7FU) << shift;
+		shift += 7U;
+		if ((b & 0x80U) == 0U)
+			break;
+	}
+	if (shift < 64U && (b & 0x40U) != 0U)
+		value |= -((s64)1 << shift);
+	return value;
+}
+
+static std::string cstring(const u8 *p, const u8 *end)
+{
+	const u8 *s = p;
+	while (p < end && *p != 0U)
+		p++;
+	return std::string((const char*)s, p - s);
+}
+
+Profile::Profile() :
+	irqCycles(0U)
+{
+	memset(count, 0, sizeof(count));
+	memset(targets, 0, sizeof(targets));
+}
+
+bool Profile::loadElf(const char *filename)
+{
+	FILE *f = fopen(filename, "rb");
+	if (f == NULL)
+		return false;
+	fseek(f, 0L, SEEK_END);
+	const long size = ftell(f);
+	fseek(f, 0L, SEEK_SET);
+	std::vector<u8> elf((size > 0) ? size : 0);
+	const bool read = (size > 0) && fread(elf.data(), 1, size, f) == (size_t)size;
+	fclose(f);
+
+	const u8 *e = elf.data();
+	if (!read || elf.size() < 52U || memcmp(e, "\177ELF", 4) != 0 ||
+	    e[4] != 1U || e[5] != 1U) // 32 bit, little endian
+		return false;
+
+	const u32 shoff = rd32(e + 32);
+	const u32 shentsize = rd16(e + 46);
+	const u32 shnum = rd16(e + 48);
+	const u32 shstrndx = rd16(e + 50);
+	if (shentsize < 40U || shoff + (u64)shnum * shentsize > elf.size() || shstrndx >= shnum)
+		return false;
+
+	// Section data within the file, NULL if there is none
+	struct section_t { const u8 *data; u32 size, type, flags, link; std::string name; };
+	std::vector<section_t> sections(shnum);
+	for (u32 i = 0U; i < shnum; i++) {
+		const u8 *sh = e + shoff + i * shentsize;
+		section_t &s = sections[i];
+		const u32 offset = rd32(sh + 16);
+		s.size = rd32(sh + 20);
+		s.type = rd32(sh + 4);
+		s.flags = rd32(sh + 8);
+		s.link = rd32(sh + 24);
+		s.data = (s.type != 8U && offset + (u64)s.size <= elf.size()) ? e + offset : NULL; // 8: NOBITS
+	}
+	const section_t &shstr = sections[shstrndx];
+	for (u32 i = 0U; i < shnum; i++) {
+		const u8 *sh = e + shoff + i * shentsize;
+		if (shstr.data != NULL && rd32(sh) < shstr.size)
+			sections[i].name = cstring(shstr.data + rd32(sh), shstr.data + shstr.size);
+	}
+
+	// Symbols in code sections
+	symbols.clear();
+	for (u32 i = 0U; i < shnum; i++) {
+		const section_t &symtab = sections[i];
+		if (symtab.type != SHT_SYMTAB || symtab.data == NULL || symtab.link >= shnum)
+			continue;
+		const section_t &strtab = sections[symtab.link];
+		if (strtab.data == NULL)
+			continue;
+		for (u32 at = 0U; at + 16U <= symtab.size; at += 16U) {
+			const u8 *sym = symtab.data + at;
+			const u32 name = rd32(sym);
+			const u32 info = sym[12];
+			const u32 shndx = rd16(sym + 14);
+			if ((info & 0xFU) == STT_SECTION || (info & 0xFU) == STT_FILE ||
+			    shndx == 0U || shndx >= shnum || (sections[shndx].flags & SHF_EXECINSTR) == 0U ||
+			    name >= strtab.size)
+				continue;
+			symbol_t s;
+			s.name = cstring(strtab.data + name, strtab.data + strtab.size);
+			if (s.name.empty() || s.name.compare(0, 2, ".L") == 0)
+				continue;
+			s.start = rd32(sym + 4);
+			s.end = (rd32(sym + 8) != 0U) ? s.start + rd32(sym + 8) : 0U;
+			// Functions and global labels first on the same address
+			const bool preferred = (info & 0xFU) == STT_FUNC || (info >> 4) == STB_GLOBAL;
+			if (preferred)
+				s.name.insert(0, 1, '\0');
+			symbols.push_back(s);
+		}
+	}
+	std::sort(symbols.begin(), symbols.end(), [](const symbol_t &a, const symbol_t &b) {
+		return (a.start != b.start) ? (a.start < b.start) : (a.name < b.name);
+	});
+	// One per address, and no labels within a function of known size
+	std::vector<symbol_t> unique;
+	for (size_t i = 0U; i < symbols.size(); i++) {
+		symbol_t &s = symbols[i];
+		if (!s.name.empty() && s.name[0] == '\0')
+			s.name.erase(0, 1);
+		if (!unique.empty() && (unique.back().start == s.start ||
+		    (s.end == 0U && unique.back().end > s.start)))
+			continue;
+		unique.push_back(s);
+	}
+	symbols.swap(unique);
+
+	// Line table
+	lines.clear();
+	files.clear();
+	const section_t *debugLine = NULL, *lineStr = NULL, *str = NULL;
+	for (u32 i = 0U; i < shnum; i++) {
+		if (sections[i].data == NULL) continue;
+		if (sections[i].name == ".debug_line") debugLine = &sections[i];
+		if (sections[i].name == ".debug_line_str") lineStr = &sections[i];
+		if (sections[i].name == ".debug_str") str = &sections[i];
+	}
+	if (debugLine != NULL)
+		readLines(debugLine->data, debugLine->data + debugLine->size,
+		          (lineStr != NULL) ? lineStr->data : NULL, (lineStr != NULL) ? lineStr->size : 0U,
+		          (str != NULL) ? str->data : NULL, (str != NULL) ? str->size : 0U);
+	// An end of sequence goes before a sequence starting at its address
+	std::stable_sort(lines.begin(), lines.end(), [](const line_t &a, const line_t &b) {
+		return (a.address != b.address) ? (a.address < b.address) :
+		       (a.line == 0U && b.line != 0U);
+	});
+
+	return !symbols.empty() || !lines.empty();
+}
+
+// Decodes the line number programs of all compilation units (DWARF 2 to 5)
+void Profile::readLines(const u8 *p, const u8 *end, const u8 *lineStr, size_t lineStrSize,
+                        const u8 *str, size_t strSize)
+{
+	while (p + 4 <= end) {
+		// Unit header
+		u64 length = rd32(p);
+		p += 4;
+		unsigned int offsetSize = 4U;
+		if (length == 0xFFFFFFFFU) {
+			if (p + 8 > end) return;
+			length = rd64(p);
+			p += 8;
+			offsetSize = 8U;
+		}
+		if (length > (u64)(end - p)) return;
+		const u8 *unitEnd = p + length;
+		const u8 *q = p;
+		p = unitEnd;
+
+		if (q + 2 > unitEnd) continue;
+		const unsigned int version = rd16(q);
+		q += 2;
+		if (version < 2U || version > 5U) continue;
+		unsigned int addressSize = 4U;
+		if (version >= 5U) {
+			if (q + 2 > unitEnd) continue;
+			addressSize = q[0];
+			q += 2;
+		}
+		if (q + offsetSize > unitEnd) continue;
+		const u64 headerLength = (offsetSize == 8U) ? rd64(q) : rd32(q);
+		q += offsetSize;
+		if (headerLength > (u64)(unitEnd - q)) continue;
+		const u8 *program = q + headerLength;
+
+		if (q + ((version >= 4U) ? 5 : 4) > program) continue;
+		const unsigned int minLength = *q++;
+		if (version >= 4U) q++; // Maximum operations per instruction (VLIW only)
+		q++;                    // Default is_stmt
+		const int lineBase = (s8)*q++;
+		const unsigned int lineRange = *q++;
+		const unsigned int opcodeBase = *q++;
+		if (lineRange == 0U || opcodeBase == 0U || q + opcodeBase - 1U > program) continue;
+		const u8 *opcodeLengths = q - 1; // Indexed by opcode
+		q += opcodeBase - 1U;
+
+		// Directories and files, the unit's file numbers start at fileBase
+		std::vector<std::string> dirs;
+		const size_t fileBase = files.size();
+		unsigned int firstFile = 1U;
+		if (version < 5U) {
+			dirs.push_back("");
+			while (q < program && *q != 0U) {
+				dirs.push_back(cstring(q, program));
+				q += dirs.back().size() + 1U;
+			}
+			q++;
+			while (q < program && *q != 0U) {
+				std::string name = cstring(q, program);
+				q += name.size() + 1U;
+				const u64 dir = uleb(q, program);
+				uleb(q, program); // Modification time
+				uleb(q, program); // Length
+				if (dir != 0U && dir < dirs.size() && !name.empty() && name[0] != '/')
+					name = dirs[dir] + "/" + name;
+				files.push_back(name);
+			}
+		} else {
+			firstFile = 0U;
+			bool bad = false;
+			for (unsigned int table = 0U; table < 2U && !bad; table++) {
+				if (q >= program) { bad = true; break; }
+				const unsigned int formats = *q++;
+				std::vector<u64> format;
+				for (unsigned int i = 0U; i < formats * 2U; i++)
+					format.push_back(uleb(q, program));
+				const u64 entries = uleb(q, program);
+				for (u64 n = 0U; n < entries && !bad; n++) {
+					std::string path;
+					u64 dir = 0U;
+					for (unsigned int i = 0U; i < formats && !bad; i++) {
+						const u64 content = format[i * 2U];
+						const u64 form = format[i * 2U + 1U];
+						u64 value = 0U;
+						std::string text;
+						switch (form) {
+							case DW_FORM_string:
+								text = cstring(q, program);
+								q += text.size() + 1U;
+								break;
+							case DW_FORM_line_strp:
+							case DW_FORM_strp: {
+								if (q + offsetSize > program) { bad = true; break; }
+								const u64 at = (offsetSize == 8U) ? rd64(q) : rd32(q);
+								q += offsetSize;
+								const u8 *s = (form == DW_FORM_strp) ? str : lineStr;
+								const size_t size = (form == DW_FORM_strp) ? strSize : lineStrSize;
+								if (s != NULL && at < size)
+									text = cstring(s + at, s + size);
+								break;
+							}
+							case DW_FORM_udata: value = uleb(q, program); break;
+							case DW_FORM_data1: value = *q; q += 1; break;
+							case DW_FORM_data2: value = rd16(q); q += 2; break;
+							case DW_FORM_data4: value = rd32(q); q += 4; break;
+							case DW_FORM_data8: q += 8; break;
+							case DW_FORM_data16: q += 16; break;
+							case DW_FORM_block: q += uleb(q, program); break;
+							default: bad = true; break;
+						}
+						if (q > program) bad = true;
+						if (content == DW_LNCT_path) path = text;
+						if (content == DW_LNCT_directory_index) dir = value;
+					}
+					if (table == 0U) {
+						dirs.push_back(path);
+					} else {
+						if (dir != 0U && dir < dirs.size() && !path.empty() && path[0] != '/')
+							path = dirs[dir] + "/" + path;
+						files.push_back(path);
+					}
+				}
+			}
+			if (bad) { files.resize(fileBase); continue; }
+		}
+
+		// Line number program, rows are kept at each address change
+		q = program;
+		u32 address = 0U;
+		u64 file = 1U;
+		s64 lineNo = 1;
+		while (q < unitEnd) {
+			const unsigned int op = *q++;
+			bool row = false, endSequence = false;
+			if (op >= opcodeBase) {
+				const unsigned int adjusted = op - opcodeBase;
+				address += (adjusted / lineRange) * minLength;
+				lineNo += lineBase + (int)(adjusted % lineRange);
+				row = true;
+			} else if (op == 0U) {
+				const u64 len = uleb(q, unitEnd);
+				if (len == 0U || len > (u64)(unitEnd - q)) break;
+				const u8 *next = q + len;
+				const unsigned int sub = *q++;
+				if (sub == DW_LNE_end_sequence) {
+					row = endSequence = true;
+				} else if (sub == DW_LNE_set_address) {
+					address = (addressSize == 2U || len == 3U) ? rd16(q) : rd32(q);
+				} else if (sub == DW_LNE_define_file) {
+					files.push_back(cstring(q, next));
+				}
+				q = next;
+			} else if (op == DW_LNS_copy) {
+				row = true;
+			} else if (op == DW_LNS_advance_pc) {
+				address += uleb(q, unitEnd) * minLength;
+			} else if (op == DW_LNS_advance_line) {
+				lineNo += sleb(q, unitEnd);
+			} else if (op == DW_LNS_set_file) {
+				file = uleb(q, unitEnd);
+			} else if (op == DW_LNS_const_add_pc) {
+				address += ((255U - opcodeBase) / lineRange) * minLength;
+			} else if (op == DW_LNS_fixed_advance_pc) {
+				if (q + 2 > unitEnd) break;
+				address += rd16(q);
+				q += 2;
+			} else {
+				// Other standard opcodes only have LEB128 operands
+				for (unsigned int i = 0U; i < opcodeLengths[op]; i++)
+					uleb(q, unitEnd);
+			}
+
+			if (row) {
+				line_t l;
+				l.address = address;
+				l.file = (u32)(fileBase + file - firstFile);
+				l.line = (endSequence || file < firstFile || l.file >= files.size()) ? 0U : (u32)lineNo;
+				// A later row on the same address describes it better
+				if (!lines.empty() && lines.back().address == address && lines.back().line != 0U)
+					lines.back() = l;
+				else
+					lines.push_back(l);
+			}
+			if (endSequence) {
+				address = 0U;
+				file = 1U;
+				lineNo = 1;
+			}
+		}
+	}
+}
+
+const Profile::symbol_t *Profile::symbol(u32 address) const
+{
+	size_t lo = 0U, hi = symbols.size();
+	while (lo < hi) {
+		const size_t mid = (lo + hi) / 2U;
+		if (symbols[mid].start <= address) lo = mid + 1U; else hi = mid;
+	}
+	if (lo == 0U) return NULL;
+	const symbol_t &s = symbols[lo - 1U];
+	return (s.end == 0U || address < s.end) ? &s : NULL;
+}
+
+const Profile::line_t *Profile::line(u32 address) const
+{
+	size_t lo = 0U, hi = lines.size();
+	while (lo < hi) {
+		const size_t mid = (lo + hi) / 2U;
+		if (lines[mid].address <= address) lo = mid + 1U; else hi = mid;
+	}
+	if (lo == 0U || lines[lo - 1U].line == 0U) return NULL;
+	return &lines[lo - 1U];
+}
+
+// Ends a frame, its cost without the interrupts goes to its call edge or
+// to the interrupts. A state loaded (rewind) may have the clock go back.
+void Profile::leave(const frame_t &frame, u64 cycle)
+{
+	const u64 irqC = irqCycles - frame.irqCycles;
+	const u64 c = (cycle > frame.cycles + irqC) ? (cycle - frame.cycles - irqC) : 0U;
+
+	edge_t &e = (frame.site == PROFILE_IRQ) ? handlers[frame.target] :
+	            edges[((u32)frame.site << 16) | frame.target];
+	e.calls ++;
+	e.cycles += c;
+	if (frame.site == PROFILE_IRQ)
+		irqCycles += c;
+}
+
+void Profile::call(u16 site, u16 target, u16 sp, u64 cycle)
+{
+	// Frames at or below the new one were left without returning
+	while (!stack.empty() && stack.back().sp <= sp) {
+		leave(stack.back(), cycle);
+		stack.pop_back();
+	}
+	frame_t f = { site, target, sp, cycle, irqCycles };
+	stack.push_back(f);
+	targets[target / 32U] |= 1U << (target % 32U);
+}
+
+void Profile::ret(u16 sp, u64 cycle)
+{
+	while (!stack.empty() && stack.back().sp < sp) {
+		leave(stack.back(), cycle);
+		stack.pop_back();
+	}
+}
+
+void Profile::interrupt(u16 handler, u16 sp, u64 cycle)
+{
+	call(PROFILE_IRQ, handler, sp, cycle);
+}
+
+// Entry and name of the function holding the instruction
+u16 Profile::function(u16 address, std::string &name) const
+{
+	const symbol_t *s = symbol(address * 2U);
+	if (s != NULL) {
+		name = s->name;
+		return (u16)(s->start / 2U);
+	}
+	u16 entry = address;
+	while (entry > 0U && (targets[entry / 32U] & (1U << (entry % 32U))) == 0U) {
+		if (targets[entry / 32U] == 0U)
+			entry &= ~31U; // No target in the whole word
+		if (entry > 0U)
+			entry --;
+	}
+	char text[16];
+	snprintf(text, sizeof(text), "0x%05x", entry * 2U);
+	name = text;
+	return entry;
+}
+
+// Cycles of a plain instruction (avr8::plainInsn) not branching nor
+// skipping, as emulated. Opcode numbers are those of instructionList
+// (avr8.cpp).
+static unsigned int insnCycles(unsigned int op)
+{
+	switch (op)
+	{
+		case  0: // Illegal
+			return 0U;
+		case  3: // ADIW
+		case 15: // CBI
+		case 23: // FMUL
+		case 24: // FMULS
+		case 25: // FMULSU
+		case 27: // IJMP
+		case 31: case 32: case 33: case 34: case 35: case 36: case 37:
+		case 38: case 39: // LD, LDD
+		case 41: // LDS
+		case 48: // MUL
+		case 49: // MULS
+		case 50: // MULSU
+		case 56: // POP
+		case 57: // PUSH
+		case 61: // RJMP
+		case 65: // SBI
+		case 68: // SBIW
+		case 73: case 74: case 75: case 76: case 77: case 78: case 79:
+		case 80: case 81: // ST, STD
+		case 82: // STS
+			return 2U;
+		case 26: // ICALL
+		case 30: // JMP
+		case 42: case 43: case 44: // LPM
+		case 58: // RCALL
+			return 3U;
+		case 14: // CALL
+		case 59: // RET
+		case 60: // RETI
+		case 72: // SPM
+			return 4U;
+		default:
+			return 1U;
+	}
+}
+
+// Cycles spent on the instructions at each address, from their counts. A
+// branch or skip is taken as many times as the next instruction ran less
+// often.
+void Profile::derive(const instructionDecode_t *decoded, std::vector<u64> &cycles) const
+{
+	cycles.assign(progSize / 2, 0U);
+	for (u32 a = 0U; a < progSize / 2; a++) {
+		if (count[a] == 0U)
+			continue;
+		const unsigned int op = avr8::plainInsn(decoded[a].opNum);
+		const u32 next = a + avr8::get_insn_size(op);
+		const u64 taken = (next < progSize / 2 && count[next] < count[a]) ?
+		                  count[a] - count[next] : 0U;
+		cycles[a] = count[a] * insnCycles(op);
+		switch (op)
+		{
+			case  9: // BRBC
+			case 10: // BRBS
+				cycles[a] += taken;
+				break;
+			case 20: // CPSE
+			case 66: // SBIC
+			case 67: // SBIS
+			case 69: // SBRC
+			case 70: // SBRS
+				if (next < progSize / 2)
+					cycles[a] += taken * avr8::get_insn_size(decoded[next].opNum);
+				break;
+			default:
+				break;
+		}
+	}
+}
+
+struct profileRow_t {
+	u64 cycles, count;
+	std::string name;
+};
+
+static void print_rows(FILE *f, std::vector<profileRow_t> &rows, u64 total, size_t limit)
+{
+	std::sort(rows.begin(), rows.end(), [](const profileRow_t &a, const profileRow_t &b) {
+		return a.cycles > b.cycles;
+	});
+	fprintf(f, "      cycles       %%  instructions  \n");
+	for (size_t i = 0U; i < rows.size() && i < limit; i++)
+		fprintf(f, "%12llu %6.2f%% %13llu  %s\n", (unsigned long long)rows[i].cycles,
+		        (total != 0U) ? 100.0 * rows[i].cycles / total : 0.0,
+		        (unsigned long long)rows[i].count, rows[i].name.c_str());
+	fprintf(f, "\n");
+}
+
+bool Profile::report(const char *filename, const instructionDecode_t *decoded, u64 run) const
+{
+	FILE *f = fopen(filename, "w");
+	if (f == NULL)
+		return false;
+
+	std::vector<u64> cycles;
+	derive(decoded, cycles);
+	u64 attributed = 0U, totalCount = 0U;
+	for (u32 a = 0U; a < progSize / 2; a++) {
+		attributed += cycles[a];
+		totalCount += count[a];
+	}
+	// A state loaded (rewind) may have the clock go back
+	const u64 totalCycles = (run > attributed) ? run : attributed;
+	fprintf(f, "Flat profile: %llu cycles, %llu instructions\n",
+	        (unsigned long long)totalCycles, (unsigned long long)totalCount);
+	fprintf(f, "Not spent on instructions (interrupt entries, skips and branches\n"
+	        "mistaken for not taken): %llu cycles\n\n",
+	        (unsigned long long)(totalCycles - attributed));
+
+	// Functions and source lines, sums over their instructions
+	std::vector<profileRow_t> functions, sourceLines, insns;
+	std::vector<size_t> byFunction(symbols.size() + 1U, (size_t)-1);
+	std::map<std::pair<u32, u32>, size_t> byLine; // (file, line)
+	char text[96];
+	for (u32 a = 0U; a < progSize / 2; a++) {
+		if (count[a] == 0U)
+			continue;
+		const u32 address = a * 2U;
+		const symbol_t *s = symbol(address);
+		const size_t fi = (s != NULL) ? (size_t)(s - symbols.data()) : symbols.size();
+		if (byFunction[fi] == (size_t)-1) {
+			byFunction[fi] = functions.size();
+			profileRow_t row = { 0U, 0U, (s != NULL) ? s->name : "(no symbol)" };
+			functions.push_back(row);
+		}
+		functions[byFunction[fi]].cycles += cycles[a];
+		functions[byFunction[fi]].count += count[a];
+
+		const line_t *l = line(address);
+		if (l != NULL) {
+			const std::pair<u32, u32> key(l->file, l->line);
+			if (byLine.find(key) == byLine.end()) {
+				byLine[key] = sourceLines.size();
+				snprintf(text, sizeof(text), ":%u", l->line);
+				profileRow_t row = { 0U, 0U, files[l->file] + text };
+				sourceLines.push_back(row);
+			}
+			sourceLines[byLine[key]].cycles += cycles[a];
+			sourceLines[byLine[key]].count += count[a];
+		}
+
+		profileRow_t row = { cycles[a], count[a], "" };
+		snprintf(text, sizeof(text), "%05x: ", address);
+		row.name = text;
+		avr8::disassemble(decoded[a], text, sizeof(text));
+		row.name += text;
+		if (s != NULL) {
+			snprintf(text, sizeof(text), "+0x%x>", address - s->start);
+			row.name += "  <" + s->name + text;
+		}
+		insns.push_back(row);
+	}
+
+	if (!symbols.empty()) {
+		fprintf(f, "Functions:\n");
+		print_rows(f, functions, totalCycles, functions.size());
+	}
+	if (!sourceLines.empty()) {
+		fprintf(f, "Source lines:\n");
+		print_rows(f, sourceLines, totalCycles, PROFILE_TOP);
+	}
+	if (!handlers.empty()) {
+		std::vector<profileRow_t> irqs;
+		for (std::map<u16, edge_t>::const_iterator i = handlers.begin(); i != handlers.end(); ++i) {
+			profileRow_t row = { i->second.cycles, i->second.calls, "" };
+			function(i->first, row.name);
+			irqs.push_back(row);
+		}
+		fprintf(f, "Interrupts (inclusive, instructions are the times taken):\n");
+		print_rows(f, irqs, totalCycles, irqs.size());
+	}
+	fprintf(f, "Instructions:\n");
+	print_rows(f, insns, totalCycles, PROFILE_TOP);
+
+	fclose(f);
+	return true;
+}
+
+// Compressed name of the callgrind format: "(id) name" the first time,
+// then "(id)"
+static std::string compressed(std::map<std::string, size_t> &ids, const std::string &name)
+{
+	char text[16];
+	std::map<std::string, size_t>::iterator i = ids.find(name);
+	if (i != ids.end()) {
+		snprintf(text, sizeof(text), "(%u)", (unsigned int)i->second);
+		return text;
+	}
+	const size_t id = ids.size() + 1U;
+	ids[name] = id;
+	snprintf(text, sizeof(text), "(%u) ", (unsigned int)id);
+	return text + name;
+}
+
+// Writes the profile in the callgrind format. The frames still open count
+// as returning now. The cycles not spent on instructions are left out.
+bool Profile::callgrind(const char *filename, const char *program,
+                        const instructionDecode_t *decoded, u64 cycle)
+{
+	while (!stack.empty()) {
+		leave(stack.back(), cycle);
+		stack.pop_back();
+	}
+
+	FILE *f = fopen(filename, "w");
+	if (f == NULL)
+		return false;
+
+	std::vector<u64> cycles;
+	derive(decoded, cycles);
+	u64 totalCycles = 0U, totalCount = 0U;
+	for (u32 a = 0U; a < progSize / 2; a++) {
+		totalCycles += cycles[a];
+		totalCount += count[a];
+	}
+	fprintf(f, "# callgrind format\nversion: 1\ncreator: uzem\ncmd: %s\n", program);
+	fprintf(f, "positions: instr line\nevents: Cycles Instructions\n");
+	fprintf(f, "summary: %llu %llu\n\n", (unsigned long long)totalCycles,
+	        (unsigned long long)totalCount);
+
+	// Instructions and call sites by function
+	std::map<u16, std::vector<u16> > insns, sites;
+	std::map<u16, std::string> names;
+	std::string name;
+	for (u32 a = 0U; a < progSize / 2; a++) {
+		if (count[a] == 0U)
+			continue;
+		const u16 entry = function((u16)a, name);
+		names[entry] = name;
+		insns[entry].push_back((u16)a);
+	}
+	for (std::map<u32, edge_t>::const_iterator i = edges.begin(); i != edges.end(); ++i) {
+		const u16 site = (u16)(i->first >> 16);
+		const u16 entry = function(site, name);
+		names[entry] = name;
+		if (sites[entry].empty() || sites[entry].back() != site)
+			sites[entry].push_back(site);
+	}
+
+	std::map<std::string, size_t> fileIds, fnIds;
+	for (std::map<u16, std::string>::const_iterator fn = names.begin(); fn != names.end(); ++fn) {
+		const line_t *l = line(fn->first * 2U);
+		const std::string file = (l != NULL) ? files[l->file] : "???";
+		fprintf(f, "fl=%s\n", compressed(fileIds, file).c_str());
+		fprintf(f, "fn=%s\n", compressed(fnIds, fn->second).c_str());
+
+		// Exclusive cost, switching files for the lines of others (inlined)
+		std::string current = file;
+		const std::vector<u16> &own = insns[fn->first];
+		for (size_t i = 0U; i < own.size(); i++) {
+			const line_t *il = line(own[i] * 2U);
+			const std::string &at = (il != NULL) ? files[il->file] : file;
+			if (at != current) {
+				fprintf(f, "fi=%s\n", compressed(fileIds, at).c_str());
+				current = at;
+			}
+			fprintf(f, "0x%x %u %llu %llu\n", own[i] * 2U, (il != NULL) ? il->line : 0U,
+			        (unsigned long long)cycles[own[i]], (unsigned long long)count[own[i]]);
+		}
+
+		// Inclusive cost of the calls made
+		const std::vector<u16> &calls = sites[fn->first];
+		for (size_t i = 0U; i < calls.size(); i++) {
+			const line_t *sl = line(calls[i] * 2U);
+			const std::string &at = (sl != NULL) ? files[sl->file] : file;
+			if (at != current) {
+				fprintf(f, "fi=%s\n", compressed(fileIds, at).c_str());
+				current = at;
+			}
+			std::map<u32, edge_t>::const_iterator e = edges.lower_bound((u32)calls[i] << 16);
+			for (; e != edges.end() && (e->first >> 16) == calls[i]; ++e) {
+				const u16 target = (u16)e->first;
+				const line_t *tl = line(target * 2U);
+				function(target, name);
+				fprintf(f, "cfi=%s\n", compressed(fileIds, (tl != NULL) ? files[tl->file] : "???").c_str());
+				fprintf(f, "cfn=%s\n", compressed(fnIds, name).c_str());
+				fprintf(f, "calls=%llu 0x%x %u\n", (unsigned long long)e->second.calls,
+				        target * 2U, (tl != NULL) ? tl->line : 0U);
+				fprintf(f, "0x%x %u %llu\n", calls[i] * 2U, (sl != NULL) ? sl->line : 0U,
+				        (unsigned long long)e->second.cycles);
+			}
+		}
+		fprintf(f, "\n");
+	}
+
+	// Interrupt handlers as the calls of a caller of no cost of its own, so
+	// they have an inclusive cost too
+	if (!handlers.empty()) {
+		fprintf(f, "fl=%s\n", compressed(fileIds, "???").c_str());
+		fprintf(f, "fn=%s\n", compressed(fnIds, "<interrupt>").c_str());
+		for (std::map<u16, edge_t>::const_iterator i = handlers.begin(); i != handlers.end(); ++i) {
+			const line_t *tl = line(i->first * 2U);
+			function(i->first, name);
+			fprintf(f, "cfi=%s\n", compressed(fileIds, (tl != NULL) ? files[tl->file] : "???").c_str());
+			fprintf(f, "cfn=%s\n", compressed(fnIds, name).c_str());
+			fprintf(f, "calls=%llu 0x%x %u\n", (unsigned long long)i->second.calls,
+			        i->first * 2U, (tl != NULL) ? tl->line : 0U);
+			fprintf(f, "0x0 0 %llu\n", (unsigned long long)i->second.cycles);
+		}
+		fprintf(f, "\n");
+	}
+
+	fclose(f);
+	return true;
+}
@@ -0,0 +1,92 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+// Per instruction profile (--profile).
+//
+// The core variant with FEATURE_PROFILE only counts the instructions
+// executed at each flash word, skipped idle loop passes (see markIdleLoop)
+// included. The cycles are derived from the counts when the profile is
+// written: the timing of each instruction, and for the branches and skips
+// taken, the times the next instruction was not executed (exact unless it
+// is also jumped to). The cycles left, interrupt entries mostly, are
+// reported apart. On exit report() writes a flat profile: the hot functions
+// and source lines, resolved with the symbol table and the DWARF line table
+// of the game's ELF file (--elf), and the hot instructions.
+//
+// The variant also follows the calls and returns (call, ret) and interrupt
+// entries (interrupt) on a shadow stack, giving the inclusive cost of each
+// call edge in cycles, and callgrind() writes them for KCachegrind
+// (--callgrind), the calls without inclusive instruction counts.
+// Like in callgrind the exclusive cost goes to the function holding the
+// instruction: the ELF symbol or else the nearest call target before it.
+// Interrupt handlers are roots of their own, their cycles are not included
+// in the functions they interrupted; callgrind() writes them as called by
+// "<interrupt>". A frame ends on the return restoring
+// the stack pointer above it, so longjmp-like stack resets and returns
+// through pushed addresses keep the stack in order.
+
+#include "avr8.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
+class Profile {
+public:
+	Profile();
+
+	u64 count[progSize / 2];  // Instructions executed at each word address
+
+	bool loadElf(const char *filename);
+	// run: the cycles run since the profile started
+	bool report(const char *filename, const instructionDecode_t *decoded, u64 run) const;
+
+	// Call graph, word addresses, sp after the return address is pushed or
+	// popped
+	void call(u16 site, u16 target, u16 sp, u64 cycle);
+	void ret(u16 sp, u64 cycle);
+	void interrupt(u16 handler, u16 sp, u64 cycle);
+	bool callgrind(const char *filename, const char *program,
+	               const instructionDecode_t *decoded, u64 cycle);
+
+private:
+	struct symbol_t {
+		u32 start, end;           // Byte addresses, end 0 if the size is unknown
+		std::string name;
+	};
+	struct line_t {
+		u32 address;              // Byte address of the first instruction
+		u32 file;                 // Index in files
+		u32 line;                 // 0: end of a sequence, no line
+	};
+	struct frame_t {
+		u16 site;                 // Call site, PROFILE_IRQ for an interrupt
+		u16 target;
+		u16 sp;
+		u64 cycles;               // On entry
+		u64 irqCycles;            // Of the interrupts before the entry
+	};
+	struct edge_t {
+		u64 calls, cycles;        // Inclusive
+	};
+
+	void readLines(const u8 *p, const u8 *end, const u8 *lineStr, size_t lineStrSize,
+	               const u8 *str, size_t strSize);
+	const symbol_t *symbol(u32 address) const;
+	const line_t *line(u32 address) const;
+	void leave(const frame_t &frame, u64 cycle);
+	void derive(const instructionDecode_t *decoded, std::vector<u64> &cycles) const;
+	u16 function(u16 address, std::string &name) const;
+
+	std::vector<symbol_t> symbols;  // Sorted by start
+	std::vector<line_t> lines;      // Sorted by address
+	std::vector<std::string> files;
+
+	std::vector<frame_t> stack;
+	std::map<u32, edge_t> edges;    // By call site << 16 | target
+	std::map<u16, edge_t> handlers; // Interrupt handler roots
+	u32 targets[progSize / 64];     // Call targets seen, one bit each
+	u64 irqCycles;                  // Spent in interrupts, nested included
+};
+
+#endif // PROFILE_H
@@ -0,0 +1,149 @@
+#include "Resampler.h"
+
+#include <math.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+	#include <immintrin.h>
+	#define RESAMPLER_X86 1
+#endif
+
+#define RESAMPLER_BETA    7.0   // Kaiser window, about 70 dB stop band
+#define RESAMPLER_CUTOFF  0.85  // Of the Nyquist frequency of the slower rate
+
+// Filter row of the output's sub-sample position
+#define ROW(table, pos, i) \
+	((table) + (u32)(((pos) - (i)) * RESAMPLER_PHASES) * RESAMPLER_TAPS)
+
+static void kernel_c(const float *in, double pos, double step,
+                     const float *table, float *out, u32 count)
+{
+	for (u32 n = 0U; n < count; n++, pos += step) {
+		const u32 i = (u32)pos;
+		const float *h = ROW(table, pos, i);
+		const float *x = in + i;
+		float sum = 0.0f;
+		for (u32 k = 0U; k < RESAMPLER_TAPS; k++)
+			sum += x[k] * h[k];
+		out[n] = sum;
+	}
+}
+
+#ifdef RESAMPLER_X86
+__attribute__((target("sse2")))
+static void kernel_sse2(const float *in, double pos, double step,
+                        const float *table, float *out, u32 count)
+{
+	for (u32 n = 0U; n < count; n++, pos += step) {
+		const u32 i = (u32)pos;
+		const float *h = ROW(table, pos, i);
+		const float *x = in + i;
+		__m128 sum = _mm_setzero_ps();
+		for (u32 k = 0U; k < RESAMPLER_TAPS; k += 4U)
+			sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(x + k), _mm_load_ps(h + k)));
+		sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+		sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+		out[n] = _mm_cvtss_f32(sum);
+	}
+}
+
+__attribute__((target("avx2,fma")))
+static void kernel_avx2(const float *in, double pos, double step,
+                        const float *table, float *out, u32 count)
+{
+	for (u32 n = 0U; n < count; n++, pos += step) {
+		const u32 i = (u32)pos;
+		const float *h = ROW(table, pos, i);
+		const float *x = in + i;
+		__m256 sum = _mm256_setzero_ps();
+		for (u32 k = 0U; k < RESAMPLER_TAPS; k += 8U)
+			sum = _mm256_fmadd_ps(_mm256_loadu_ps(x + k), _mm256_load_ps(h + k), sum);
+		__m128 s = _mm_add_ps(_mm256_castps256_ps128(sum), _mm256_extractf128_ps(sum, 1));
+		s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+		s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+		out[n] = _mm_cvtss_f32(s);
+	}
+}
+#endif // RESAMPLER_X86
+
+// Modified Bessel function of the first kind, order 0 (Kaiser window)
+static double bessel_i0(double x)
+{
+	double sum = 1.0, term = 1.0;
+	for (unsigned int k = 1U; k < 32U; k++) {
+		term *= (x / (2.0 * k)) * (x / (2.0 * k));
+		sum += term;
+	}
+	return sum;
+}
+
+Resampler::Resampler() :
+	kernel(kernel_c), step(1.0), pos(0.0)
+{
+	init(1.0, 1.0);
+}
+
+void Resampler::init(double inRate, double outRate)
+{
+	step = inRate / outRate;
+	pos = 0.0;
+	history.assign(RESAMPLER_TAPS, 0.0f);
+
+	// Each row holds the filter for inputs at k - (TAPS / 2 - 1) - phase
+	// from the output, normalised to a gain of 1
+	const double cutoff = RESAMPLER_CUTOFF * ((outRate < inRate) ? (outRate / inRate) : 1.0);
+	const double half = RESAMPLER_TAPS / 2.0;
+	for (u32 p = 0U; p < RESAMPLER_PHASES; p++) {
+		double row[RESAMPLER_TAPS], sum = 0.0;
+		for (u32 k = 0U; k < RESAMPLER_TAPS; k++) {
+			const double t = (double)k - (half - 1.0) - (double)p / RESAMPLER_PHASES;
+			const double x = M_PI * cutoff * t;
+			const double sinc = (x != 0.0) ? (sin(x) / x) : 1.0;
+			const double w = t / half;
+			const double window = (w > -1.0 && w < 1.0) ?
+				bessel_i0(RESAMPLER_BETA * sqrt(1.0 - w * w)) / bessel_i0(RESAMPLER_BETA) : 0.0;
+			row[k] = sinc * window;
+			sum += row[k];
+		}
+		for (u32 k = 0U; k < RESAMPLER_TAPS; k++)
+			table[p][k] = (float)(row[k] / sum);
+	}
+
+	kernel = kernel_c;
+#ifdef RESAMPLER_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+		kernel = kernel_avx2;
+	else if (__builtin_cpu_supports("sse2"))
+		kernel = kernel_sse2;
+#endif // RESAMPLER_X86
+}
+
+u32 Resampler::needed(u32 count, double ratio) const
+{
+	if (count == 0U)
+		return 0U;
+	const size_t last = (size_t)(pos + (count - 1U) * step * ratio) + RESAMPLER_TAPS;
+	return (last > history.size()) ? (u32)(last - history.size()) : 0U;
+}
+
+void Resampler::run(const u8 *in, u32 inCount, float *out, u32 count, double ratio)
+{
+	const u32 need = needed(count, ratio);
+	const size_t at = history.size();
+	history.resize(at + need);
+	for (u32 i = 0U; i < need; i++) {
+		history[at + i] = (i < inCount) ? (in[i] - 128.0f) * (1.0f / 128.0f) :
+		                  history[at + i - 1U];
+	}
+
+	const double s = step * ratio;
+	kernel(history.data(), pos, s, &table[0][0], out, count);
+
+	// Keep the inputs from the first the next output uses
+	pos += count * s;
+	size_t drop = (size_t)pos;
+	if (drop > history.size())
+		drop = history.size();
+	history.erase(history.begin(), history.begin() + drop);
+	pos -= drop;
+}
@@ -0,0 +1,44 @@
+#ifndef RESAMPLER_H
+#define RESAMPLER_H
+
+// Band-limited polyphase resampler of the sound (see avr8::audio_callback).
+//
+// The 8 bit samples written to OCR2A, one per scanline (15734 Hz), are
+// converted to float at the rate of the audio device. Each output is the
+// dot product of RESAMPLER_TAPS inputs with the row of a Kaiser windowed
+// sinc filter picked by its sub-sample position, among RESAMPLER_PHASES.
+// The cutoff is below the Nyquist frequency of the slower of the two rates.
+// The dot products run in an AVX2 or SSE2 kernel when the CPU has it.
+//
+// The ratio of run() scales the input step: the rate control of the caller
+// nudges it to keep its buffer at the target fill.
+
+#include "avr8.h"
+
+#include <vector>
+
+#define RESAMPLER_TAPS    16U   // Inputs per output, a multiple of 8
+#define RESAMPLER_PHASES  256U  // Sub-sample positions of the filter
+
+class Resampler {
+public:
+	Resampler();
+
+	void init(double inRate, double outRate);
+	// Inputs run() takes for count outputs at the ratio
+	u32 needed(u32 count, double ratio) const;
+	// The inputs missing (in short of needed) repeat the last one
+	void run(const u8 *in, u32 inCount, float *out, u32 count, double ratio);
+
+	typedef void (*kernel_t)(const float *in, double pos, double step,
+	                         const float *table, float *out, u32 count);
+
+private:
+	kernel_t kernel;
+	double step;                  // Inputs per output at ratio 1
+	double pos;                   // Of the next output's first input in history
+	std::vector<float> history;   // Inputs from the first the next output uses
+	alignas(32) float table[RESAMPLER_PHASES][RESAMPLER_TAPS];
+};
+
+#endif // RESAMPLER_H
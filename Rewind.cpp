@@ -0,0 +1,238 @@
+#include "Rewind.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define LITERAL_GAP  4U   // Unchanged bytes ending a literal
+
+static inline void put_varint(std::vector<u8> &out, size_t value)
+{
+	while (value >= 0x80U) {
+		out.push_back((u8)(value | 0x80U));
+		value >>= 7;
+	}
+	out.push_back((u8)value);
+}
+
+static inline size_t get_varint(const u8 *&p)
+{
+	size_t value = 0U;
+	unsigned int shift = 0U;
+	u8 b;
+	do {
+		b = *p++;
+		value |= (size_t)(b & 0x7FU) << shift;
+		shift += 7U;
+	} while (b & 0x80U);
+	return value;
+}
+
+Rewind::Rewind(size_t budget) :
+	budget(budget), used(0U), sinceKey(0U), warned(false), head(0U), tail(0U), quit(false)
+{
+	lock = SDL_CreateMutex();
+	wake = SDL_CreateCond();
+	done = SDL_CreateCond();
+	thread = NULL;
+	if (lock != NULL && wake != NULL && done != NULL)
+		thread = SDL_CreateThread(worker_stub, "rewind", this);
+}
+
+Rewind::~Rewind()
+{
+	if (thread != NULL) {
+		SDL_LockMutex(lock);
+		quit = true;
+		SDL_CondSignal(wake);
+		SDL_UnlockMutex(lock);
+		SDL_WaitThread(thread, NULL);
+	}
+	if (done != NULL) SDL_DestroyCond(done);
+	if (wake != NULL) SDL_DestroyCond(wake);
+	if (lock != NULL) SDL_DestroyMutex(lock);
+}
+
+// Output: (unchanged count, literal count, literal bytes)... with the
+// counts as varints and the literals XOR ref (no ref: zeros)
+void Rewind::encode(const u8 *state, const u8 *ref, size_t size, std::vector<u8> &out)
+{
+	size_t pos = 0U;
+
+	out.clear();
+	while (pos < size) {
+		// Unchanged run, a word at a time where possible
+		size_t start = pos;
+		if (ref != NULL) {
+			while (pos + 8U <= size && memcmp(state + pos, ref + pos, 8U) == 0)
+				pos += 8U;
+			while (pos < size && state[pos] == ref[pos])
+				pos ++;
+		} else {
+			static const u8 zero[8] = {0};
+			while (pos + 8U <= size && memcmp(state + pos, zero, 8U) == 0)
+				pos += 8U;
+			while (pos < size && state[pos] == 0U)
+				pos ++;
+		}
+		if (pos == size)
+			break;
+		put_varint(out, pos - start);
+
+		// Literal up to LITERAL_GAP unchanged bytes in a row
+		start = pos;
+		size_t end = pos;
+		while (pos < size && (pos - end) < LITERAL_GAP) {
+			if (state[pos] != ((ref != NULL) ? ref[pos] : 0U))
+				end = pos + 1U;
+			pos ++;
+		}
+		put_varint(out, end - start);
+		for (size_t i = start; i < end; i++)
+			out.push_back(state[i] ^ ((ref != NULL) ? ref[i] : 0U));
+		pos = end;
+	}
+}
+
+// XORs the literals into state, which holds the reference
+void Rewind::decode(const std::vector<u8> &in, u8 *state, size_t size)
+{
+	const u8 *p = in.data();
+	const u8 *end = p + in.size();
+	size_t pos = 0U;
+
+	while (p < end) {
+		pos += get_varint(p);
+		size_t count = get_varint(p);
+		if (pos + count > size)
+			break;
+		for (size_t i = 0U; i < count; i++)
+			state[pos + i] ^= p[i];
+		p += count;
+		pos += count;
+	}
+}
+
+void Rewind::compress(const slot_t &slot)
+{
+	frame_t frame;
+	const u8 *state = slot.state.data();
+
+	frame.size = (u32)slot.size;
+	frame.key = history.empty() || sinceKey >= REWIND_KEY_INTERVAL ||
+	            key.size() != slot.size;
+	if (frame.key) {
+		encode(state, NULL, slot.size, frame.data);
+		key.assign(state, state + slot.size);
+		sinceKey = 0U;
+	} else {
+		encode(state, key.data(), slot.size, frame.data);
+	}
+	sinceKey ++;
+	frame.data.shrink_to_fit();
+	used += frame.data.size();
+	history.push_back(std::move(frame));
+
+	// Over budget: drop the oldest keyframe with the frames relative to it,
+	// never the one the frame just added needs
+	while (used > budget) {
+		size_t next = 1U;
+		while (next < history.size() && !history[next].key)
+			next ++;
+		if (next == history.size()) {
+			if (!warned)
+				fprintf(stderr, "Warning: The rewind buffer of %zu MB is too small, using %zu KB.\n",
+				        budget >> 20, used >> 10);
+			warned = true;
+			break;
+		}
+		for (; next != 0U; next--) {
+			used -= history.front().data.size();
+			history.pop_front();
+		}
+	}
+}
+
+void Rewind::worker()
+{
+	SDL_LockMutex(lock);
+	while (!quit) {
+		if (tail == head) {
+			SDL_CondWait(wake, lock);
+			continue;
+		}
+		// The slot is left alone by acquire() until tail moves past it
+		const slot_t &slot = pending[tail % REWIND_PENDING];
+		SDL_UnlockMutex(lock);
+		compress(slot);
+		SDL_LockMutex(lock);
+		tail ++;
+		SDL_CondSignal(done);
+	}
+	SDL_UnlockMutex(lock);
+}
+
+u8 *Rewind::acquire(size_t size)
+{
+	if (thread != NULL) {
+		SDL_LockMutex(lock);
+		const bool full = (head - tail) >= REWIND_PENDING;
+		SDL_UnlockMutex(lock);
+		if (full)
+			return NULL;
+	}
+	slot_t &slot = pending[head % REWIND_PENDING];
+	if (slot.state.size() < size)
+		slot.state.resize(size);
+	slot.size = size;
+	return slot.state.data();
+}
+
+void Rewind::commit()
+{
+	if (thread == NULL) {
+		compress(pending[head % REWIND_PENDING]);
+		head ++;
+		tail ++;
+		return;
+	}
+	SDL_LockMutex(lock);
+	head ++;
+	SDL_CondSignal(wake);
+	SDL_UnlockMutex(lock);
+}
+
+// Waits for the worker to compress the committed frames
+void Rewind::drain()
+{
+	if (thread == NULL)
+		return;
+	SDL_LockMutex(lock);
+	while (tail != head)
+		SDL_CondWait(done, lock);
+	SDL_UnlockMutex(lock);
+}
+
+const u8 *Rewind::step(size_t &size)
+{
+	// The worker is idle from here on, no commit() while rewinding
+	drain();
+	if (history.empty())
+		return NULL;
+	if (history.size() > 1U) {
+		used -= history.back().data.size();
+		history.pop_back();
+		// The keyframe may be gone, start over with a new one
+		sinceKey = REWIND_KEY_INTERVAL;
+	}
+
+	size_t k = history.size() - 1U;
+	while (!history[k].key)
+		k --;
+	const frame_t &frame = history.back();
+	current.assign(frame.size, 0U);
+	decode(history[k].data, current.data(), frame.size);
+	if (k != history.size() - 1U)
+		decode(frame.data, current.data(), frame.size);
+	size = frame.size;
+	return current.data();
+}
@@ -0,0 +1,69 @@
+#ifndef REWIND_H
+#define REWIND_H
+
+// Rewind buffer (see avr8::rewind_frame).
+//
+// The machine state is taken at the start of every frame and kept
+// compressed: a keyframe every REWIND_KEY_INTERVAL frames, and in between
+// the difference to the last keyframe. Both are stored as runs of unchanged
+// bytes and literals of the state XOR the keyframe (XOR zero for a
+// keyframe), so the SRAM and SPI RAM, which change little from frame to
+// frame, cost a few bytes. The compression runs on a worker thread, the
+// emulation only copies the state into one of the REWIND_PENDING slots.
+// The oldest frames are dropped to stay within the memory budget.
+
+#include "avr8.h"
+
+#include <deque>
+#include <vector>
+
+#define REWIND_KEY_INTERVAL  60U  // Frames per keyframe
+#define REWIND_PENDING       8U   // States queued for compression
+
+class Rewind {
+public:
+	Rewind(size_t budget);
+	~Rewind();
+
+	// Slot to save the state of the frame into, NULL if the worker fell
+	// behind (the frame is not recorded then). commit() once saved.
+	u8 *acquire(size_t size);
+	void commit();
+	// Drops the latest frame and returns the one before (the oldest one
+	// stays), NULL if there is none
+	const u8 *step(size_t &size);
+
+private:
+	struct frame_t {
+		std::vector<u8> data; // Compressed state
+		u32 size;             // Size of the state
+		bool key;             // Keyframe, else relative to the previous one
+	};
+	struct slot_t {
+		std::vector<u8> state;
+		size_t size;
+	};
+
+	static void encode(const u8 *state, const u8 *ref, size_t size, std::vector<u8> &out);
+	static void decode(const std::vector<u8> &in, u8 *state, size_t size);
+	void compress(const slot_t &slot);
+	void drain();
+	void worker();
+	static int worker_stub(void *self) { ((Rewind*)self)->worker(); return 0; }
+
+	size_t budget;              // Bytes of compressed frames to keep at most
+	size_t used;
+	std::deque<frame_t> history;
+	std::vector<u8> key;        // Last keyframe, uncompressed
+	unsigned int sinceKey;      // Frames compressed since
+	bool warned;                // The budget does not hold a keyframe group
+	std::vector<u8> current;    // State returned by step()
+	slot_t pending[REWIND_PENDING];
+	unsigned int head, tail;    // Slots committed / compressed so far
+	bool quit;
+	SDL_Thread *thread;         // NULL: compressed on commit()
+	SDL_mutex *lock;
+	SDL_cond *wake, *done;
+};
+
+#endif // REWIND_H
@@ -54,16 +54,8 @@ extern void SDWriteByte(uint8_t byte);
 extern char ascii(uint8_t val);
 
 /* bootsector jump instruction */
-unsigned char bootjmp[3] = { 0xeb, 0x3c, 0x90 };
-unsigned char oem_name[8] = "uzemSDe";
-
-static int posBootsector;
-static int posFatSector;
-static int posRootDir;
-static int posDataSector;
-static int clusterSize;
-
-static bool hexDebug=false;
+static const unsigned char bootjmp[3] = { 0xeb, 0x3c, 0x90 };
+static const unsigned char oem_name[8] = "uzemSDe";
 
 void SDEmu::debug(bool value) {
 	hexDebug = value;
@@ -321,15 +313,14 @@ uint8_t SDEmu::handleSpiByte(uint8_t byte) {
             // output a nice display to see sector data
             int i = 512-spiByteCount;
             int ofs = i&0x000F;
-            static unsigned char buf[16];
             if(i > 0 && (ofs == 0)){
                 printf("%04X: ",i-16);
-                for(int j=0; j<16; j++) printf("%02X ",buf[j]);
+                for(int j=0; j<16; j++) printf("%02X ",debugBuf[j]);
                 printf("| ");
-                for(int j=0; j<16; j++) printf("%c",ascii(buf[j]));
+                for(int j=0; j<16; j++) printf("%c",ascii(debugBuf[j]));
                 SPI_DEBUG("\n");
             }
-            buf[ofs] = response;
+            debugBuf[ofs] = response;
 	}
         #endif
         spiByteCount--;
@@ -528,12 +519,6 @@ int SDEmu::init_with_directory(const char *path) {
 }
 
 void SDEmu::read(unsigned char *ptr) {
-	static int lastfile=-1;
-	static int lastfileStart=0;
-	static int lastfileEnd=0;
-	static FILE *fp=NULL;
-	static int lastPos=0;
-
 	int pos;
 	unsigned char c;
 
@@ -26,6 +26,7 @@ THE SOFTWARE.
 #define _SDEMULATOR_H_
 
 #include <cstring>
+#include <cstdio>
 #include <stdint.h>
 
 #define SD_IDLE_STATE             0
@@ -136,6 +137,17 @@ struct SDEmu {
 		emulatedMBR = nullptr;
 		emulatedMBRLength = 0;
 		emulatedReadPos = 0xFFFFFFFF;
+		posBootsector = posFatSector = posRootDir = posDataSector = 0;
+		clusterSize = 0;
+		hexDebug = false;
+		lastfile = -1;
+		lastfileStart = lastfileEnd = 0;
+		fp = NULL;
+		lastPos = 0;
+	}
+	~SDEmu() {
+		if (fp != NULL)
+			fclose(fp);
 	}
 
 	struct fat_BS bootsector;
@@ -157,6 +169,22 @@ struct SDEmu {
 	uint32_t emulatedMBRLength;
 	uint32_t emulatedReadPos;
 
+	// Layout of the emulated card (init_with_directory)
+	int posBootsector;
+	int posFatSector;
+	int posRootDir;
+	int posDataSector;
+	int clusterSize;
+	bool hexDebug;
+
+	// File being read (read)
+	int lastfile;
+	int lastfileStart;
+	int lastfileEnd;
+	FILE *fp;
+	int lastPos;
+	unsigned char debugBuf[16]; // Sector dump (USE_SPI_DEBUG)
+
 	void chipSelectChanged(bool selected);
 	void SDBuildMBR(SDPartitionEntry* entry);
 	int init_with_directory(const char* path);
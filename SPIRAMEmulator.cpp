@@ -1,8 +1,6 @@
 #include "SPIRAMEmulator.h"
 #include <string.h>
 
-SPIRAMEmu SPIRAMemulator;
-
 void SPIRAMEmu::Reset() {
 	memset(data, 0, sizeof(data));
 	cs_active = false;
@@ -11,10 +9,12 @@ void SPIRAMEmu::Reset() {
 	cmd = 0;
 	byte = 0;
 	addr = 0;
+	used = false;
 }
 
 void SPIRAMEmu::chipSelectChanged(bool selected) {
 	cs_active = selected;
+	if (selected) used = true;
 	if (!selected) {
 		state = SPIRAM_IDLE;
 		byte = 0;
@@ -31,12 +31,10 @@ struct SPIRAMEmu {
 	uint8_t byte;
 	uint8_t data[SPIRAM_SIZE];
 	uint32_t addr;
+	bool used;           // Selected at least once (contents go in savestates)
 
 	void chipSelectChanged(bool selected);
 	uint8_t handleSpiByte(uint8_t byte);
 };
 
-// Global instance
-extern SPIRAMEmu SPIRAMemulator;
-
 #endif // SPIRAMEMULATOR_H
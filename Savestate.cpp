@@ -0,0 +1,405 @@
+// Savestate.cpp
+//
+// Save and load of the complete machine state, to memory or to a file.
+
+#include "avr8.h"
+
+#include <stdio.h>
+#include <string.h>
+
+// Savestate layout (host byte order, sizes fixed by the types below):
+//
+//   savestateHeader_t
+//   savestateCore_t       CPU, timers, scheduler and beam position
+//   r, io, sram           As laid out in avr8 (one block)
+//   eeprom
+//   savestateDevices_t    Controllers, keyboard and its queue, SPI, SD card
+//   SPI RAM contents      If SS_SPIRAM
+//   progmem               If SS_PROGMEM
+//
+// Bump SAVESTATE_VERSION on any change of the above.
+
+#define SAVESTATE_MAGIC    0x53455A55U // "UZES"
+#define SAVESTATE_VERSION  3U
+
+#define SS_SPIRAM   0x0001U // SPI RAM was selected, its contents follow
+#define SS_PROGMEM  0x0002U // SPM wrote the flash, its contents follow
+
+struct savestateHeader_t {
+	u32 magic;
+	u16 version;
+	u16 flags;
+	u32 size;                 // Of the whole state, header included
+};
+
+struct savestateCore_t {
+	u64 cycleCounter;
+	u64 prevCyclesCounter;
+	u64 lastCyclesSleep;
+	u64 prevWDR;
+	u64 timer1_start;
+	u64 watchdogStart;
+	u64 eventAt[EV_COUNT];
+	u32 elapsedCycles;
+	u32 elapsedCyclesSleep;
+	u32 prevPortB;
+	u32 watchdogTimer;
+	u32 T16_latch;
+	u32 TCNT1;
+	u32 itd_TIFR1;
+	u32 dly_out;
+	u32 dly_TCCR1B;
+	u32 dly_TCNT1L;
+	u32 dly_TCNT1H;
+	u32 lazyMask;
+	u32 lazyKind;
+	u32 lazyRd, lazyRr, lazyR;
+	u32 lazyZKind;
+	u32 lazyZR;
+	s32 scanline_count;
+	u32 left_edge_cycle;
+	u32 randomSeed;
+	u16 pc;
+	u8  pixel_raw;
+	u8  pad;
+};
+
+struct savestateDevices_t {
+	u32 buttons[2];
+	u32 latched_buttons[2];
+	// Uzebox keyboard
+	u8  uzeKbState;
+	u8  uzeKbDataOut;
+	u8  uzeKbEnabled;
+	u8  uzeKbDataIn;
+	u8  uzeKbClock;
+	// SPI port
+	u8  spiByte;
+	u8  spiTransfer;
+	u8  pad;
+	u16 spiClock;
+	u16 spiCycleWait;
+	// SD card (SDEmu)
+	s32 sdPosition;
+	u32 sdArg;
+	s32 sdByteCount;
+	s32 sdCommandDelay;
+	u32 sdReadPos;
+	u8  sdCsActive;
+	u8  sdState;
+	u8  sdCommand;
+	u8  sdArgXhi, sdArgXlo, sdArgYhi, sdArgYlo;
+	u8  sdResponse;           // spiResponsePtr, offset in the buffer
+	u8  sdResponseEnd;
+	u8  sdResponseBuffer[8];
+	u8  pad2[3];
+	// SPI RAM (SPIRAMEmu), contents apart
+	u32 ramAddr;
+	u8  ramCsActive;
+	u8  ramWriteEnabled;
+	u8  ramState;
+	u8  ramCmd;
+	u8  ramByte;
+	u8  pad3[3];
+	// Scancodes queued for the keyboard, oldest first
+	u8  kbQueued;
+	u8  kbQueue[KB_QUEUE_SIZE];
+	u8  pad4[3];
+};
+
+#define STATE_CPU_SIZE  (sizeof(r) + sizeof(io) + sizeof(sram))
+
+size_t avr8::saveStateSize()
+{
+	size_t size = sizeof(savestateHeader_t) + sizeof(savestateCore_t) +
+	              STATE_CPU_SIZE + sizeof(eeprom) + sizeof(savestateDevices_t);
+	if (SPIRAMemulator.used)
+		size += sizeof(SPIRAMemulator.data);
+	if (flashWritten)
+		size += sizeof(progmem);
+	return size;
+}
+
+// Stores the machine state, dest has to hold saveStateSize() bytes. To be
+// called between frames (or other run_until() calls), when the hot state
+// is in the members.
+size_t avr8::saveState(u8 *dest)
+{
+	u8 *p = dest;
+
+	savestateHeader_t head;
+	head.magic = SAVESTATE_MAGIC;
+	head.version = SAVESTATE_VERSION;
+	head.flags = (SPIRAMemulator.used ? SS_SPIRAM : 0U) |
+	             (flashWritten ? SS_PROGMEM : 0U);
+	head.size = (u32)saveStateSize();
+	memcpy(p, &head, sizeof(head));
+	p += sizeof(head);
+
+	savestateCore_t core;
+	memset(&core, 0, sizeof(core));
+	core.cycleCounter = cycleCounter;
+	core.prevCyclesCounter = prevCyclesCounter;
+	core.lastCyclesSleep = lastCyclesSleep;
+	core.prevWDR = prevWDR;
+	core.timer1_start = timer1_start;
+	core.watchdogStart = watchdogStart;
+	memcpy(core.eventAt, eventAt, sizeof(eventAt));
+	core.elapsedCycles = elapsedCycles;
+	core.elapsedCyclesSleep = elapsedCyclesSleep;
+	core.prevPortB = prevPortB;
+	core.watchdogTimer = watchdogTimer;
+	core.T16_latch = T16_latch;
+	core.TCNT1 = TCNT1;
+	core.itd_TIFR1 = itd_TIFR1;
+	core.dly_out = dly_out;
+	core.dly_TCCR1B = dly_TCCR1B;
+	core.dly_TCNT1L = dly_TCNT1L;
+	core.dly_TCNT1H = dly_TCNT1H;
+	core.lazyMask = lazyMask;
+	core.lazyKind = lazyKind;
+	core.lazyRd = lazyRd;
+	core.lazyRr = lazyRr;
+	core.lazyR = lazyR;
+	core.lazyZKind = lazyZKind;
+	core.lazyZR = lazyZR;
+	core.scanline_count = scanline_count;
+	core.left_edge_cycle = left_edge_cycle;
+	core.randomSeed = randomSeed;
+	core.pc = pc;
+	core.pixel_raw = pixel_raw;
+	memcpy(p, &core, sizeof(core));
+	p += sizeof(core);
+
+	memcpy(p, r, STATE_CPU_SIZE);
+	p += STATE_CPU_SIZE;
+	memcpy(p, eeprom, sizeof(eeprom));
+	p += sizeof(eeprom);
+
+	savestateDevices_t dev;
+	memset(&dev, 0, sizeof(dev));
+	memcpy(dev.buttons, buttons, sizeof(buttons));
+	memcpy(dev.latched_buttons, latched_buttons, sizeof(latched_buttons));
+	dev.uzeKbState = uzeKbState;
+	dev.uzeKbDataOut = uzeKbDataOut;
+	dev.uzeKbEnabled = uzeKbEnabled;
+	dev.uzeKbDataIn = uzeKbDataIn;
+	dev.uzeKbClock = uzeKbClock;
+	dev.spiByte = spiByte;
+	dev.spiTransfer = spiTransfer;
+	dev.spiClock = spiClock;
+	dev.spiCycleWait = spiCycleWait;
+	dev.sdPosition = SDemulator.position;
+	dev.sdArg = SDemulator.spiArg;
+	dev.sdByteCount = SDemulator.spiByteCount;
+	dev.sdCommandDelay = SDemulator.spiCommandDelay;
+	dev.sdReadPos = SDemulator.emulatedReadPos;
+	dev.sdCsActive = SDemulator.cs_active;
+	dev.sdState = SDemulator.spiState;
+	dev.sdCommand = SDemulator.spiCommand;
+	dev.sdArgXhi = SDemulator.spiArgXhi;
+	dev.sdArgXlo = SDemulator.spiArgXlo;
+	dev.sdArgYhi = SDemulator.spiArgYhi;
+	dev.sdArgYlo = SDemulator.spiArgYlo;
+	if (SDemulator.spiResponsePtr != NULL) {
+		dev.sdResponse = (u8)(SDemulator.spiResponsePtr - SDemulator.spiResponseBuffer);
+		dev.sdResponseEnd = (u8)(SDemulator.spiResponseEnd - SDemulator.spiResponseBuffer);
+	}
+	memcpy(dev.sdResponseBuffer, SDemulator.spiResponseBuffer, sizeof(dev.sdResponseBuffer));
+	dev.ramAddr = SPIRAMemulator.addr;
+	dev.ramCsActive = SPIRAMemulator.cs_active;
+	dev.ramWriteEnabled = SPIRAMemulator.write_enabled;
+	dev.ramState = SPIRAMemulator.state;
+	dev.ramCmd = SPIRAMemulator.cmd;
+	dev.ramByte = SPIRAMemulator.byte;
+	queue<u8> kbQueue = uzeKbScanCodeQueue;
+	while (!kbQueue.empty() && dev.kbQueued < KB_QUEUE_SIZE) {
+		dev.kbQueue[dev.kbQueued++] = kbQueue.front();
+		kbQueue.pop();
+	}
+	memcpy(p, &dev, sizeof(dev));
+	p += sizeof(dev);
+
+	if (head.flags & SS_SPIRAM) {
+		memcpy(p, SPIRAMemulator.data, sizeof(SPIRAMemulator.data));
+		p += sizeof(SPIRAMemulator.data);
+	}
+	if (head.flags & SS_PROGMEM) {
+		memcpy(p, progmem, sizeof(progmem));
+		p += sizeof(progmem);
+	}
+
+	return p - dest;
+}
+
+// Restores a state stored by saveState(). Returns false without changing
+// anything if it is not a valid state of this version.
+bool avr8::loadState(const u8 *src, size_t size)
+{
+	const u8 *p = src;
+	savestateHeader_t head;
+
+	if (size < sizeof(head))
+		return false;
+	memcpy(&head, p, sizeof(head));
+	p += sizeof(head);
+	if (head.magic != SAVESTATE_MAGIC || head.version != SAVESTATE_VERSION)
+		return false;
+	size_t expected = sizeof(head) + sizeof(savestateCore_t) + STATE_CPU_SIZE +
+	                  sizeof(eeprom) + sizeof(savestateDevices_t);
+	if (head.flags & SS_SPIRAM)
+		expected += sizeof(SPIRAMemulator.data);
+	if (head.flags & SS_PROGMEM)
+		expected += sizeof(progmem);
+	if (head.size != expected || size < expected)
+		return false;
+
+	savestateCore_t core;
+	memcpy(&core, p, sizeof(core));
+	p += sizeof(core);
+	cycleCounter = core.cycleCounter;
+	prevCyclesCounter = core.prevCyclesCounter;
+	lastCyclesSleep = core.lastCyclesSleep;
+	prevWDR = core.prevWDR;
+	timer1_start = core.timer1_start;
+	watchdogStart = core.watchdogStart;
+	memcpy(eventAt, core.eventAt, sizeof(eventAt));
+	elapsedCycles = core.elapsedCycles;
+	elapsedCyclesSleep = core.elapsedCyclesSleep;
+	prevPortB = core.prevPortB;
+	watchdogTimer = core.watchdogTimer;
+	T16_latch = core.T16_latch;
+	TCNT1 = core.TCNT1;
+	itd_TIFR1 = core.itd_TIFR1;
+	dly_out = core.dly_out;
+	dly_TCCR1B = core.dly_TCCR1B;
+	dly_TCNT1L = core.dly_TCNT1L;
+	dly_TCNT1H = core.dly_TCNT1H;
+	lazyMask = core.lazyMask;
+	lazyKind = core.lazyKind;
+	lazyRd = core.lazyRd;
+	lazyRr = core.lazyRr;
+	lazyR = core.lazyR;
+	lazyZKind = core.lazyZKind;
+	lazyZR = core.lazyZR;
+	scanline_count = core.scanline_count;
+	left_edge_cycle = core.left_edge_cycle;
+	randomSeed = core.randomSeed;
+	pc = currentPc = core.pc;
+	pixel_raw = core.pixel_raw;
+
+	memcpy(r, p, STATE_CPU_SIZE);
+	p += STATE_CPU_SIZE;
+	memcpy(eeprom, p, sizeof(eeprom));
+	p += sizeof(eeprom);
+
+	savestateDevices_t dev;
+	memcpy(&dev, p, sizeof(dev));
+	p += sizeof(dev);
+	memcpy(buttons, dev.buttons, sizeof(buttons));
+	memcpy(latched_buttons, dev.latched_buttons, sizeof(latched_buttons));
+	uzeKbState = dev.uzeKbState;
+	uzeKbDataOut = dev.uzeKbDataOut;
+	uzeKbEnabled = dev.uzeKbEnabled;
+	uzeKbDataIn = dev.uzeKbDataIn;
+	uzeKbClock = dev.uzeKbClock;
+	while (!uzeKbScanCodeQueue.empty())
+		uzeKbScanCodeQueue.pop();
+	for (u32 i = 0U; i < dev.kbQueued && i < KB_QUEUE_SIZE; i++)
+		uzeKbScanCodeQueue.push(dev.kbQueue[i]);
+	spiByte = dev.spiByte;
+	spiTransfer = dev.spiTransfer;
+	spiClock = dev.spiClock;
+	spiCycleWait = dev.spiCycleWait;
+	SDemulator.position = dev.sdPosition;
+	SDemulator.spiArg = dev.sdArg;
+	SDemulator.spiByteCount = dev.sdByteCount;
+	SDemulator.spiCommandDelay = dev.sdCommandDelay;
+	SDemulator.emulatedReadPos = dev.sdReadPos;
+	SDemulator.cs_active = dev.sdCsActive;
+	SDemulator.spiState = dev.sdState;
+	SDemulator.spiCommand = dev.sdCommand;
+	SDemulator.spiArgXhi = dev.sdArgXhi;
+	SDemulator.spiArgXlo = dev.sdArgXlo;
+	SDemulator.spiArgYhi = dev.sdArgYhi;
+	SDemulator.spiArgYlo = dev.sdArgYlo;
+	memcpy(SDemulator.spiResponseBuffer, dev.sdResponseBuffer, sizeof(dev.sdResponseBuffer));
+	SDemulator.spiResponsePtr = SDemulator.spiResponseBuffer + (dev.sdResponse & 7U);
+	SDemulator.spiResponseEnd = SDemulator.spiResponseBuffer + (dev.sdResponseEnd & 7U);
+	SDemulator.lastPos = -2; // Seek on the next read of the open file
+	SPIRAMemulator.addr = dev.ramAddr;
+	SPIRAMemulator.cs_active = dev.ramCsActive;
+	SPIRAMemulator.write_enabled = dev.ramWriteEnabled;
+	SPIRAMemulator.state = dev.ramState;
+	SPIRAMemulator.cmd = dev.ramCmd;
+	SPIRAMemulator.byte = dev.ramByte;
+
+	if (head.flags & SS_SPIRAM) {
+		memcpy(SPIRAMemulator.data, p, sizeof(SPIRAMemulator.data));
+		p += sizeof(SPIRAMemulator.data);
+		SPIRAMemulator.used = true;
+	} else if (SPIRAMemulator.used) {
+		memset(SPIRAMemulator.data, 0, sizeof(SPIRAMemulator.data));
+		SPIRAMemulator.used = false;
+	}
+	if (head.flags & SS_PROGMEM) {
+		// Run-ahead and rewind mostly restore the flash as it is: the
+		// analysis and translation of the program stay
+		if (!flashWritten || memcmp(progmem, p, sizeof(progmem)) != 0) {
+			if (!flashWritten)
+				keep_rom();
+			memcpy(progmem, p, sizeof(progmem));
+			flashWritten = true;
+			flashModified = false;
+			decodeFlash();
+		}
+		p += sizeof(progmem);
+	} else if (flashWritten && !romImage.empty()) {
+		// From before the first SPM: back to the program as loaded
+		memcpy(progmem, romImage.data(), sizeof(progmem));
+		flashWritten = false;
+		flashModified = false;
+		decodeFlash();
+	}
+
+	// Derived state: the scheduler, the idle loop detection and the
+	// pixel changes not rendered yet
+	schedule(EV_TIMER1, eventAt[EV_TIMER1]);
+	idlePc = IDLE_NONE;
+	pixelHead = pixelTail = 0U;
+	pixelTailValue = pixel_raw;
+	return true;
+}
+
+bool avr8::saveStateFile(const char *filename)
+{
+	const size_t size = saveStateSize();
+	u8 *buf = new u8[size];
+	saveState(buf);
+
+	FILE *f = fopen(filename, "wb");
+	bool ok = (f != NULL) && (fwrite(buf, 1, size, f) == size);
+	if (f != NULL && fclose(f) != 0)
+		ok = false;
+	delete[] buf;
+	return ok;
+}
+
+bool avr8::loadStateFile(const char *filename)
+{
+	FILE *f = fopen(filename, "rb");
+	if (f == NULL)
+		return false;
+	fseek(f, 0L, SEEK_END);
+	long size = ftell(f);
+	rewind(f);
+	if (size <= 0) {
+		fclose(f);
+		return false;
+	}
+	u8 *buf = new u8[size];
+	bool ok = fread(buf, 1, size, f) == (size_t)size && loadState(buf, size);
+	fclose(f);
+	delete[] buf;
+	return ok;
+}
@@ -3,40 +3,45 @@
 #include <cstdlib>
 #include <cstdio>
 #include <SDL2/SDL.h>
-#include "avr8.h"   // for u8, u32, SCALER_NONE, SCALER_BASE_MASK, etc.
 
-
-int SCREEN_WIDTH  = 0;
-int SCREEN_HEIGHT = 0;
-
-// -- Define the one copy of each global declared extern in Scaler.h --
-int  initial_scaler_mode   = SCALER_NONE;
-ScalerFunc activeScaler    = nullptr;
-int  scaleFactor           = 1;
+Scaler::Scaler(SDL_Surface *surface, SDL_Renderer *renderer) :
+    surface(surface), renderer(renderer), scaledTexture(nullptr),
+    activeScaler(nullptr), currentTextureScale(1), scaleFactor(1),
 #ifdef ENABLE_CRT
-int  crtEffectEnabled      = 0;
+    crtEffectEnabled(0),
 #endif
-u32 *scale_buffer          = nullptr;
-size_t scale_buffer_size   = 0;
-int  lastMode              = 0;
+    scale_buffer(nullptr), scale_buffer_size(0), lastMode(0)
 #ifdef ENABLE_SCALE4X
-u32 *scale4x_tmp           = nullptr;
-size_t scale4x_tmp_size    = 0;
+    , scale4x_tmp(nullptr), scale4x_tmp_size(0)
 #endif
+{
+}
 
-void ApplyScalerIfNeeded() {
+Scaler::~Scaler() {
+    free(scale_buffer);
+#ifdef ENABLE_SCALE4X
+    free(scale4x_tmp);
+#endif
+    if (scaledTexture) SDL_DestroyTexture(scaledTexture);
+}
+
+void Scaler::ApplyScalerIfNeeded() {
     if (!activeScaler || !scale_buffer) return;
+    Scale((const u32*)surface->pixels, scale_buffer);
+    SDL_UpdateTexture(scaledTexture, nullptr, scale_buffer, surface->w * scaleFactor * sizeof(u32));
+}
+
+void Scaler::Scale(const u32 *src, u32 *dst) {
     int w = surface->w;
     int h = surface->h;
-    activeScaler((u32*)surface->pixels, w, h, scale_buffer);
+    (this->*activeScaler)((u32*)src, w, h, dst);
 #ifdef ENABLE_CRT
     if (crtEffectEnabled)
-        ApplyCRTEffect(scale_buffer, w * scaleFactor, h * scaleFactor);
+        ApplyCRTEffect(dst, w * scaleFactor, h * scaleFactor);
 #endif
-    SDL_UpdateTexture(scaledTexture, nullptr, scale_buffer, w * scaleFactor * sizeof(u32));
 }
 
-void SetScaler(int mode) {
+void Scaler::SetScaler(int mode) {
     if (!surface || surface->w == 0 || surface->h == 0) return;
 	
     if (mode == lastMode) return;
@@ -57,7 +62,7 @@ void SetScaler(int mode) {
             break;
 #ifdef ENABLE_SCALE2X
         case SCALER_SCALE2X:
-            activeScaler        = ApplyScale2x;
+            activeScaler        = &Scaler::ApplyScale2x;
             scaleFactor         = 2;
             scale_buffer_size   = (size_t)w * 2 * h * 2;
             scale_buffer        = (u32*)malloc(scale_buffer_size * sizeof(u32));
@@ -65,7 +70,7 @@ void SetScaler(int mode) {
 #endif
 #ifdef ENABLE_SCALE3X
         case SCALER_SCALE3X:
-            activeScaler        = ApplyScale3x;
+            activeScaler        = &Scaler::ApplyScale3x;
             scaleFactor         = 3;
             scale_buffer_size   = (size_t)w * 3 * h * 3;
             scale_buffer        = (u32*)malloc(scale_buffer_size * sizeof(u32));
@@ -73,7 +78,7 @@ void SetScaler(int mode) {
 #endif
 #ifdef ENABLE_SCALE4X
         case SCALER_SCALE4X:
-            activeScaler        = ApplyScale4x;
+            activeScaler        = &Scaler::ApplyScale4x;
             scaleFactor         = 4;
             scale4x_tmp_size    = (size_t)w * 2 * h * 2;
             scale4x_tmp         = (u32*)malloc(scale4x_tmp_size * sizeof(u32));
@@ -97,7 +102,7 @@ void SetScaler(int mode) {
     }
 }
 
-int NextScaler() {
+int Scaler::NextScaler() {
     static const int modes[] = {
         SCALER_NONE,
 #ifdef ENABLE_SCALE2X
@@ -125,7 +130,7 @@ int NextScaler() {
 }
 
 #ifdef ENABLE_SCALE2X
-void ApplyScale2x(u32 *src, int w, int h, u32 *dst) {
+void Scaler::ApplyScale2x(u32 *src, int w, int h, u32 *dst) {
     for (int y = 0; y < h; ++y) {
         for (int x = 0; x < w; ++x) {
             u32 A = src[(y>0?y-1:y)*w + x];
@@ -146,7 +151,7 @@ void ApplyScale2x(u32 *src, int w, int h, u32 *dst) {
 #endif
 
 #ifdef ENABLE_SCALE3X
-void ApplyScale3x(u32 *src, int w, int h, u32 *dst) {
+void Scaler::ApplyScale3x(u32 *src, int w, int h, u32 *dst) {
     for (int y = 1; y < h-1; ++y) {
         for (int x = 1; x < w-1; ++x) {
             u32 A = src[(y-1)*w + (x-1)];
@@ -177,7 +182,7 @@ void ApplyScale3x(u32 *src, int w, int h, u32 *dst) {
 #endif
 
 #ifdef ENABLE_SCALE4X
-void ApplyScale4x(u32 *src, int w, int h, u32 *dst) {
+void Scaler::ApplyScale4x(u32 *src, int w, int h, u32 *dst) {
     if (!scale4x_tmp) return;
     ApplyScale2x(src,           w,   h,   scale4x_tmp);
     ApplyScale2x(scale4x_tmp,  w*2, h*2, dst);
@@ -185,7 +190,7 @@ void ApplyScale4x(u32 *src, int w, int h, u32 *dst) {
 #endif
 
 #ifdef ENABLE_CRT
-void ApplyCRTEffect(u32 *buf, int w, int h) {
+void Scaler::ApplyCRTEffect(u32 *buf, int w, int h) {
     for (int y = 0; y < h; ++y) {
         for (int x = 0; x < w; ++x) {
             u32 *px = &buf[y*w + x];
@@ -2,7 +2,11 @@
 #define SCALER_H
 
 #include <SDL2/SDL.h>
-#include "avr8.h"   // for u32
+#include <stddef.h>
+#include <stdint.h>
+
+typedef uint32_t u32;
+typedef uint8_t u8;
 
 // ————————————————————————————————
 // Scaler mode bits
@@ -31,49 +35,67 @@
 // ————————————————————————————————
 // Scaler function type
 // ————————————————————————————————
-typedef void (*ScalerFunc)(u32 *src, int w, int h, u32 *dst);
+class Scaler;
+typedef void (Scaler::*ScalerFunc)(u32 *src, int w, int h, u32 *dst);
 
 // ————————————————————————————————
-// Globals (defined once in Scaler.cpp)
+// Scaler state, one per emulator instance (avr8::scaler)
 // ————————————————————————————————
-extern int           initial_scaler_mode;
-extern int           SCREEN_WIDTH;         // width before scaling
-extern int           SCREEN_HEIGHT;        // height before scaling
-extern ScalerFunc    activeScaler;         // current scaler function
-extern int           currentTextureScale;  // current factor (1,2,3,4)
-extern SDL_Surface  *surface;              // source surface
-extern SDL_Renderer *renderer;             // SDL renderer
-extern SDL_Texture  *scaledTexture;        // streaming GL texture for output
+class Scaler {
+public:
+    Scaler(SDL_Surface *surface, SDL_Renderer *renderer);
+    ~Scaler();
 
-// ————————————————————————————————
-// API
-// ————————————————————————————————
-/// Apply the active scaler (and CRT effect) to surface→pixels and upload to scaledTexture
-void ApplyScalerIfNeeded();
+    /// Apply the active scaler (and CRT effect) to surface→pixels and upload to scaledTexture
+    void ApplyScalerIfNeeded();
 
-/// Switch to a new scaler mode (e.g. SCALER_SCALE2X|SCALER_CRT)
-void SetScaler(int mode);
+    /// Apply the active scaler (and CRT effect) to src, a frame the size of surface,
+    /// into dst (currentTextureScale² times as large). No SDL call: any thread may run it
+    void Scale(const u32 *src, u32 *dst);
 
-/// Cycle to the next scaler mode and return it
-int NextScaler();
+    /// Switch to a new scaler mode (e.g. SCALER_SCALE2X|SCALER_CRT)
+    void SetScaler(int mode);
 
-// ————————————————————————————————
-// Scaler implementations
-// ————————————————————————————————
+    /// Cycle to the next scaler mode and return it
+    int NextScaler();
+
+    SDL_Surface  *surface;              // source surface
+    SDL_Renderer *renderer;             // SDL renderer
+    SDL_Texture  *scaledTexture;        // streaming GL texture for output
+    ScalerFunc    activeScaler;         // current scaler function
+    int           currentTextureScale;  // current factor (1,2,3,4)
+
+private:
+    int     scaleFactor;
+#ifdef ENABLE_CRT
+    int     crtEffectEnabled;
+#endif
+    u32    *scale_buffer;
+    size_t  scale_buffer_size;
+    int     lastMode;
+#ifdef ENABLE_SCALE4X
+    u32    *scale4x_tmp;
+    size_t  scale4x_tmp_size;
+#endif
+
+    // ————————————————————————————————
+    // Scaler implementations
+    // ————————————————————————————————
 #ifdef ENABLE_SCALE2X
-void ApplyScale2x(u32 *src, int w, int h, u32 *dst);
+    void ApplyScale2x(u32 *src, int w, int h, u32 *dst);
 #endif
 
 #ifdef ENABLE_SCALE3X
-void ApplyScale3x(u32 *src, int w, int h, u32 *dst);
+    void ApplyScale3x(u32 *src, int w, int h, u32 *dst);
 #endif
 
 #ifdef ENABLE_SCALE4X
-void ApplyScale4x(u32 *src, int w, int h, u32 *dst);
+    void ApplyScale4x(u32 *src, int w, int h, u32 *dst);
 #endif
 
 #ifdef ENABLE_CRT
-void ApplyCRTEffect(u32 *buf, int w, int h);
+    void ApplyCRTEffect(u32 *buf, int w, int h);
 #endif
+};
 
 #endif // SCALER_H
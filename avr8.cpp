@@ -51,13 +51,14 @@ More info at uzebox.org
 #include "logo.h"
 #include "SPIRAMEmulator.h"
 #include "SDEmulator.h"
-#include "Scaler.h"
-
-#ifdef ENABLE_SCALER
-SDL_Texture *scaledTexture = nullptr;
-int currentTextureScale = 1;
-SDL_Renderer *renderer = nullptr;
-SDL_Surface *surface = nullptr;
+#include "Presenter.h"
+#include "Analysis.h"
+#include "Rewind.h"
+#include "Movie.h"
+#include "Profile.h"
+#include "Resampler.h"
+#ifdef ENABLE_JIT
+    #include "JIT.h"
 #endif
 
 using namespace std;
@@ -127,6 +128,10 @@ using namespace std;
 #define DELAY16MS			457142	//in cpu cycles
 #define HSYNC_HALF_PERIOD 	910		//in cpu cycles
 #define HSYNC_PERIOD 		1820	//in cpu cycles
+#define CPU_CLOCK			28636360ULL	//cycles per second
+#define PACE_RESYNC			10U		//late or early by 1/10 s: start over
+#define FRAME_CYCLES_MAX	(2 * 262 * HSYNC_PERIOD)	// run_frame limit if no frame completes
+#define GDB_POLL_CYCLES		(16 * HSYNC_PERIOD)		// gdb connection polling while running (~1ms)
 
 static const char* joySettingsFilename = "joystick-settings";
 
@@ -156,6 +161,209 @@ static const char* joySettingsFilename = "joystick-settings";
 #define DLY_TCNT1      0x0002U
 
 
+// Instruction dispatch. With GCC compatible compilers run_until() uses threaded
+// code: every handler ends fetching the next instruction and jumping
+// straight to its handler through a label table, so the branch predictor
+// gets one indirect jump per handler instead of one shared by the whole
+// switch. Define NO_THREADED_DISPATCH to fall back to the plain switch.
+#if defined(__GNUC__) && !defined(NO_THREADED_DISPATCH)
+	#define THREADED_DISPATCH 1
+#endif
+
+// Branch hint for the rare paths of the per-cycle hardware update
+#ifdef __GNUC__
+	#define UNLIKELY(x) __builtin_expect(!!(x), 0)
+#else
+	#define UNLIKELY(x) (x)
+#endif
+
+#define INSN(n)    case n: insn_##n
+
+// Breakpoints are flagged in the decoded instructions (see setBreakpoint),
+// so only the debugger variant has to test for them, once per fetch
+#ifndef NOGDB
+	#define BREAK_CHECK \
+		if ((F & FEATURE_GDB) && (opNum & OP_BREAKPOINT)) \
+			goto break_hit
+#else
+	#define BREAK_CHECK
+#endif // NOGDB
+
+#ifdef THREADED_DISPATCH
+	#define END_INSN \
+		UPDATE_HARDWARE; \
+		UPDATE_HARDWARE_INS; \
+		if (cycleCounter >= stop) \
+			goto exec_end; \
+		JIT_DISPATCH; \
+		currentPc=pc; \
+		PROFILE_INSN; \
+		insnDecoded = progmemDecoded[pc]; \
+		opNum  = insnDecoded.opNum; \
+		arg1_8 = insnDecoded.arg1; \
+		arg2_8 = insnDecoded.arg2; \
+		pc++; \
+		BREAK_CHECK; \
+		goto *insnTable[opNum]
+#else
+	#define END_INSN   break
+#endif
+
+// Profile (FEATURE_PROFILE) of the instruction just fetched, only counted:
+// the totals and the cycles are derived from the counts (see Profile)
+#define PROFILE_INSN \
+	if (F & FEATURE_PROFILE) \
+		profile->count[currentPc] ++
+// Call graph of the profile, after the instruction changed pc and SP
+#define PROFILE_CALL \
+	if (F & FEATURE_PROFILE) \
+		profile->call(currentPc, pc, SP, cycleCounter)
+#define PROFILE_RET \
+	if (F & FEATURE_PROFILE) \
+		profile->ret(SP, cycleCounter)
+
+// Ends the first instruction of a fused pair (superinstruction, see
+// fuseInsn). This is END_INSN, except that the second instruction is
+// fetched for the handler to jump to directly. If the first instruction
+// ended the budget or an interrupt was taken, dispatch proceeds normally.
+#define FUSE_NEXT \
+	UPDATE_HARDWARE; \
+	UPDATE_HARDWARE_INS; \
+	if (cycleCounter >= stop) \
+		goto exec_end; \
+	if (pc != (u16)(currentPc + 1U)) \
+		goto next_insn; \
+	currentPc=pc; \
+	PROFILE_INSN; \
+	insnDecoded = progmemDecoded[pc]; \
+	opNum  = insnDecoded.opNum; \
+	arg1_8 = insnDecoded.arg1; \
+	arg2_8 = insnDecoded.arg2; \
+	pc++
+
+// Hot state. run_until() keeps pc, currentPc, cycleCounter and pixel_raw
+// in locals shadowing the members, so they may stay in host registers
+// across instructions: every store to the register file or SRAM would
+// otherwise force the compiler to reload them (u8 stores may alias
+// anything). The members are only synced around calls which use them: I/O
+// register accesses, scheduled events, interrupts and translated blocks.
+// HOT_LOAD also picks up the next scheduled event, a changed deadline
+// (run_frame) and whether update_hardware_ins() has anything to do.
+#define HOT_SAVE \
+	this->pc = pc; \
+	this->currentPc = currentPc; \
+	this->cycleCounter = cycleCounter; \
+	this->pixel_raw = pixel_raw
+#define HOT_LOAD \
+	pc = this->pc; \
+	currentPc = this->currentPc; \
+	cycleCounter = this->cycleCounter; \
+	pixel_raw = this->pixel_raw; \
+	nextEvent = this->nextEvent; \
+	stop = deadline; \
+	insPending = hardware_ins_pending()
+
+// update_hardware() on the hot state. Events only touch Timer1 (which may
+// raise an interrupt flag) or are left to update_hardware_ins(), which has
+// a look after each of them.
+#define UPDATE_HARDWARE \
+	do { \
+		cycleCounter ++; \
+		if (UNLIKELY(cycleCounter >= nextEvent)) \
+		{ \
+			this->cycleCounter = cycleCounter; \
+			run_events(); \
+			nextEvent = this->nextEvent; \
+			insPending = true; \
+		} \
+	} while (0)
+
+// update_hardware_ins() on the hot state, only called when it has work.
+// Anything it does may change what an idle loop reads (see IDLE_LOOP).
+#define UPDATE_HARDWARE_INS \
+	do { \
+		if (UNLIKELY(insPending)) \
+		{ \
+			idlePc = IDLE_NONE; \
+			HOT_SAVE; \
+			update_hardware_ins(); \
+			HOT_LOAD; \
+		} \
+	} while (0)
+
+// Idle loop fast-forward, run by the instruction deciding whether an idle
+// loop goes on (see markIdleLoop) before it executes. The loop body only
+// writes registers and SREG, so if these are the same as on the previous
+// pass, and nothing but the loop ran since, every further pass is the same
+// until an event or an interrupt changes what the loop reads: these passes
+// are skipped at once by idle_forward().
+#define IDLE_LOOP \
+	do { \
+		flags_sync(); \
+		if (idlePc == currentPc && idleSREG == SREG && \
+		    memcmp(idleRegs, r, sizeof(idleRegs)) == 0) \
+		{ \
+			HOT_SAVE; \
+			idle_forward(); \
+			HOT_LOAD; \
+		} \
+		else \
+		{ \
+			idlePc = currentPc; \
+			idleSREG = SREG; \
+			memcpy(idleRegs, r, sizeof(idleRegs)); \
+		} \
+		idleCycle = cycleCounter; \
+	} while (0)
+
+// Skipping the RJMP closing an idle loop, which leaves it
+#define IDLE_SKIP \
+	do { \
+		idlePc = IDLE_NONE; \
+		UPDATE_HARDWARE; \
+		pc ++; \
+	} while (0)
+
+// Data space accesses. SRAM is accessed directly, the rest may involve I/O
+// registers which see the hot state.
+#define READ_DATA(dest, addr) \
+	do { \
+		u16 daddr = (addr); \
+		if (daddr >= SRAMBASE) \
+		{ \
+			dest = read_sram(daddr); \
+		} \
+		else \
+		{ \
+			HOT_SAVE; \
+			dest = read_sram_io(daddr); \
+		} \
+	} while (0)
+#define WRITE_DATA(addr, value) \
+	do { \
+		u16 daddr = (addr); \
+		if (daddr >= SRAMBASE) \
+		{ \
+			write_sram(daddr, value); \
+		} \
+		else \
+		{ \
+			HOT_SAVE; \
+			write_sram_io(daddr, value); \
+			HOT_LOAD; \
+		} \
+	} while (0)
+
+// Translated blocks are entered on instruction dispatch (see jit_exec),
+// except while profiling: they would hide the instructions
+#ifdef ENABLE_JIT
+	#define JIT_DISPATCH \
+		if (!(F & FEATURE_PROFILE) && jit->entry[pc] != 0U) goto jit_block
+#else
+	#define JIT_DISPATCH
+#endif
+
+
 // Masks for SREG bits, use to combine them
 #define SREG_IM (1U << SREG_I)
 #define SREG_TM (1U << SREG_T)
@@ -202,15 +410,6 @@ inline static void store_bit_1(u8 &dest, unsigned int bit, unsigned int value)
 #define BORROWS		(~Rd&Rr)|(Rr&R)|(R&~Rd)
 #define CARRIES		((Rd&Rr)|(Rr&~R)|(~R&Rd))
 
-#define UPDATE_HC_SUB \
-	CH = BORROWS; \
-	set_bit_1(SREG, SREG_H, (CH & 0x08U) >> 3); \
-	set_bit_1(SREG, SREG_C, (CH & 0x80U) >> 7);
-#define UPDATE_HC_ADD \
-	CH = CARRIES; \
-	set_bit_1(SREG, SREG_H, (CH & 0x08U) >> 3); \
-	set_bit_1(SREG, SREG_C, (CH & 0x80U) >> 7);
-
 #define UPDATE_H		set_bit_1(SREG, SREG_H, (CARRIES & 0x8) >> 3)
 #define UPDATE_Z		set_bit_inv(SREG, SREG_Z, R)
 #define UPDATE_V_ADD	set_bit_1(SREG, SREG_V, (((Rd&Rr&~R)|(~Rd&~Rr&R)) & 0x80) >> 7)
@@ -239,6 +438,50 @@ inline static void store_bit_1(u8 &dest, unsigned int bit, unsigned int value)
 
 #define SET_C		(SREG |= (1<<SREG_C))
 
+// Lazy flag evaluation. Arithmetic and logic instructions don't compute
+// their SREG bits, they only record the operands, the result and which kind
+// of operation produced them. The bits listed in lazyMask are then derived
+// by flags_eval() when something actually reads them (a conditional branch,
+// an instruction consuming C, an IN / LD from SREG or the debugger). Most
+// flag results are overwritten before being looked at, so this saves the
+// bulk of the flag computation work. Bits not in lazyMask are held in SREG.
+//
+// Two records are kept: the last arithmetic operation (lazyKind, lazyRd,
+// lazyRr, lazyR) for C and H, and the last flag producing operation
+// (lazyZKind, lazyZR) for Z, N, V and S. This way logic instructions and
+// INC / DEC, which leave C and H alone, never have to evaluate the previous
+// carries. V of arithmetic kinds comes from the first record, which is
+// always from the same instruction then.
+#define LF_ADD		0U	// H C from carries, V from add overflow
+#define LF_SUB		1U	// H C from borrows, V from sub overflow
+#define LF_LOGIC	2U	// V cleared
+#define LF_INC		3U	// V set on 0x7F -> 0x80
+#define LF_DEC		4U	// V set on 0x80 -> 0x7F
+#define LF_ADIW		5U	// 16 bit add (no H)
+#define LF_SBIW		6U	// 16 bit subtract (no H)
+
+// Records an arithmetic operation producing the bits in mask. Any other
+// pending bit has to be evaluated first (LAZY_SYNC).
+#define LAZY_FLAGS(kind, mask) \
+	lazyKind = lazyZKind = (kind); lazyRd = Rd; lazyRr = Rr; lazyR = lazyZR = R; \
+	lazyMask = (mask)
+#define LAZY_FLAGS16(kind, mask) \
+	lazyKind = lazyZKind = (kind); lazyRd = Rd16; lazyR = lazyZR = R16; \
+	lazyMask = (mask)
+// Records an operation producing Z, N, V and S from its result only
+#define LAZY_RESULT(kind) \
+	lazyZKind = (kind); lazyZR = R; \
+	lazyMask |= (SREG_ZM | SREG_NM | SREG_VM | SREG_SM)
+// Brings the bits in mask up to date in SREG before they are read
+#define LAZY_SYNC(mask) \
+	if ((lazyMask & (mask)) != 0U) \
+	{ \
+		if (((mask) & (SREG_VM | SREG_SM)) == 0U) flags_eval_fast(mask); \
+		else flags_eval(mask); \
+	}
+// The instruction computes the bits in mask itself (into SREG)
+#define LAZY_CLEAR(mask)	lazyMask &= ~(mask)
+
 #define ILLEGAL_OP fprintf(stderr,"invalid insn at address %x\n",currentPc); shutdown(1);
 
 #if defined(_DEBUG)
@@ -278,14 +521,6 @@ static u8 encode_delta(int d)
 	return result;
 }
 
-u32 hsync_more_col;
-u32 hsync_less_col;
-
-#ifndef __EMSCRIPTEN__
-FILE* avconv_video = NULL;
-FILE* avconv_audio = NULL;
-#endif // __EMSCRIPTEN__
-
 void avr8::spi_calculateClock(){
     // calculate the number of cycles before the write completes
     u16 spiClockDivider;
@@ -302,12 +537,48 @@ void avr8::spi_calculateClock(){
     SPI_DEBUG("SPI divider set to : %d (%d cycles per byte)\n",spiClockDivider,spiCycleWait);
 }
 
-// Renders a line into a 32 bit output buffer.
-// Performs a shrink by 2
-static inline void render_line(u32* dest, u8 const* src, unsigned int spos, u32 const* pal)
+// Renders a line into a 32 bit output buffer from the pixel output
+// changes (see pixel_event), taking every second cycle from the start one
+// (shrink by 2). Spans without changes are filled with a single color.
+void avr8::render_line(u32* dest, u32 start)
 {
-	for (unsigned int i = 0; i < VIDEO_DISP_WIDTH; i++)
-		dest[i] = pal[src[((i << 1) + spos) & 0x7FFU]];
+	unsigned int tail = pixelTail;
+	u8 value = pixelTailValue;
+
+	// Overrun (no line rendered for long): start from the oldest change
+	if ((pixelHead - tail) > PIXEL_EVENTS)
+	{
+		tail = pixelHead - PIXEL_EVENTS;
+		value = pixelEvents[tail % PIXEL_EVENTS].value;
+		tail ++;
+	}
+
+	// Changes up to the first pixel only give its value
+	while (tail != pixelHead &&
+	       (s32)(pixelEvents[tail % PIXEL_EVENTS].cycle - start) <= 0)
+	{
+		value = pixelEvents[tail % PIXEL_EVENTS].value;
+		tail ++;
+	}
+	pixelTail = tail;
+	pixelTailValue = value;
+
+	unsigned int x = 0U;
+	while (tail != pixelHead)
+	{
+		const pixelEvent_t &ev = pixelEvents[tail % PIXEL_EVENTS];
+		const u32 first = (ev.cycle - start + 1U) >> 1; // First pixel showing it
+		if (first >= VIDEO_DISP_WIDTH)
+			break;
+		const u32 color = palette[value];
+		while (x < first)
+			dest[x++] = color;
+		value = ev.value;
+		tail ++;
+	}
+	const u32 color = palette[value];
+	while (x < VIDEO_DISP_WIDTH)
+		dest[x++] = color;
 }
 
 inline void avr8::write_io(u8 addr,u8 value)
@@ -316,16 +587,22 @@ inline void avr8::write_io(u8 addr,u8 value)
 	// million times per second in a Uzebox game.
 	if (addr == ports::PORTC)
 	{
-		pixel_raw = value & DDRC;
+		value &= DDRC;
+		if (value != pixel_raw)
+		{
+			pixel_raw = value;
+			pixel_event(cycleCounter, value);
+		}
 	}
 	else
 	{
-		write_io_x(addr, value);
+		(this->*writeIoX)(addr, value);
 	}
 }
 
 // Should not be called directly, use write_io instead (pixel output!)
-void avr8::write_io_x(u8 addr,u8 value)
+// F: features (FEATURE_GDB...) the variant supports
+template <unsigned int F> void avr8::write_io_x(u8 addr,u8 value)
 {
 	u8 changed;
 	u8 went_low;
@@ -333,24 +610,21 @@ void avr8::write_io_x(u8 addr,u8 value)
 	switch (addr)
 	{
 	case (ports::OCR2A):
-		if (enableSound && TCCR2B)
+		if (enableSound && TCCR2B && !speculative)
 		{
-			// raw pcm sample at 15.7khz
-#ifndef __EMSCRIPTEN__
-			while (audioRing.isFull())SDL_Delay(1);
-#endif // __EMSCRIPTEN__
-			SDL_LockAudio();
-			audioRing.push(value);
-			SDL_UnlockAudio();
+			// raw pcm sample at 15.7khz, published by batches (dropped if
+			// the ring is full: the emulation never waits for the device)
+			audioBatch[audioBatchSize++] = value;
+			if (audioBatchSize == AUDIO_BATCH)
+				audio_flush();
 
 #ifndef __EMSCRIPTEN__
 			//Send audio byte to ffmpeg
-			if(recordMovie && avconv_audio) {
+			if((F & FEATURE_RECORD) && recordMovie && avconv_audio) {
 				fwrite(&value, 1, 1, avconv_audio);
 
 				// Keep audio in sync, since the sample rate we encode at is not a factor of the clock speed
 				const double needs_extra_sample = 4.0 * 1.0 / 15734.0 / (1.0 / 15734.0 - 1820.0 / 28636360.0);
-				static double accumulated_error = 0.0;
 				accumulated_error += (28636360 % 15734);
 				if (accumulated_error > needs_extra_sample) {
 					accumulated_error -= needs_extra_sample;
@@ -383,9 +657,7 @@ void avr8::write_io_x(u8 addr,u8 value)
 				if (scanline_count >= 0){
 					render_line(
 						(u32*)((u8*)surface->pixels + scanline_count * surface->pitch),
-						&scanline_buf[0],
-						left_edge + left_edge_cycle,
-						palette);
+						left_edge + left_edge_cycle);
 				}
 
 				scanline_count ++;
@@ -393,104 +665,97 @@ void avr8::write_io_x(u8 addr,u8 value)
 
 				if (scanline_count == 224)
 				{
+					// Headless: the frame is only kept in surface. Run-ahead shows
+					// the last frame ahead only (see run_frame). The scaling runs
+					// on the worker of the presenter.
+					if (!headless && !hideFrame)
+						presenter->frame(surface);
 
-					if (activeScaler) {
-						ApplyScalerIfNeeded();
-						SDL_RenderClear(renderer);
-						if (orientation != -1 || mirror)
-							SDL_RenderCopyEx(renderer, scaledTexture, NULL, NULL, orientation, NULL, mirror);
-						else
-							SDL_RenderCopy(renderer, scaledTexture, NULL, NULL);
-					} else {
-						SDL_UpdateTexture(texture, NULL, surface->pixels, surface->pitch);
-						SDL_RenderClear(renderer);
-						if (orientation != -1 || mirror)
-							SDL_RenderCopyEx(renderer, texture, NULL, NULL, orientation, NULL, mirror);
-						else
-							SDL_RenderCopy(renderer, texture, NULL, NULL);
-					}
-					SDL_RenderPresent(renderer);
+					// Frames run ahead are discarded: they neither see new input
+					// nor count
+					if (!speculative) {
+						frameCounter ++;
 
 #ifndef __EMSCRIPTEN__
-					//Send video frame to ffmpeg
-					if (recordMovie && avconv_video) fwrite(surface->pixels, VIDEO_DISP_WIDTH*224*4, 1, avconv_video);
+						//Send video frame to ffmpeg
+						if ((F & FEATURE_RECORD) && recordMovie && avconv_video) fwrite(surface->pixels, VIDEO_DISP_WIDTH*224*4, 1, avconv_video);
 #endif // __EMSCRIPTEN__
 
-					SDL_Event event;
+						if (!headless) {
+							SDL_Event event;
 #ifndef NOGDB
-					while (singleStep? SDL_WaitEvent(&event) : SDL_PollEvent(&event))
+							while (((F & FEATURE_GDB) && singleStep)? SDL_WaitEvent(&event) : SDL_PollEvent(&event))
 #else // NOGDB
-					while (SDL_PollEvent(&event))
+							while (SDL_PollEvent(&event))
 #endif // NOGDB
-					{
-						switch (event.type) {
-							case SDL_KEYDOWN:
-								handle_key_down(event);
-								break;
-							case SDL_KEYUP:
-								handle_key_up(event);
-								break;
-							case SDL_JOYBUTTONDOWN:
-							case SDL_JOYBUTTONUP:
-							case SDL_JOYAXISMOTION:
-							case SDL_JOYHATMOTION:
-							case SDL_JOYBALLMOTION:
-								if (jmap.jstate != JMAP_IDLE)
-									map_joysticks(event);
-								else
-									update_joysticks(event);
-								break;
-							case SDL_QUIT:
-								printf("User abort (closed window).\n");
-								shutdown(0);
-								break;
+							{
+								switch (event.type) {
+									case SDL_KEYDOWN:
+										handle_key_down(event);
+										break;
+									case SDL_KEYUP:
+										handle_key_up(event);
+										break;
+									case SDL_JOYBUTTONDOWN:
+									case SDL_JOYBUTTONUP:
+									case SDL_JOYAXISMOTION:
+									case SDL_JOYHATMOTION:
+									case SDL_JOYBALLMOTION:
+										if (jmap.jstate != JMAP_IDLE)
+											map_joysticks(event);
+										else
+											update_joysticks(event);
+										break;
+									case SDL_QUIT:
+										printf("User abort (closed window).\n");
+										shutdown(0);
+										break;
+								}
+							}
 						}
-					}
-
-					//capture or replay controlelr capture data
-					if(captureMode==CAPTURE_WRITE){
-						fputc((u8)(buttons[0]&0xff),captureFile);
-						fputc((u8)((buttons[0]>>8)&0xff),captureFile);
-					}else if(captureMode==CAPTURE_READ && captureSize>0){
-						buttons[0]=captureData[capturePtr]+(captureData[capturePtr+1]<<8);
-						capturePtr+=2;
-						captureSize-=2;
-					}else if(captureMode==CAPTURE_READ && captureSize==0){
-						printf("Playback reached end of capture file.\n");
-						shutdown(0);
-					}
-
 
-					if (pad_mode == SNES_MOUSE)
-					{
-						// http://www.repairfaq.org/REPAIR/F_SNES.html
-						// we always report "low sensitivity"
-						int mouse_dx, mouse_dy;
-						u8 mouse_buttons = SDL_GetRelativeMouseState(&mouse_dx,&mouse_dy);
-						mouse_dx >>= mouse_scale;
-						mouse_dy >>= mouse_scale;
-						// clear high bit so we know it's the mouse
-						buttons[0] = (encode_delta(mouse_dx) << 24)
-							| (encode_delta(mouse_dy) << 16) | 0x7FFF;
-						if (mouse_buttons & SDL_BUTTON_LMASK)
-							buttons[0] &= ~(1<<9);
-						if (mouse_buttons & SDL_BUTTON_RMASK)
-							buttons[0] &= ~(1<<8);
-						// keep mouse centered so it doesn't get stuck on edge of screen.
-						// ...and immediately consume the bogus motion event it generated.
-						if (fullscreen)
+						if (pad_mode == SNES_MOUSE && !headless)
 						{
-							SDL_WarpMouseInWindow(window,400,300);
-							SDL_GetRelativeMouseState(&mouse_dx,&mouse_dy);
+							// http://www.repairfaq.org/REPAIR/F_SNES.html
+							// we always report "low sensitivity"
+							int mouse_dx, mouse_dy;
+							u8 mouse_buttons = SDL_GetRelativeMouseState(&mouse_dx,&mouse_dy);
+							mouse_dx >>= mouse_scale;
+							mouse_dy >>= mouse_scale;
+							// clear high bit so we know it's the mouse
+							buttons[0] = (encode_delta(mouse_dx) << 24)
+								| (encode_delta(mouse_dy) << 16) | 0x7FFF;
+							if (mouse_buttons & SDL_BUTTON_LMASK)
+								buttons[0] &= ~(1<<9);
+							if (mouse_buttons & SDL_BUTTON_RMASK)
+								buttons[0] &= ~(1<<8);
+							// keep mouse centered so it doesn't get stuck on edge of screen.
+							// ...and immediately consume the bogus motion event it generated.
+							if (fullscreen)
+							{
+								SDL_WarpMouseInWindow(window,400,300);
+								SDL_GetRelativeMouseState(&mouse_dx,&mouse_dy);
+							}
 						}
+						else
+							buttons[0] |= 0xFFFF8000;
+
+						//record or replay the input of the frame
+						if (F & FEATURE_CAPTURE)
+							movie_frame();
+
+						if (frameLimit != 0U && frameCounter >= frameLimit)
+							shutdown(0);
 					}
-					else
-						buttons[0] |= 0xFFFF8000;
 
 #ifndef NOGDB
-					singleStep = nextSingleStep;
+					if (F & FEATURE_GDB) singleStep = nextSingleStep;
 #endif // NOGDB
 					scanline_count = -999;
+
+					// Frame complete, run_frame() returns after this instruction
+					if (frameStop)
+						deadline = cycleCounter;
 				}
 			}
 
@@ -607,7 +872,7 @@ void avr8::write_io_x(u8 addr,u8 value)
 		break;
 
 	case (ports::SPDR):
-		if((SPCR & 0x40) && SD_ENABLED()){ // only if SPI is enabled and card is present
+		if((F & FEATURE_SPI) && (SPCR & 0x40) && SD_ENABLED()){ // only if SPI is enabled and card is present
 		#if defined(SPIRAM_ENABLED)
 			if ((PORTA & (1 << 4)) == 0) { // CS low: SPI RAM selected
 				spiByte = SPIRAM_Transfer(value);
@@ -617,8 +882,8 @@ void avr8::write_io_x(u8 addr,u8 value)
 				spiByte = value;
 			}
 			//TODO: flag collision if x-fer in progress
-			spiClock = spiCycleWait;
 			spiTransfer = 1;
+			schedule(EV_SPI, cycleCounter + spiCycleWait);
 			SPSR ^= 0x80; // clear interrupt
 			//SPI_DEBUG("spiClock: %0.2X\n",spiClock);
 		}
@@ -628,14 +893,23 @@ void avr8::write_io_x(u8 addr,u8 value)
 
 	case (ports::SPCR):
 		SPI_DEBUG("SPCR: %02X\n",value);
+		if (spiTransfer && ((io[addr] ^ value) & 0x40)){
+			// SPI toggled during a transfer: it is only clocked while enabled
+			if (value & 0x40){
+				schedule(EV_SPI, cycleCounter + spiClock);
+			}else{
+				spiClock = eventAt[EV_SPI] - cycleCounter;
+				schedule(EV_SPI, EVENT_NEVER);
+			}
+		}
 		io[addr] = value;
-		if(SD_ENABLED()) spi_calculateClock();
+		if((F & FEATURE_SPI) && SD_ENABLED()) spi_calculateClock();
 		break;
 
 	case (ports::SPSR):
 		SPI_DEBUG("SPSR: %02X\n",value);
 		io[addr] = value;
-		if(SD_ENABLED()) spi_calculateClock();
+		if((F & FEATURE_SPI) && SD_ENABLED()) spi_calculateClock();
 		break;
 
 	case (ports::EECR):
@@ -665,6 +939,13 @@ void avr8::write_io_x(u8 addr,u8 value)
 		else{
 			io[addr] = value;
 		}
+		if(io[addr] & (EEPE|EERE)){
+			schedule(EV_EEPROM, cycleCounter); // completes after this instruction
+		}
+		break;
+
+	case (ports::WDTCSR):
+		write_wdtcsr(value);
 		break;
 
 	// Note: This was commented out in the original code. If needed,
@@ -689,9 +970,12 @@ void avr8::write_io_x(u8 addr,u8 value)
 		// TODO: These should also be latched by the Atmel docs, maybe
 		// implement it later.
 		io[addr] = value;
-		TCNT1 += timer1_base - timer1_next;
-		timer1_base = 0U;
-		timer1_next = 0U; // Force timer state recalculation (update_hardware)
+		timer1_resync();
+		break;
+
+	case (ports::SREG):
+		lazyMask = 0U;
+		io[addr] = value;
 		break;
 
 	case (ports::res3A):
@@ -716,7 +1000,7 @@ u8 avr8::read_io(u8 addr)
 	// p106 in 644 manual; 16-bit values are latched
 	if (addr == ports::TCNT1L)
 	{
-		unsigned int curr_timer = TCNT1 + timer1_base - timer1_next;
+		unsigned int curr_timer = TCNT1 + timer1_elapsed();
 		T16_latch = (curr_timer >> 8) & 0xFFU;
 		return curr_timer & 0xFFU;
 	}
@@ -724,28 +1008,10 @@ u8 avr8::read_io(u8 addr)
 	{
 		return T16_latch;
 	}
-	else if (addr == ports::SPDR)
+	else if (addr == ports::SREG)
 	{
-		if ((SPCR & 0x40)) // SPI enabled
-		{
-			if (!SDemulator.cs_active) {
-				// SD card is selected (CS low)
-				return spiByte;
-			}
-			else if (!SPIRAMemulator.cs_active) {
-				// SPI RAM is selected (CS low)
-				spiByte = SPIRAMemulator.handleSpiByte(spiByte);
-				return spiByte;
-			}
-			else {
-				// No known device selected, return default (e.g., open bus)
-				return 0xFF;
-			}
-		}
-		else
-		{
-			return spiByte;
-		}
+		flags_sync();
+		return SREG;
 	}
 	else
 	{
@@ -755,130 +1021,217 @@ u8 avr8::read_io(u8 addr)
 
 
 
-// Inline variation of update_hardware, to be used with frequent multi-cycle
-// instructions.
-inline void avr8::update_hardware_fast()
+// Performs hardware updates which have to be calculated at cycle precision
+void avr8::update_hardware()
 {
-	if (timer1_next == 0U)
+	cycleCounter ++;
+
+	// Process scheduled events
+
+	if (cycleCounter >= nextEvent)
 	{
-		update_hardware();
-		return;
+		run_events();
 	}
+}
 
-	cycleCounter ++;
-	timer1_next --;
-	scanline_buf[cycleCounter & 0x7FFU] = pixel_raw;
+
+
+// Processes the events due on the current cycle. Only Timer1 needs cycle
+// precision, the other events are completed by update_hardware_ins() after
+// the current instruction (see hardware_ins_pending).
+void avr8::run_events()
+{
+	if (cycleCounter >= eventAt[EV_TIMER1])
+	{
+		update_timer1();
+	}
 }
 
 
 
-// Performs hardware updates which have to be calculated at cycle precision
-void avr8::update_hardware()
+// Full Timer1 processing, done on the cycles its events are scheduled for.
+// Between those TCNT1 is reproduced from the cycles elapsed since
+// timer1_start, so the timer's events are scheduled whenever it may raise an
+// interrupt flag or its state changes (port writes, see timer1_resync).
+void avr8::update_timer1()
 {
-	cycleCounter ++;
+	unsigned int next = 0U;
 
-	// timer1_next stores the cycles remaining until the next event on the
-	// Timer1 16 bit timer. It can be cleared to zero whenever the timer's
-	// state is changed (port writes). Locking it to zero should have no
-	// effect, causing the timer to re-calculate its state proper on every
-	// update_hardware call. It should only improve performance.
+	// Apply time elapsed between full timer processings
 
-	if (timer1_next == 0U)
-	{
-		// Apply time elapsed between full timer processings
+	TCNT1 += (unsigned int)(cycleCounter - 1U - timer1_start);
+	timer1_start = cycleCounter;
 
-		TCNT1 += timer1_base;
+	// Apply delayed timer interrupt flags
 
-		// Apply delayed timer interrupt flags
+	TIFR1 |= itd_TIFR1;
+	itd_TIFR1 = 0U;
 
-		TIFR1 |= itd_TIFR1;
-		itd_TIFR1 = 0U;
+	// Process timer
+
+	if ((TCCR1B & 7U) != 0U) // If timer 1 is started
+	{
 
-		// Process timer
+		unsigned int OCR1A = OCR1AL | ((unsigned int)(OCR1AH) << 8);
+		unsigned int OCR1B = OCR1BL | ((unsigned int)(OCR1BH) << 8);
 
-		if ((TCCR1B & 7U) != 0U) // If timer 1 is started
+		if(TCCR1B & WGM12) // Timer in CTC mode: count up to OCRnA then resets to zero
 		{
 
-			unsigned int OCR1A = OCR1AL | ((unsigned int)(OCR1AH) << 8);
-			unsigned int OCR1B = OCR1BL | ((unsigned int)(OCR1BH) << 8);
+			if (TCNT1 == 0xFFFFU)
+			{
+				itd_TIFR1 |= TOV1;
+			}
 
-			if(TCCR1B & WGM12) // Timer in CTC mode: count up to OCRnA then resets to zero
+			if (TCNT1 == OCR1B)
 			{
+				itd_TIFR1 |= OCF1B;
+			}
 
-				if (TCNT1 == 0xFFFFU)
-				{
-					itd_TIFR1 |= TOV1;
-				}
+			if (TCNT1 == OCR1A)
+			{
+				TCNT1 = 0U;
+				itd_TIFR1 |= OCF1A;
+			}
+			else
+			{
+				TCNT1 = (TCNT1 + 1U) & 0xFFFFU;
+			}
 
-				if (TCNT1 == OCR1B)
-				{
-					itd_TIFR1 |= OCF1B;
-				}
+			// Calculate next timer event
 
-				if (TCNT1 == OCR1A)
+			if (itd_TIFR1 == 0U)
+			{
+				next = 0xFFFFU - TCNT1;
+				if ( (TCNT1 <= OCR1B) &&
+				     (next > (OCR1B - TCNT1)) )
 				{
-					TCNT1 = 0U;
-					itd_TIFR1 |= OCF1A;
+					next = (OCR1B - TCNT1);
 				}
-				else
+				if ( (TCNT1 <= OCR1A) &&
+				     (next > (OCR1A - TCNT1)) )
 				{
-					TCNT1 = (TCNT1 + 1U) & 0xFFFFU;
+					next = (OCR1A - TCNT1);
 				}
+			}
 
-				// Calculate next timer event
+		}else{	//timer in normal mode: counts up to 0xffff then rolls over
 
-				if (itd_TIFR1 == 0U)
-				{
-					timer1_next = 0xFFFFU - TCNT1;
-					if ( (TCNT1 <= OCR1B) &&
-					     (timer1_next > (OCR1B - TCNT1)) )
-					{
-						timer1_next = (OCR1B - TCNT1);
-					}
-					if ( (TCNT1 <= OCR1A) &&
-					     (timer1_next > (OCR1A - TCNT1)) )
-					{
-						timer1_next = (OCR1A - TCNT1);
-					}
-				}
+			if (TCNT1 == 0xFFFFU)
+			{
+				itd_TIFR1 |= TOV1;
+			}
+			TCNT1 = (TCNT1 + 1U) & 0xFFFFU;
 
-			}else{	//timer in normal mode: counts up to 0xffff then rolls over
+			// Calculate next timer event
 
-				if (TCNT1 == 0xFFFFU)
-				{
-					itd_TIFR1 |= TOV1;
-				}
-				TCNT1 = (TCNT1 + 1U) & 0xFFFFU;
+			if (itd_TIFR1 == 0U)
+			{
+				next = 0xFFFFU - TCNT1;
+			}
 
-				// Calculate next timer event
+		}
 
-				if (itd_TIFR1 == 0U)
-				{
-					timer1_next = 0xFFFFU - TCNT1;
-				}
+	}
 
-			}
+	// Schedule the next full processing. A stopped timer has nothing to do
+	// until its registers are written.
+
+	if ((TCCR1B & 7U) != 0U)
+	{
+		schedule(EV_TIMER1, cycleCounter + next + 1U);
+	}
+	else
+	{
+		schedule(EV_TIMER1, EVENT_NEVER);
+	}
+}
 
-		}
 
-		// Set timer base to be able to reproduce TCNT1 outside full timer
-		// processing
 
-		timer1_base = timer1_next;
+// Cycles TCNT1 advanced by since timer1_start. A running timer always has
+// an event scheduled.
+unsigned int avr8::timer1_elapsed()
+{
+	if (eventAt[EV_TIMER1] == EVENT_NEVER)
+	{
+		return 0U;
+	}
+	return (unsigned int)(cycleCounter - timer1_start);
+}
+
+
+
+// Brings TCNT1 up to date and has the timer state recalculated on the next
+// cycle. Used when the Timer1 registers change.
+void avr8::timer1_resync()
+{
+	TCNT1 += timer1_elapsed();
+	timer1_start = cycleCounter;
+	schedule(EV_TIMER1, cycleCounter + 1U);
+}
+
+
+
+// Watchdog notes:
+//
+// This is a bare minimum implementation to make the Uzebox kernel's
+// seed generator operational (used for seeding a PRNG). While enabled the
+// count is cycleCounter - watchdogStart, so only the timeout (if the
+// interrupt is enabled) has to be scheduled. It is raised by
+// update_hardware_ins() after the instruction reaching it.
 
+// Sets the watchdog count (WDR, timeouts) and schedules the timeout
+void avr8::watchdog_set(unsigned int count)
+{
+	if ((WDTCSR & WDE) == 0U)
+	{
+		watchdogTimer = count;
+		schedule(EV_WATCHDOG, EVENT_NEVER);
 	}
 	else
 	{
-		timer1_next --;
+		watchdogStart = cycleCounter - count;
+		if ((WDTCSR & WDIE) != 0U)
+		{
+			schedule(EV_WATCHDOG, watchdogStart + DELAY16MS);
+		}
+		else
+		{
+			schedule(EV_WATCHDOG, EVENT_NEVER);
+		}
 	}
+}
 
-	// Draw pixel on scanline
+// WDTCSR writes, which may start or stop the watchdog count
+void avr8::write_wdtcsr(u8 value)
+{
+	unsigned int count = watchdogTimer;
 
-	scanline_buf[cycleCounter & 0x7FFU] = pixel_raw;
+	if ((WDTCSR & WDE) != 0U)
+	{
+		count = (unsigned int)(cycleCounter - watchdogStart);
+	}
+	WDTCSR = value;
+	watchdog_set(count);
 }
 
 
 
+// Tells whether update_hardware_ins() has anything to do. The state this
+// depends on only changes through I/O writes, scheduled events, interrupts
+// and setting the I flag, so run_until() only re-evaluates it after those.
+inline bool avr8::hardware_ins_pending()
+{
+	if (dly_out != 0U || cycleCounter >= nextEvent)
+		return true;
+	if ((SREG & (1U << SREG_I)) == 0U)
+		return false;
+	return ((SPCR & SPSR & 0x80U) != 0U) ||
+	       ((WDTCSR & (WDIF | WDIE)) == (WDIF | WDIE)) ||
+	       ((TIFR1 & TIMSK1 & (OCF1A | OCF1B | TOV1)) != 0U);
+}
+
 // Performs hardware updates which can be done at instruction precision
 // Also process interrupt requests
 inline void avr8::update_hardware_ins()
@@ -895,78 +1248,45 @@ inline void avr8::update_hardware_ins()
 	{
 		if ((dly_out & DLY_TCCR1B) != 0U)
 		{
+			timer1_resync(); // Timer state changes
 			TCCR1B = dly_TCCR1B;
-			TCNT1 += timer1_base - timer1_next;
-			timer1_base = 0U;
-			timer1_next = 0U; // Timer state changes
 		}
 		if ((dly_out & DLY_TCNT1) != 0U)
 		{
+			timer1_resync(); // Timer state changes
 			TCNT1 = (dly_TCNT1H << 8) | dly_TCNT1L;
-			timer1_base = 0U;
-			timer1_next = 0U; // Timer state changes
 		}
 		dly_out = 0U;
 	}
 
-	// Get cycle count to emulate
-
-	unsigned int cycles = cycleCounter - cycle_ctr_ins;
-	cycle_ctr_ins = cycleCounter;
-
 	// Notes:
 	//
 	// From this point if further cycles are required to be consumed,
-	// those should be consumed using update_hardware(). This won't
-	// increase this run's cycle count (cycles), but will show in the
-	// next run proper.
+	// those should be consumed using update_hardware(), so the cycle
+	// precise hardware sees them.
 
-	// Watchdog notes:
-	//
-	// This is a bare minimum implementation to make the Uzebox kernel's
-	// seed generator operational (used for seeding a PRNG).
-
-	if(WDTCSR & WDE){ //if watchdog enabled
-		watchdogTimer += cycles;
-		if(watchdogTimer>=DELAY16MS && (WDTCSR&WDIE)){
-			WDTCSR|=WDIF;	//watchdog interrupt
-			//reset watchdog
-			//watchdog is based on a RC oscillator
-			//so add some random variation to simulate entropy
-			watchdogTimer=rand()%1024;
-		}
+	// Watchdog timeout (see watchdog_set)
+
+	if (cycleCounter >= eventAt[EV_WATCHDOG])
+	{
+		WDTCSR |= WDIF;	//watchdog interrupt
+		//reset watchdog
+		//watchdog is based on a RC oscillator
+		//so add some random variation to simulate entropy
+		watchdog_set(watchdog_entropy()%1024);
 	}
 
-    // clock the SPI hardware.
-    if((SPCR & 0x40) && SD_ENABLED()){ // only if SPI is enabled
-        //TODO: test for master/slave modes (assume master for now)
-        // TODO: factor in clock divider
-
-        if(spiTransfer){
-            if(spiClock <= cycles){
-                //SPI_DEBUG("SPI transfer complete\n");
-                update_spi();
-                spiClock = 0;
-                spiTransfer = 0;
-                SPSR |= 0x80; // set interrupt
-            }
-            else{
-                spiClock -= cycles;
-            }
-        }
-            /*
-        //HACK: instantaneous SPI access
-        if(spiTransfer && spiClock > 0){
-            update_spi();
-            SPSR |= 0x80; // set interrupt
-            spiTransfer = 0;
-            spiClock = 0;
-        }*/
-
-        // test for interrupt (enable and interrupt flag for SPI)
-        // TODO (Jubatian): Verify that the move is OK, if not, try to fix
-        // it there (where the other interrupts are)
-    }
+	// SPI transfer completion (scheduled by SPDR writes)
+	//TODO: test for master/slave modes (assume master for now)
+
+	if (cycleCounter >= eventAt[EV_SPI])
+	{
+		//SPI_DEBUG("SPI transfer complete\n");
+		schedule(EV_SPI, EVENT_NEVER);
+		update_spi();
+		spiTransfer = 0;
+		SPSR |= 0x80; // set interrupt
+	}
 
     //clock the EEPROM hardware
     /*
@@ -978,20 +1298,15 @@ inline void avr8::update_hardware_ins()
     6. Within four clock cycles after setting EEMPE, write a logical one to EEPE.
     The EEPROM can not be programmed during a CPU write to the Flash memory.
     */
-    // are we attempting to program?
+    // are we attempting to program? (scheduled by EECR writes)
 
-	// TODO (Jubatian):
-	//
-	// cycleCounter is incremented here by 4, but this has no effect on at
-	// least Timer 1 and the video output, maybe even more. Not like
-	// writing to EEPROM would be a common task when drawing the video
-	// frame, though.
-
-    if(EECR & (EEPE|EERE))
+    if(cycleCounter >= eventAt[EV_EEPROM])
     {
+		schedule(EV_EEPROM, EVENT_NEVER);
 		if(EECR & EEPE){
 			//printf("attempting write of EEPROM\n");
-			cycleCounter += 4; // writes take four cycles
+			for (unsigned int i = 0U; i < 4U; i++)
+				update_hardware(); // writes take four cycles
 			int addr = (EEARH << 8) | EEARL;
 			if(addr < eepromSize) eeprom[addr] = EEDR;
 			EECR ^= (EEMPE | EEPE); // clear program bits
@@ -1005,7 +1320,8 @@ inline void avr8::update_hardware_ins()
 		// are we attempting to read?
 		else if(EECR & EERE){
 		   // printf("attempting read of EEPROM\n");
-			cycleCounter += 4; // eeprom reads take 4 additonal cycles
+			for (unsigned int i = 0U; i < 4U; i++)
+				update_hardware(); // eeprom reads take 4 additonal cycles
 			int addr = (EEARH << 8) | EEARL;
 			if(addr < eepromSize) EEDR = eeprom[addr];
 			EECR ^= EERE; // clear read  bit
@@ -1061,7 +1377,177 @@ inline void avr8::update_hardware_ins()
 }
 
 
-instructionList_t instructionList[] = {
+// Computes the SREG bits in mask left pending by the last flag producing
+// instructions (see LAZY_FLAGS). This handles C, H, Z and N, flags_eval()
+// the rest.
+inline void avr8::flags_eval_fast(unsigned int mask)
+{
+	unsigned int f = 0U;
+
+	mask &= lazyMask;
+	if ((mask & (SREG_CM | SREG_HM)) != 0U)
+	{
+		if (lazyKind >= LF_ADIW)
+		{
+			u16 Rd16 = lazyRd;
+			u16 R16 = lazyR;
+
+			if (lazyKind == LF_ADIW)
+				f = ((~R16 & Rd16) >> 15) << SREG_C;
+			else
+				f = ((R16 & ~Rd16) >> 15) << SREG_C;
+		}
+		else
+		{
+			u8 Rd = (u8)lazyRd;
+			u8 Rr = (u8)lazyRr;
+			u8 R = (u8)lazyR;
+			u8 CH;
+
+			if (lazyKind == LF_ADD)
+				CH = CARRIES;
+			else
+				CH = BORROWS;
+			f  = ((CH >> 3) & 1U) << SREG_H;
+			f |= ((CH >> 7) & 1U) << SREG_C;
+		}
+	}
+	if ((mask & (SREG_ZM | SREG_NM)) != 0U)
+	{
+		if (lazyZKind >= LF_ADIW)
+		{
+			f |= ((lazyZR >> 15) & 1U) << SREG_N;
+			if ((lazyZR & 0xFFFFU) == 0U)
+				f |= SREG_ZM;
+		}
+		else
+		{
+			f |= ((lazyZR >> 7) & 1U) << SREG_N;
+			if ((lazyZR & 0xFFU) == 0U)
+				f |= SREG_ZM;
+		}
+	}
+
+	SREG = (SREG & ~mask) | (f & mask);
+	lazyMask &= ~mask;
+}
+
+// Computes the SREG bits in mask left pending, including V and S
+void avr8::flags_eval(unsigned int mask)
+{
+	unsigned int n, v, f;
+
+	flags_eval_fast(mask & (SREG_CM | SREG_HM | SREG_ZM | SREG_NM));
+	mask &= lazyMask;
+	if (mask == 0U)
+		return;
+
+	if (lazyZKind >= LF_ADIW)
+	{
+		u16 Rd16 = lazyRd;
+		u16 R16 = lazyZR;
+
+		n = R16 >> 15;
+		if (lazyZKind == LF_ADIW)
+			v = (~Rd16 & R16) >> 15;
+		else
+			v = (Rd16 & ~R16) >> 15;
+	}
+	else
+	{
+		u8 Rd = (u8)lazyRd;
+		u8 Rr = (u8)lazyRr;
+		u8 R = (u8)lazyZR;
+
+		n = R >> 7;
+		switch (lazyZKind)
+		{
+		case LF_ADD:
+			v = (((Rd&Rr&~R)|(~Rd&~Rr&R)) & 0x80U) >> 7;
+			break;
+		case LF_SUB:
+			v = (((Rd&~Rr&~R)|(~Rd&Rr&R)) & 0x80U) >> 7;
+			break;
+		case LF_INC:
+			v = (R == 0x80U) ? 1U : 0U;
+			break;
+		case LF_DEC:
+			v = (R == 0x7FU) ? 1U : 0U;
+			break;
+		default: // LF_LOGIC
+			v = 0U;
+			break;
+		}
+	}
+	f = (v << SREG_V) | ((n ^ v) << SREG_S);
+
+	SREG = (SREG & ~mask) | (f & mask);
+	lazyMask &= ~mask;
+}
+
+// Skips the passes of an idle loop found in the same state as on its
+// previous pass (see IDLE_LOOP), which took cycleCounter - idleCycle
+// cycles. Passes are skipped up to the one the next event or the deadline
+// falls in, which is left to run normally. The pixel output does not
+// change over the skipped cycles, so there is nothing to record.
+void avr8::idle_forward()
+{
+	const u64 pass = cycleCounter - idleCycle;
+	const u64 limit = (nextEvent < deadline) ? nextEvent : deadline;
+
+	if (pass == 0U || limit <= cycleCounter)
+		return;
+
+	const u64 skip = ((limit - 1U - cycleCounter) / pass) * pass;
+
+	cycleCounter += skip;
+
+	// The profile counts the passes as executed. The loop ends on the
+	// deciding instruction or on the RJMP after a deciding skip.
+	if (profiling)
+	{
+		u16 tail = currentPc;
+		const u8 op = progmemDecoded[tail].opNum & ~OP_BREAKPOINT;
+		if (op >= 97U && op <= 100U)
+			tail ++;
+		const u16 head = tail + 1U + progmemDecoded[tail].arg2;
+		for (u16 i = head; i <= tail; i += get_insn_size(progmemDecoded[i].opNum))
+			profile->count[i] += skip / pass;
+	}
+}
+
+#ifdef ENABLE_JIT
+// Runs the translated block starting at pc. Blocks only contain register
+// instructions, so the hardware only sees the passing of their cycles. The
+// block is entered if no scheduled event or delayed output falls within
+// it: then a single update_hardware_ins() call after the block has the
+// same effect as one after each instruction.
+// Blocks not fitting in the remaining cycle budget are interpreted, so
+// run_until() stops on the same instruction with or without translation.
+// Returns false if the block was not executed.
+inline bool avr8::jit_exec(u64 budget)
+{
+	const jitBlock_t &blk = jit->blocks[jit->entry[pc] - 1U];
+	const unsigned int cycles = blk.cycles;
+
+	if (cycles > budget)
+		return false;
+	if ((cycleCounter + cycles) >= nextEvent || dly_out != 0U)
+		return false;
+
+	flags_sync(); // Blocks work on SREG directly
+	blk.code(r);
+
+	currentPc = blk.last;
+	pc = blk.end;
+	cycleCounter += cycles;
+
+	return true;
+}
+#endif
+
+
+constexpr instructionList_t instructionList[] = {
 
 {   1,"ADC    r%d, r%d "               ,   1,   1,   0,   0,   2,   1,   0,   0,   1,   1, 0b0001110000000000, 0b0000000111110000, 0b0000001000001111},
 {   2,"ADD    r%d, r%d "               ,   1,   1,   0,   0,   2,   1,   0,   0,   1,   1, 0b0000110000000000, 0b0000000111110000, 0b0000001000001111},
@@ -1155,41 +1641,308 @@ instructionList_t instructionList[] = {
 
 };
 
-unsigned int avr8::exec()
+// Opcode decoder: for each of the 65536 opcodes, the index + 1 of the
+// first instructionList entry matching it (which has the recipe to
+// extract its arguments), 0 for illegal opcodes. It is generated at compile
+// time by enumerating the argument bits of each entry, last to first, so
+// decoding a flash word is a single lookup.
+struct decodeTable_t {
+	u8 insn[65536];
+};
+static constexpr decodeTable_t makeDecodeTable()
 {
+	decodeTable_t table = {};
+	unsigned int count = 0U;
 
-	currentPc=pc;
-	const instructionDecode_t insnDecoded = progmemDecoded[pc];
-	const u8  opNum  = insnDecoded.opNum;
-	const u8  arg1_8 = insnDecoded.arg1;
-	const s16 arg2_8 = insnDecoded.arg2;
-
-	const unsigned int startcy = cycleCounter;
-	u8 Rd, Rr, R, CH;
-	u16 uTmp, Rd16, R16;
-	s16 sTmp;
+	while (instructionList[count].opNum != 0)
+		count ++;
 
-#ifndef NOGDB
-	//GDB must be first
-	if (enableGdb == true)
+	for (unsigned int i = count; i > 0U; i--)
 	{
-		gdb->exec();
-	
-		// Check if the next instruction match a GDB breakpoint
-		Breakpoints::iterator ii;
-  		if ((ii= find(gdb->BP.begin(), gdb->BP.end(), pc)) != gdb->BP.end())
+		const instructionList_t &insn = instructionList[i - 1U];
+		const u16 args = insn.arg1Mask | insn.arg2Mask;
+		u16 bits = 0U;
+
+		do // All combinations of the argument bits
 		{
-			gdbBreakpointFound = true;
-			return 0;
-		}
+			table.insn[insn.mask | bits] = (u8)i;
+			bits = (bits - args) & args;
+		} while (bits != 0U);
 	}
 
-	if (state == CPU_STOPPED)
-		return 0;
-#endif // NOGDB
+	return table;
+}
+static constexpr decodeTable_t decodeTable = makeDecodeTable();
 
-	//Program counter must be incremented *after* GDB
-	pc++;
+unsigned int avr8::exec()
+{
+	return run_until(cycleCounter + 1U);
+}
+
+unsigned int avr8::exec(unsigned int cycles)
+{
+	return run_until(cycleCounter + cycles);
+}
+
+unsigned int avr8::run_frame()
+{
+	unsigned int cycles;
+
+	// Analyse the program again once SPM left it alone for a frame
+	if (flashModified && (cycleCounter - flashModifiedAt) > FRAME_CYCLES_MAX){
+		flashModified = false;
+		decodeFlash();
+	}
+
+	if (stateKey != 0)
+		state_key();
+
+	if (rewindBuffer != NULL)
+		rewind_frame();
+
+	// Keyframe of the movie being recorded, to seek to
+	if (captureMode == CAPTURE_WRITE && movie->wantState()) {
+		std::vector<u8> state(saveStateSize());
+		saveState(state.data());
+		movie->state(state.data(), state.size());
+	} else if (captureMode == CAPTURE_READ && !rewinding) {
+		movie_check();
+	}
+
+	// Run-ahead: the frame is emulated for its sound and to pick up the
+	// input, then the next runAhead frames with that input, showing the
+	// last one, and the state is restored. This hides as many frames of
+	// input lag of the game. Not under gdb, which would stop in there.
+	// The keyboard scancodes the frames ahead consume are in the state,
+	// the game reads them again on the following frames.
+	const bool ahead = (runAhead != 0U) && !rewinding && !enableGdb;
+	hideFrame = ahead;
+	cycles = frame_cycles();
+	hideFrame = false;
+	if (ahead) {
+		runAheadState.resize(saveStateSize());
+		saveState(runAheadState.data());
+		speculative = true;
+		for (unsigned int i = 1U; i <= runAhead; i++) {
+			hideFrame = (i != runAhead);
+			frame_cycles();
+		}
+		hideFrame = false;
+		speculative = false;
+		loadState(runAheadState.data(), runAheadState.size());
+	}
+
+	if (cycleLimit != 0U && (s64)(cycleCounter - cycleLimit) >= 0)
+		shutdown(0);
+
+	audio_flush();
+#ifndef __EMSCRIPTEN__
+	if (!headless)
+		pace_frame(cycles);
+#endif // __EMSCRIPTEN__
+
+	return cycles;
+}
+
+// Waits for the host clock to catch up with the emulated time of the frame.
+// The deadline moves by that time, so the frame rate does not drift with
+// the waits. Being late or early by more than PACE_RESYNC (slow host,
+// debugger, window dragged) starts over from now rather than running fast
+// to catch up. SDL_Delay waits the bulk, the last millisecond polls the
+// performance counter. Drift against the clock of the audio device is left
+// to the rate control of audio_callback.
+void avr8::pace_frame(unsigned int cycles)
+{
+	const u64 freq = SDL_GetPerformanceFrequency();
+	u64 now = SDL_GetPerformanceCounter();
+
+	paceDeadline += cycles * freq / CPU_CLOCK;
+	if ((s64)(now - paceDeadline) > (s64)(freq / PACE_RESYNC) ||
+	    (s64)(paceDeadline - now) > (s64)(freq / PACE_RESYNC))
+		paceDeadline = now;
+
+	while ((s64)(paceDeadline - now) > 0) {
+		const u64 ms = (paceDeadline - now) * 1000U / freq;
+		if (ms >= 2U)
+			SDL_Delay((Uint32)(ms - 1U));
+		now = SDL_GetPerformanceCounter();
+	}
+}
+
+// Runs until the end of the next video frame or the cycle limit
+unsigned int avr8::frame_cycles()
+{
+	unsigned int cycles;
+
+	u64 target = cycleCounter + FRAME_CYCLES_MAX;
+	if (cycleLimit != 0U && (s64)(target - cycleLimit) > 0)
+		target = cycleLimit;
+
+	frameStop = true;
+	cycles = run_until(target);
+	frameStop = false;
+
+	return cycles;
+}
+
+// Input of the frame ended, recorded to the movie or replayed from it
+void avr8::movie_frame()
+{
+	if (captureMode == CAPTURE_WRITE) {
+		movie->frame(buttons);
+	} else if (captureMode == CAPTURE_READ) {
+		if (!movie->next(buttons)) {
+			printf("Playback reached end of movie.\n");
+			shutdown(0);
+		}
+		for (size_t i = 0U; i < movie->keys.size(); i++)
+			uzekb_queue(movie->keys[i]);
+	}
+}
+
+// Replays the movie from its keyframe before the frame, up to the frame
+bool avr8::movie_seek(u32 frame)
+{
+	size_t size;
+	const u8 *state = movie->seek(frame, size);
+	if (state == NULL || !loadState(state, size))
+		return false;
+
+	// Twice the time of a frame for each, and a second more: a game that
+	// stopped making frames (or the cycle limit) fails the seek
+	const u32 frames = (frame > movie->frames) ? (frame - movie->frames) : 0U;
+	const u64 budget = cycleCounter + (u64)frames * FRAME_CYCLES_MAX + CPU_CLOCK;
+	hideFrame = true;
+	while (movie->frames < frame && (s64)(cycleCounter - budget) < 0) {
+		if (frame_cycles() == 0U)
+			break;
+	}
+	hideFrame = false;
+	return movie->frames >= frame;
+}
+
+// Saves (F2) or loads (F4) the state file of the ROM, between frames
+void avr8::state_key()
+{
+	char statebuf[sizeof(romName) + 4];
+	snprintf(statebuf, sizeof(statebuf), "%s.uzs", romName);
+	if (stateKey == SDLK_F2) {
+		printf("saving state to '%s'...\n", statebuf);
+		if (!saveStateFile(statebuf))
+			printf("Error: cannot write '%s'.\n", statebuf);
+	} else {
+		printf("loading state from '%s'...\n", statebuf);
+		if (!loadStateFile(statebuf))
+			printf("Error: cannot load '%s'.\n", statebuf);
+	}
+	stateKey = 0;
+}
+
+// Seeking starts from the keyframes: the replay has to reach their state
+// as recorded, else the movie desyncs (emulation or input not captured)
+void avr8::movie_check()
+{
+	size_t size;
+	const u8 *key = movie->keyState(size);
+	if (key == NULL)
+		return;
+	std::vector<u8> state(saveStateSize());
+	saveState(state.data());
+	if (state.size() != size || memcmp(state.data(), key, size) != 0)
+		fprintf(stderr, "Warning: The replay differs from the recording at frame %u.\n", movie->frames);
+}
+
+// Records the state the frame starts with, or while the rewind key is
+// held, goes back to the one of the previous frame
+void avr8::rewind_frame()
+{
+	if (rewinding) {
+		size_t size;
+		const u8 *state = rewindBuffer->step(size);
+		// Keep the controllers as the player holds them now
+		const u32 held[2] = { buttons[0], buttons[1] };
+		if (state != NULL && loadState(state, size)) {
+			buttons[0] = held[0];
+			buttons[1] = held[1];
+		}
+	} else {
+		u8 *dest = rewindBuffer->acquire(saveStateSize());
+		if (dest != NULL) {
+			saveState(dest);
+			rewindBuffer->commit();
+		}
+	}
+}
+
+// F: features (FEATURE_GDB...) the variant supports, only the debugger
+// and the profile matter here, the I/O variant is picked apart (see
+// useFeatures).
+template <unsigned int F> u64 avr8::run_until_t(u64 target)
+{
+	const u64 startcy = cycleCounter;
+	instructionDecode_t insnDecoded;
+	u8  opNum;
+	u8  arg1_8;
+	s16 arg2_8;
+	u8 Rd, Rr, R;
+	u16 uTmp, Rd16, R16;
+	s16 sTmp;
+
+#ifdef THREADED_DISPATCH
+	// Handler addresses indexed by opNum (0: illegal op). The order must
+	// follow the instructionList opNum numbering.
+	static void* const insnTable[] = {
+		&&insn_0,  &&insn_1,  &&insn_2,  &&insn_3,  &&insn_4,  &&insn_5,
+		&&insn_6,  &&insn_7,  &&insn_8,  &&insn_9,  &&insn_10, &&insn_11,
+		&&insn_12, &&insn_13, &&insn_14, &&insn_15, &&insn_16, &&insn_17,
+		&&insn_18, &&insn_19, &&insn_20, &&insn_21, &&insn_22, &&insn_23,
+		&&insn_24, &&insn_25, &&insn_26, &&insn_27, &&insn_28, &&insn_29,
+		&&insn_30, &&insn_31, &&insn_32, &&insn_33, &&insn_34, &&insn_35,
+		&&insn_36, &&insn_37, &&insn_38, &&insn_39, &&insn_40, &&insn_41,
+		&&insn_42, &&insn_43, &&insn_44, &&insn_45, &&insn_46, &&insn_47,
+		&&insn_48, &&insn_49, &&insn_50, &&insn_51, &&insn_52, &&insn_53,
+		&&insn_54, &&insn_55, &&insn_56, &&insn_57, &&insn_58, &&insn_59,
+		&&insn_60, &&insn_61, &&insn_62, &&insn_63, &&insn_64, &&insn_65,
+		&&insn_66, &&insn_67, &&insn_68, &&insn_69, &&insn_70, &&insn_71,
+		&&insn_72, &&insn_73, &&insn_74, &&insn_75, &&insn_76, &&insn_77,
+		&&insn_78, &&insn_79, &&insn_80, &&insn_81, &&insn_82, &&insn_83,
+		&&insn_84, &&insn_85, &&insn_86, &&insn_87, &&insn_88, &&insn_89,
+		&&insn_90, &&insn_91, &&insn_92, &&insn_93, &&insn_94, &&insn_95,
+		&&insn_96, &&insn_97, &&insn_98, &&insn_99, &&insn_100,&&insn_101,
+		&&insn_102,&&insn_103,&&insn_104,&&insn_105,&&insn_106,&&insn_107,
+		&&insn_108,&&insn_109,&&insn_110,&&insn_111,&&insn_112,&&insn_113,
+		&&insn_114,&&insn_115
+	};
+#endif
+
+	if ((s64)(target - startcy) <= 0)
+		return 0;
+	deadline = target;
+	idlePc = IDLE_NONE; // Memory may have changed since the last call
+
+	// Hot state (see HOT_SAVE), these shadow the members until return
+	u16 pc = this->pc;
+	u16 currentPc = this->currentPc;
+	u64 cycleCounter = startcy;
+	u8 pixel_raw = this->pixel_raw;
+	u64 nextEvent = this->nextEvent;
+	u64 stop = target;
+	bool insPending = hardware_ins_pending();
+
+next_insn:
+	JIT_DISPATCH;
+#ifdef ENABLE_JIT
+fetch_insn:
+#endif
+	currentPc=pc;
+	PROFILE_INSN;
+	insnDecoded = progmemDecoded[pc];
+	opNum  = insnDecoded.opNum;
+	arg1_8 = insnDecoded.arg1;
+	arg2_8 = insnDecoded.arg2;
+
+	pc++;
+	BREAK_CHECK;
 
 
 
@@ -1208,62 +1961,60 @@ unsigned int avr8::exec()
 	// be buggy then (the behavior of things like having the stack over IO
 	// area...). This solution is at least fast for these instructions.
 
+#ifdef THREADED_DISPATCH
+	goto *insnTable[opNum];
+#endif
+
 	switch (opNum){
 
-		case  1: // 0001 11rd dddd rrrr		(1) ADC Rd,Rr (ROL is ADC Rd,Rd)
+		INSN( 1): // 0001 11rd dddd rrrr		(1) ADC Rd,Rr (ROL is ADC Rd,Rd)
+			LAZY_SYNC(SREG_CM);
 			Rd = r[arg1_8];
 			Rr = r[arg2_8];
 			R = Rd + Rr + C;
-			clr_bits(SREG, SREG_CM | SREG_ZM | SREG_NM | SREG_VM | SREG_SM | SREG_HM);
-			UPDATE_HC_ADD; UPDATE_SVN_ADD; UPDATE_Z;
+			LAZY_FLAGS(LF_ADD, SREG_CM | SREG_ZM | SREG_NM | SREG_VM | SREG_SM | SREG_HM);
 			r[arg1_8] = R;
-			break;
+			END_INSN;
 
-		case  2: // 0000 11rd dddd rrrr		(1) ADD Rd,Rr (LSL is ADD Rd,Rd)
+		INSN( 2): // 0000 11rd dddd rrrr		(1) ADD Rd,Rr (LSL is ADD Rd,Rd)
 			Rd = r[arg1_8];
 			Rr = r[arg2_8];
 			R = Rd + Rr;
-			clr_bits(SREG, SREG_CM | SREG_ZM | SREG_NM | SREG_VM | SREG_SM | SREG_HM);
-			UPDATE_HC_ADD; UPDATE_SVN_ADD; UPDATE_Z;
+			LAZY_FLAGS(LF_ADD, SREG_CM | SREG_ZM | SREG_NM | SREG_VM | SREG_SM | SREG_HM);
 			r[arg1_8] = R;
-			break;
+			END_INSN;
 
-		case  3: // 1001 0110 KKdd KKKK		(2) ADIW Rd+1:Rd,K   (16-bit add to upper four register pairs)
+		INSN( 3): // 1001 0110 KKdd KKKK		(2) ADIW Rd+1:Rd,K   (16-bit add to upper four register pairs)
 			Rd = arg1_8;
 			Rr = arg2_8;
 			Rd16 = r[Rd] | (r[Rd+1]<<8);
 			R16 = Rd16 + Rr;
 			r[Rd] = (u8)R16;
 			r[Rd+1] = (u8)(R16>>8);
-			clr_bits(SREG, SREG_CM | SREG_ZM | SREG_NM | SREG_VM | SREG_SM);
-			set_bit_1(SREG,SREG_V,((~Rd16&R16)&0x8000) >> 15);
-			set_bit_1(SREG,SREG_N,(R16&0x8000) >> 15);
-			UPDATE_S;
-			set_bit_inv(SREG,SREG_Z,R16);
-			set_bit_1(SREG,SREG_C,((~R16&Rd16)&0x8000) >> 15);
-			update_hardware();
-			break;
+			LAZY_SYNC(SREG_HM);
+			LAZY_FLAGS16(LF_ADIW, SREG_CM | SREG_ZM | SREG_NM | SREG_VM | SREG_SM);
+			UPDATE_HARDWARE;
+			END_INSN;
 
-		case  4: // 0010 00rd dddd rrrr		(1) AND Rd,Rr (TST is AND Rd,Rd)
+		INSN( 4): // 0010 00rd dddd rrrr		(1) AND Rd,Rr (TST is AND Rd,Rd)
 			Rd = r[arg1_8];
 			Rr = r[arg2_8];
 			R = Rd & Rr;
-			clr_bits(SREG, SREG_ZM | SREG_NM | SREG_VM | SREG_SM);
-			UPDATE_SVN_LOGICAL; UPDATE_Z;
+			LAZY_RESULT(LF_LOGIC);
 			r[arg1_8] = R;
-			break;
+			END_INSN;
 
-		case  5: // 0111 KKKK dddd KKKK		(1) ANDI Rd,K (CBR is ANDI with K complemented)
+		INSN( 5): // 0111 KKKK dddd KKKK		(1) ANDI Rd,K (CBR is ANDI with K complemented)
 			Rd = r[arg1_8];
 			Rr = arg2_8;
 			R = Rd & Rr;
-			clr_bits(SREG, SREG_ZM | SREG_NM | SREG_VM | SREG_SM);
-			UPDATE_SVN_LOGICAL; UPDATE_Z;
+			LAZY_RESULT(LF_LOGIC);
 			r[arg1_8] = R;
-			break;
+			END_INSN;
 
-		case  6: // 1001 010d dddd 0101		(1) ASR Rd
+		INSN( 6): // 1001 010d dddd 0101		(1) ASR Rd
 			Rd = r[arg1_8];
+			LAZY_CLEAR(SREG_CM | SREG_ZM | SREG_NM | SREG_VM | SREG_SM);
 			clr_bits(SREG, SREG_CM | SREG_ZM | SREG_NM | SREG_VM | SREG_SM);
 			set_bit_1(SREG,SREG_C,Rd&1);
 			r[arg1_8] = R = (Rd >> 1) | (Rd & 0x80);
@@ -1271,97 +2022,106 @@ unsigned int avr8::exec()
 			set_bit_1(SREG,SREG_V,(R>>7)^(Rd&1));
 			UPDATE_S;
 			UPDATE_Z;
-			break;
+			END_INSN;
 
-		case  8: // 1111 100d dddd 0bbb		(1) BLD Rd,b
+		INSN( 8): // 1111 100d dddd 0bbb		(1) BLD Rd,b
 			Rd = arg1_8;
 			store_bit_1(r[Rd],arg2_8,(SREG >> SREG_T) & 1U);
-			break;
+			END_INSN;
 
-		case  7: // 1001 0100 1sss 1000		(1) BCLR s (CLC, etc are aliases with sss implicit)
+		INSN( 7): // 1001 0100 1sss 1000		(1) BCLR s (CLC, etc are aliases with sss implicit)
 			Rd = arg1_8;
+			LAZY_CLEAR(1U << Rd);
 			SREG &= ~(1U << Rd);
-			break;
+			END_INSN;
 
-		case  9: // 1111 01kk kkkk ksss		(1/2) BRBC s,k (BRCC, etc are aliases for this with sss implicit)
+		INSN( 9): // 1111 01kk kkkk ksss		(1/2) BRBC s,k (BRCC, etc are aliases for this with sss implicit)
+			LAZY_SYNC(1U << arg1_8);
 			if (!(SREG & (1<<(arg1_8))))
 			{
-				update_hardware();
+				UPDATE_HARDWARE;
 				pc += arg2_8;
 			}
-			break;
+			END_INSN;
 
-		case  10: // 1111 00kk kkkk ksss		(1/2) BRBS s,k (same here)
+		INSN(10): // 1111 00kk kkkk ksss		(1/2) BRBS s,k (same here)
+			LAZY_SYNC(1U << arg1_8);
 			if (SREG & (1<<(arg1_8)))
 			{
-				update_hardware();
+				UPDATE_HARDWARE;
 				pc += arg2_8;
 			}
-			break;
+			END_INSN;
 
-		case  11: // 1001 0101 1001 1000		(?) BREAK
+		INSN(11): // 1001 0101 1001 1000		(?) BREAK
 			// no operation
-			break;
+			END_INSN;
 
-		case  12: // 1001 0100 0sss 1000		(1) BSET s (SEC, etc are aliases with sss implicit)
+		INSN(12): // 1001 0100 0sss 1000		(1) BSET s (SEC, etc are aliases with sss implicit)
 			Rd = arg1_8;
+			LAZY_CLEAR(1U << Rd);
 			SREG |= (1U << Rd);
-			break;
+			if (Rd == SREG_I)
+				insPending = true; // Interrupts may have to be taken
+			END_INSN;
 
-		case  13: // 1111 101d dddd 0bbb		(1) BST Rd,b
+		INSN(13): // 1111 101d dddd 0bbb		(1) BST Rd,b
 			Rd = r[arg1_8];
 			store_bit_1(SREG,SREG_T,(Rd >> (arg2_8)) & 1U);
-			break;
+			END_INSN;
 
-		case  14: // 1001 010k kkkk 111k		(4) CALL k (next word is rest of address)
+		INSN(14): // 1001 010k kkkk 111k		(4) CALL k (next word is rest of address)
 			// Note: 64K progmem, so 'k' in first insn word is unused
-			update_hardware();
-			update_hardware();
-			update_hardware();
+			UPDATE_HARDWARE;
+			UPDATE_HARDWARE;
+			UPDATE_HARDWARE;
 			write_sram(SP,(pc+1));
 			DEC_SP;
 			write_sram(SP,(pc+1)>>8);
 			DEC_SP;
 			pc = arg2_8;
-			break;
+			PROFILE_CALL;
+			END_INSN;
 
-		case  15: // 1001 1000 AAAA Abbb		(2) CBI A,b
-			update_hardware();
+		INSN(15): // 1001 1000 AAAA Abbb		(2) CBI A,b
+			UPDATE_HARDWARE;
 			Rd = arg1_8;
+			HOT_SAVE;
 			write_io(Rd, read_io(Rd) & ~(1<<(arg2_8)));
-			break;
+			HOT_LOAD;
+			END_INSN;
 
-		case  16: // 1001 010d dddd 0000		(1) COM Rd
+		INSN(16): // 1001 010d dddd 0000		(1) COM Rd
 			r[arg1_8] = R = ~r[arg1_8];
-			clr_bits(SREG, SREG_CM | SREG_ZM | SREG_NM | SREG_VM | SREG_SM);
-			UPDATE_SVN_LOGICAL; UPDATE_Z; SET_C;
-			break;
+			LAZY_CLEAR(SREG_CM);
+			SET_C;
+			LAZY_RESULT(LF_LOGIC);
+			END_INSN;
 
-		case  17: // 0001 01rd dddd rrrr		(1) CP Rd,Rr
+		INSN(17): // 0001 01rd dddd rrrr		(1) CP Rd,Rr
 			Rd = r[arg1_8];
 			Rr = r[arg2_8];
 			R = Rd - Rr;
-			clr_bits(SREG, SREG_CM | SREG_ZM | SREG_NM | SREG_VM | SREG_SM | SREG_HM);
-			UPDATE_HC_SUB; UPDATE_SVN_SUB; UPDATE_Z;
-			break;
+			LAZY_FLAGS(LF_SUB, SREG_CM | SREG_ZM | SREG_NM | SREG_VM | SREG_SM | SREG_HM);
+			END_INSN;
 
-		case  18: // 0000 01rd dddd rrrr		(1) CPC Rd,Rr
+		INSN(18): // 0000 01rd dddd rrrr		(1) CPC Rd,Rr
+			LAZY_SYNC(SREG_CM | SREG_ZM);
 			Rd = r[arg1_8];
 			Rr = r[arg2_8];
 			R = Rd - Rr - C;
-			clr_bits(SREG, SREG_CM | SREG_NM | SREG_VM | SREG_SM | SREG_HM);
-			UPDATE_HC_SUB; UPDATE_SVN_SUB; UPDATE_CLEAR_Z;
-			break;
+			LAZY_FLAGS(LF_SUB, SREG_CM | SREG_NM | SREG_VM | SREG_SM | SREG_HM);
+			UPDATE_CLEAR_Z;
+			END_INSN;
 
-		case  19: // 0011 KKKK dddd KKKK		(1) CPI Rd,K
+		INSN(19): // 0011 KKKK dddd KKKK		(1) CPI Rd,K
 			Rd = r[arg1_8];
 			Rr = arg2_8;
 			R = Rd - Rr;
-			clr_bits(SREG, SREG_CM | SREG_ZM | SREG_NM | SREG_VM | SREG_SM | SREG_HM);
-			UPDATE_HC_SUB; UPDATE_SVN_SUB; UPDATE_Z;
-			break;
+			LAZY_FLAGS(LF_SUB, SREG_CM | SREG_ZM | SREG_NM | SREG_VM | SREG_SM | SREG_HM);
+			END_INSN;
 
-		case  20: // 0001 00rd dddd rrrr		(1/2/3) CPSE Rd,Rr
+		INSN(20): // 0001 00rd dddd rrrr		(1/2/3) CPSE Rd,Rr
 			Rd = r[arg1_8];
 			Rr = r[arg2_8];
 			if (Rd == Rr)
@@ -1370,186 +2130,183 @@ unsigned int avr8::exec()
 				pc += icc;
 				while (icc != 0U)
 				{
-					update_hardware();
+					UPDATE_HARDWARE;
 					icc --;
 				}
 			}
-			break;
+			END_INSN;
 
-		case  21: // 1001 010d dddd 1010		(1) DEC Rd
+		INSN(21): // 1001 010d dddd 1010		(1) DEC Rd
 			R = --r[arg1_8];
-			clr_bits(SREG, SREG_ZM | SREG_NM | SREG_VM | SREG_SM);
-			UPDATE_N;
-			set_bit_inv(SREG,SREG_V,(unsigned int)(R) - 0x7FU);
-			UPDATE_S;
-			UPDATE_Z;
-			break;
+			LAZY_RESULT(LF_DEC);
+			END_INSN;
 
-		case  22: // 0010 01rd dddd rrrr		(1) EOR Rd,Rr (CLR is EOR Rd,Rd)
+		INSN(22): // 0010 01rd dddd rrrr		(1) EOR Rd,Rr (CLR is EOR Rd,Rd)
 			Rd = r[arg1_8];
 			Rr = r[arg2_8];
 			R = Rd ^ Rr;
-			clr_bits(SREG, SREG_ZM | SREG_NM | SREG_VM | SREG_SM);
-			UPDATE_SVN_LOGICAL; UPDATE_Z;
+			LAZY_RESULT(LF_LOGIC);
 			r[arg1_8] = R;
-			break;
+			END_INSN;
 		
-		case  23: // 0000 0011 0ddd 1rrr		(2) FMUL Rd,Rr (registers are in 16-23 range)
+		INSN(23): // 0000 0011 0ddd 1rrr		(2) FMUL Rd,Rr (registers are in 16-23 range)
 			Rd = r[arg1_8];
 			Rr = r[arg2_8];
 			uTmp = (u8)Rd * (u8)Rr;
 			r0 = (u8)(uTmp << 1);
 			r1 = (u8)(uTmp >> 7);
+			LAZY_CLEAR(SREG_CM | SREG_ZM);
 			clr_bits(SREG, SREG_CM | SREG_ZM);
 			UPDATE_CZ_MUL(uTmp);
-			update_hardware();
-			break;
+			UPDATE_HARDWARE;
+			END_INSN;
 
-		case  24: // 0000 0011 1ddd 0rrr		(2) FMULS Rd,Rr
+		INSN(24): // 0000 0011 1ddd 0rrr		(2) FMULS Rd,Rr
 			Rd = r[arg1_8];
 			Rr = r[arg2_8];
 			sTmp = (s8)Rd * (s8)Rr;
 			r0 = (u8)(sTmp << 1);
 			r1 = (u8)(sTmp >> 7);
+			LAZY_CLEAR(SREG_CM | SREG_ZM);
 			clr_bits(SREG, SREG_CM | SREG_ZM);
 			UPDATE_CZ_MUL(sTmp);
-			update_hardware();
-			break;
+			UPDATE_HARDWARE;
+			END_INSN;
 
-		case  25: // 0000 0011 1ddd 1rrr		(2) FMULSU Rd,Rr
+		INSN(25): // 0000 0011 1ddd 1rrr		(2) FMULSU Rd,Rr
 			Rd = r[arg1_8];
 			Rr = r[arg2_8];
 			sTmp = (s8)Rd * (u8)Rr;
 			r0 = (u8)(sTmp << 1);
 			r1 = (u8)(sTmp >> 7);
+			LAZY_CLEAR(SREG_CM | SREG_ZM);
 			clr_bits(SREG, SREG_CM | SREG_ZM);
 			UPDATE_CZ_MUL(sTmp);
-			update_hardware();
-			break;
+			UPDATE_HARDWARE;
+			END_INSN;
 
-		case  26: // 1001 0101 0000 1001		(3) ICALL (call thru Z register)
-			update_hardware();
-			update_hardware();
+		INSN(26): // 1001 0101 0000 1001		(3) ICALL (call thru Z register)
+			UPDATE_HARDWARE;
+			UPDATE_HARDWARE;
 			write_sram(SP,u8(pc));
 			DEC_SP;
 			write_sram(SP,(pc)>>8);
 			DEC_SP;
 			pc = Z;
-			break;
+			PROFILE_CALL;
+			END_INSN;
 
-		case  27: // 1001 0100 0000 1001		(2) IJMP (jump thru Z register)
-			update_hardware_fast();
+		INSN(27): // 1001 0100 0000 1001		(2) IJMP (jump thru Z register)
+			UPDATE_HARDWARE;
 			pc = Z;
-			break;
+			END_INSN;
 
-		case  28: // 1011 0AAd dddd AAAA		(1) IN Rd,A
+		INSN(28): // 1011 0AAd dddd AAAA		(1) IN Rd,A
 			Rd = arg1_8;
 			Rr = arg2_8;
+			HOT_SAVE;
 			r[Rd] = read_io(Rr);
-			break;
+			END_INSN;
 
-		case  29: // 1001 010d dddd 0011		(1) INC Rd
+		INSN(29): // 1001 010d dddd 0011		(1) INC Rd
 			R = ++r[arg1_8];
-			clr_bits(SREG, SREG_ZM | SREG_NM | SREG_VM | SREG_SM);
-			UPDATE_N;
-			set_bit_inv(SREG,SREG_V,(unsigned int)(R) - 0x80U);
-			UPDATE_S;
-			UPDATE_Z;
-			break;
+			LAZY_RESULT(LF_INC);
+			END_INSN;
 
-		case  30: // 1001 010k kkkk 110k		(3) JMP k (next word is rest of address)
+		INSN(30): // 1001 010k kkkk 110k		(3) JMP k (next word is rest of address)
 			// Note: 64K progmem, so 'k' in first insn word is unused
-			update_hardware();
-			update_hardware();
+			UPDATE_HARDWARE;
+			UPDATE_HARDWARE;
 			pc = arg2_8;
-			break;
+			END_INSN;
 
-		case  31: // 1001 000d dddd 1110		(2) LD rd,-X
-			update_hardware();
+		INSN(31): // 1001 000d dddd 1110		(2) LD rd,-X
+			UPDATE_HARDWARE;
 			DEC_X;
-			r[arg1_8] = read_sram_io(X);
-			break;
+			READ_DATA(r[arg1_8], X);
+			END_INSN;
 
-		case  32: // 1001 000d dddd 1010		(2) LD Rd,-Y
-			update_hardware();
+		INSN(32): // 1001 000d dddd 1010		(2) LD Rd,-Y
+			UPDATE_HARDWARE;
 			DEC_Y;
-			r[arg1_8] = read_sram_io(Y);
-			break;
+			READ_DATA(r[arg1_8], Y);
+			END_INSN;
 
-		case  33: // 1001 000d dddd 0010		(2) LD Rd,-Z
-			update_hardware();
+		INSN(33): // 1001 000d dddd 0010		(2) LD Rd,-Z
+			UPDATE_HARDWARE;
 			DEC_Z;
-			r[arg1_8] = read_sram_io(Z);
-			break;
+			READ_DATA(r[arg1_8], Z);
+			END_INSN;
 
-		case  34: // 1001 000d dddd 1100		(2) LD rd,X
-			update_hardware();
-			r[arg1_8] = read_sram_io(X);
-			break;
+		INSN(34): // 1001 000d dddd 1100		(2) LD rd,X
+			UPDATE_HARDWARE;
+			READ_DATA(r[arg1_8], X);
+			END_INSN;
 
-		case  35: // 1001 000d dddd 1101		(2) LD rd,X+
-			update_hardware();
-			r[arg1_8] = read_sram_io(X);
+		INSN(35): // 1001 000d dddd 1101		(2) LD rd,X+
+			UPDATE_HARDWARE;
+			READ_DATA(r[arg1_8], X);
 			INC_X;
-			break;
+			END_INSN;
 
-		case  36: // 1001 000d dddd 1001		(2) LD Rd,Y+
-			update_hardware();
-			r[arg1_8] = read_sram_io(Y);
+		INSN(36): // 1001 000d dddd 1001		(2) LD Rd,Y+
+			UPDATE_HARDWARE;
+			READ_DATA(r[arg1_8], Y);
 			INC_Y;
-			break;
+			END_INSN;
 
-		case  37: // 10q0 qq0d dddd 1qqq		(2) LDD Rd,Y+q
-			update_hardware();
+		INSN(37): // 10q0 qq0d dddd 1qqq		(2) LDD Rd,Y+q
+			UPDATE_HARDWARE;
 			Rd = arg1_8;
 			Rr = arg2_8;
-			r[Rd] = read_sram_io(Y + Rr);
-			break;
+			READ_DATA(r[Rd], Y + Rr);
+			END_INSN;
 
-		case  38: // 1001 000d dddd 0001		(2) LD Rd,Z+
-			update_hardware();
-			r[arg1_8] = read_sram_io(Z);
+		INSN(38): // 1001 000d dddd 0001		(2) LD Rd,Z+
+			UPDATE_HARDWARE;
+			READ_DATA(r[arg1_8], Z);
 			INC_Z;
-			break;
+			END_INSN;
 
-		case  39: // 10q0 qq0d dddd 0qqq		(2) LDD Rd,Z+q
-			update_hardware();
+		INSN(39): // 10q0 qq0d dddd 0qqq		(2) LDD Rd,Z+q
+			UPDATE_HARDWARE;
 			Rd = arg1_8;
 			Rr = arg2_8;
-			r[Rd] = read_sram_io(Z + Rr);
-			break;
+			READ_DATA(r[Rd], Z + Rr);
+			END_INSN;
 
-		case  40: // 1110 KKKK dddd KKKK		(1) LDI Rd,K (SER is just LDI Rd,255)
+		INSN(40): // 1110 KKKK dddd KKKK		(1) LDI Rd,K (SER is just LDI Rd,255)
 			r[arg1_8] = arg2_8;
-			break;
+			END_INSN;
 
-		case  41: // 1001 000d dddd 0000		(2) LDS Rd,k (next word is rest of address)
-			update_hardware();
-			r[arg1_8] = read_sram_io(arg2_8);
+		INSN(41): // 1001 000d dddd 0000		(2) LDS Rd,k (next word is rest of address)
+			UPDATE_HARDWARE;
+			READ_DATA(r[arg1_8], arg2_8);
 			pc++;
-			break;
+			END_INSN;
 
-		case  42: // 1001 0101 1100 1000		(3) LPM (r0 implied, why is this special?)
-			update_hardware();
-			update_hardware();
+		INSN(42): // 1001 0101 1100 1000		(3) LPM (r0 implied, why is this special?)
+			UPDATE_HARDWARE;
+			UPDATE_HARDWARE;
 			r0 = read_progmem(Z);
-			break;
+			END_INSN;
 
-		case  43: // 1001 000d dddd 0100		(3) LPM Rd,Z
-			update_hardware_fast();
-			update_hardware_fast();
+		INSN(43): // 1001 000d dddd 0100		(3) LPM Rd,Z
+			UPDATE_HARDWARE;
+			UPDATE_HARDWARE;
 			r[arg1_8] = read_progmem(Z);
-			break;
+			END_INSN;
 
-		case  44: // 1001 000d dddd 0101		(3) LPM Rd,Z+
-			update_hardware_fast();
-			update_hardware_fast();
+		INSN(44): // 1001 000d dddd 0101		(3) LPM Rd,Z+
+			UPDATE_HARDWARE;
+			UPDATE_HARDWARE;
 			r[arg1_8] = read_progmem(Z);
 			INC_Z;
-			break;
+			END_INSN;
 
-		case  45: // 1001 010d dddd 0110		(1) LSR Rd
+		INSN(45): // 1001 010d dddd 0110		(1) LSR Rd
 			Rd = r[arg1_8];
+			LAZY_CLEAR(SREG_CM | SREG_ZM | SREG_NM | SREG_VM | SREG_SM);
 			clr_bits(SREG, SREG_CM | SREG_ZM | SREG_NM | SREG_VM | SREG_SM);
 			set_bit_1(SREG,SREG_C,Rd&1);
 			r[arg1_8] = R = (Rd >> 1);
@@ -1557,216 +2314,239 @@ unsigned int avr8::exec()
 			set_bit_1(SREG,SREG_V,Rd&1);
 			UPDATE_S;
 			UPDATE_Z;
-			break;
+			END_INSN;
 
-		case  46: // 0010 11rd dddd rrrr		(1) MOV Rd,Rr
+		INSN(46): // 0010 11rd dddd rrrr		(1) MOV Rd,Rr
 			r[arg1_8]  = r[arg2_8];
-			break;
+			END_INSN;
 
-		case  47: // 0000 0001 dddd rrrr		(1) MOVW Rd+1:Rd,Rr+1:R
+		INSN(47): // 0000 0001 dddd rrrr		(1) MOVW Rd+1:Rd,Rr+1:R
 			Rd = arg1_8;
 			Rr = arg2_8;
 			r[Rd] = r[Rr];
 			r[Rd+1] = r[Rr+1];
-			break;
+			END_INSN;
 
-		case  48: // 1001 11rd dddd rrrr		(2) MUL Rd,Rr
+		INSN(48): // 1001 11rd dddd rrrr		(2) MUL Rd,Rr
 			Rd = r[arg1_8];
 			Rr = r[arg2_8];
 			uTmp = Rd * Rr;
 			r0 = (u8)uTmp;
 			r1 = (u8)(uTmp >> 8);
+			LAZY_CLEAR(SREG_CM | SREG_ZM);
 			clr_bits(SREG, SREG_CM | SREG_ZM);
 			UPDATE_CZ_MUL(uTmp);
-			update_hardware_fast();
-			break;
+			UPDATE_HARDWARE;
+			END_INSN;
 
-		case  49: // 0000 0010 dddd rrrr		(2) MULS Rd,Rr
+		INSN(49): // 0000 0010 dddd rrrr		(2) MULS Rd,Rr
 			Rd = r[arg1_8];
 			Rr = r[arg2_8];
 			sTmp = (s8)Rd * (s8)Rr;
 			r0 = (u8)sTmp;
 			r1 = (u8)(sTmp >> 8);
+			LAZY_CLEAR(SREG_CM | SREG_ZM);
 			clr_bits(SREG, SREG_CM | SREG_ZM);
 			UPDATE_CZ_MUL(sTmp);
-			update_hardware();
-			break;
+			UPDATE_HARDWARE;
+			END_INSN;
 
-		case  50: // 0000 0011 0ddd 0rrr		(2) MULSU Rd,Rr (registers are in 16-23 range)
+		INSN(50): // 0000 0011 0ddd 0rrr		(2) MULSU Rd,Rr (registers are in 16-23 range)
 			Rd = r[arg1_8];
 			Rr = r[arg2_8];
 			sTmp = (s8)Rd * (u8)Rr;
 			r0 = (u8)sTmp;
 			r1 = (u8)(sTmp >> 8);
+			LAZY_CLEAR(SREG_CM | SREG_ZM);
 			clr_bits(SREG, SREG_CM | SREG_ZM);
 			UPDATE_CZ_MUL(sTmp);
-			update_hardware();
-			break;
+			UPDATE_HARDWARE;
+			END_INSN;
 
-		case  51: // 1001 010d dddd 0001		(1) NEG Rd
+		INSN(51): // 1001 010d dddd 0001		(1) NEG Rd
 			Rr = r[arg1_8];
 			Rd = 0;
 			r[arg1_8] = R = Rd - Rr;
-			clr_bits(SREG, SREG_CM | SREG_ZM | SREG_NM | SREG_VM | SREG_SM | SREG_HM);
-			UPDATE_HC_SUB; UPDATE_SVN_SUB; UPDATE_Z;
-			break;
+			LAZY_FLAGS(LF_SUB, SREG_CM | SREG_ZM | SREG_NM | SREG_VM | SREG_SM | SREG_HM);
+			END_INSN;
 
-		case  52: // 0000 0000 0000 0000		(1) NOP
-			break;
+		INSN(52): // 0000 0000 0000 0000		(1) NOP
+			END_INSN;
 
-		case  53: // 0010 10rd dddd rrrr		(1) OR Rd,Rr
+		INSN(53): // 0010 10rd dddd rrrr		(1) OR Rd,Rr
 			Rd = r[arg1_8];
 			Rr = r[arg2_8];
 			R = Rd | Rr;
-			clr_bits(SREG, SREG_ZM | SREG_NM | SREG_VM | SREG_SM);
-			UPDATE_SVN_LOGICAL; UPDATE_Z;
+			LAZY_RESULT(LF_LOGIC);
 			r[arg1_8] = R;
-			break;
+			END_INSN;
 
-		case  54: // 0110 KKKK dddd KKKK		(1) ORI Rd,K (same as SBR insn)
+		INSN(54): // 0110 KKKK dddd KKKK		(1) ORI Rd,K (same as SBR insn)
 			Rd = r[arg1_8];
 			Rr = arg2_8;
 			R = Rd | Rr;
-			clr_bits(SREG, SREG_ZM | SREG_NM | SREG_VM | SREG_SM);
-			UPDATE_SVN_LOGICAL; UPDATE_Z;
+			LAZY_RESULT(LF_LOGIC);
 			r[arg1_8] = R;
-			break;
+			END_INSN;
 
-		case  55: // 1011 1AAd dddd AAAA		(1) OUT A,Rd
+		INSN(55): // 1011 1AAd dddd AAAA		(1) OUT A,Rd
 			Rd = arg2_8;
 			Rr = arg1_8;
-			write_io(Rr,r[Rd]);
-			break;
+			if (Rr == ports::PORTC)
+			{
+				// Pixel output, see write_io
+				R = r[Rd] & DDRC;
+				if (R != pixel_raw)
+				{
+					pixel_raw = R;
+					pixel_event(cycleCounter, R);
+				}
+			}
+			else
+			{
+				HOT_SAVE;
+				write_io(Rr,r[Rd]);
+				HOT_LOAD;
+			}
+			END_INSN;
 
-		case  56: // 1001 000d dddd 1111		(2) POP Rd
-			update_hardware();
+		INSN(56): // 1001 000d dddd 1111		(2) POP Rd
+			UPDATE_HARDWARE;
 			INC_SP;
 			r[arg1_8] = read_sram(SP);
-			break;
+			END_INSN;
 
-		case  57: // 1001 001d dddd 1111		(2) PUSH Rd
-			update_hardware();
+		INSN(57): // 1001 001d dddd 1111		(2) PUSH Rd
+			UPDATE_HARDWARE;
 			write_sram(SP,r[arg1_8]);
 			DEC_SP;
-			break;
+			END_INSN;
 
-		case  58: // 1101 kkkk kkkk kkkk		(3) RCALL k
-			update_hardware();
-			update_hardware();
+		INSN(58): // 1101 kkkk kkkk kkkk		(3) RCALL k
+			UPDATE_HARDWARE;
+			UPDATE_HARDWARE;
 			write_sram(SP,(u8)pc);
 			DEC_SP;
 			write_sram(SP,pc>>8);
 			DEC_SP;
 			pc += arg2_8;
-			break;
+			PROFILE_CALL;
+			END_INSN;
 
-		case  59: // 1001 0101 0000 1000		(4) RET
-			update_hardware();
-			update_hardware();
-			update_hardware();
+		INSN(59): // 1001 0101 0000 1000		(4) RET
+			UPDATE_HARDWARE;
+			UPDATE_HARDWARE;
+			UPDATE_HARDWARE;
 			INC_SP;
 			pc = read_sram(SP) << 8;
 			INC_SP;
 			pc |= read_sram(SP);
-			break;
+			PROFILE_RET;
+			END_INSN;
 
-		case  60: // 1001 0101 0001 1000		(4) RETI
-			update_hardware();
-			update_hardware();
-			update_hardware();
+		INSN(60): // 1001 0101 0001 1000		(4) RETI
+			UPDATE_HARDWARE;
+			UPDATE_HARDWARE;
+			UPDATE_HARDWARE;
 			INC_SP;
 			pc = read_sram(SP) << 8;
 			INC_SP;
 			pc |= read_sram(SP);
+			PROFILE_RET;
 			SREG |= (1<<SREG_I);
+			insPending = true;
 			//--interruptLevel;
-			break;
+			END_INSN;
 
-		case  61: // 1100 kkkk kkkk kkkk		(2) RJMP k
-			update_hardware_fast();
+		INSN(61): // 1100 kkkk kkkk kkkk		(2) RJMP k
+			UPDATE_HARDWARE;
 			pc += arg2_8;
-			break;
+			END_INSN;
 
-		case  62: // 1001 010d dddd 0111		(1) ROR Rd
+		INSN(62): // 1001 010d dddd 0111		(1) ROR Rd
+			LAZY_SYNC(SREG_CM);
 			Rd = r[arg1_8];
 			r[arg1_8] = R = (Rd >> 1) | ((SREG&1)<<7);
+			LAZY_CLEAR(SREG_CM | SREG_ZM | SREG_NM | SREG_VM | SREG_SM);
 			clr_bits(SREG, SREG_CM | SREG_ZM | SREG_NM | SREG_VM | SREG_SM);
 			set_bit_1(SREG,SREG_C,Rd&1);
 			UPDATE_N;
 			set_bit_1(SREG,SREG_V,(R>>7)^(Rd&1));
 			UPDATE_S;
 			UPDATE_Z;
-			break;
+			END_INSN;
 
-		case  63: // 0000 10rd dddd rrrr		(1) SBC Rd,Rr
+		INSN(63): // 0000 10rd dddd rrrr		(1) SBC Rd,Rr
+			LAZY_SYNC(SREG_CM | SREG_ZM);
 			Rd = r[arg1_8];
 			Rr = r[arg2_8];
 			R = Rd - Rr - C;
-			clr_bits(SREG, SREG_CM | SREG_NM | SREG_VM | SREG_SM | SREG_HM);
-			UPDATE_HC_SUB; UPDATE_SVN_SUB; UPDATE_CLEAR_Z;
+			LAZY_FLAGS(LF_SUB, SREG_CM | SREG_NM | SREG_VM | SREG_SM | SREG_HM);
+			UPDATE_CLEAR_Z;
 			r[arg1_8] = R;
-			break;
+			END_INSN;
 
-		case  64: // 0100 KKKK dddd KKKK		(1) SBCI Rd,K
+		INSN(64): // 0100 KKKK dddd KKKK		(1) SBCI Rd,K
+			LAZY_SYNC(SREG_CM | SREG_ZM);
 			Rd = r[arg1_8];
 			Rr = arg2_8;
 			R = Rd - Rr - C;
-			clr_bits(SREG, SREG_CM | SREG_NM | SREG_VM | SREG_SM | SREG_HM);
-			UPDATE_HC_SUB; UPDATE_SVN_SUB; UPDATE_CLEAR_Z;
+			LAZY_FLAGS(LF_SUB, SREG_CM | SREG_NM | SREG_VM | SREG_SM | SREG_HM);
+			UPDATE_CLEAR_Z;
 			r[arg1_8] = R;
-			break;
+			END_INSN;
 
-		case  65: // 1001 1010 AAAA Abbb		(2) SBI A,b
-			update_hardware();
+		INSN(65): // 1001 1010 AAAA Abbb		(2) SBI A,b
+			UPDATE_HARDWARE;
 			Rd = arg1_8;
+			HOT_SAVE;
 			write_io(Rd, read_io(Rd) | (1<<(arg2_8)));
-			break;
+			HOT_LOAD;
+			END_INSN;
 
-		case  66: // 1001 1001 AAAA Abbb		(1/2/3) SBIC A,b
+		INSN(66): // 1001 1001 AAAA Abbb		(1/2/3) SBIC A,b
 			Rd = arg1_8;
+			HOT_SAVE;
 			if (!(read_io(Rd) & (1<<(arg2_8))))
 			{
 				unsigned int icc = get_insn_size(progmemDecoded[pc].opNum);
 				pc += icc;
 				while (icc != 0U)
 				{
-					update_hardware();
+					UPDATE_HARDWARE;
 					icc --;
 				}
 			}
-			break;
+			END_INSN;
 
-		case  67: // 1001 1011 AAAA Abbb		(1/2/3) SBIS A,b
+		INSN(67): // 1001 1011 AAAA Abbb		(1/2/3) SBIS A,b
 			Rd = arg1_8;
+			HOT_SAVE;
 			if (read_io(Rd) & (1<<(arg2_8)))
 			{
 				unsigned int icc = get_insn_size(progmemDecoded[pc].opNum);
 				pc += icc;
 				while (icc != 0U)
 				{
-					update_hardware();
+					UPDATE_HARDWARE;
 					icc --;
 				}
 			}
-			break;
+			END_INSN;
 
-		case  68: // 1001 0111 KKdd KKKK		(2) SBIW Rd+1:Rd,K
+		INSN(68): // 1001 0111 KKdd KKKK		(2) SBIW Rd+1:Rd,K
 			Rd = arg1_8;
 			Rr = arg2_8;
 			Rd16 = r[Rd] | (r[Rd+1]<<8);
 			R16 = Rd16 - Rr;
 			r[Rd] = (u8)R16;
 			r[Rd+1] = (u8)(R16>>8);
-			clr_bits(SREG, SREG_CM | SREG_ZM | SREG_NM | SREG_VM | SREG_SM);
-			set_bit_1(SREG,SREG_V,((Rd16&~R16)&0x8000) >> 15);
-			set_bit_1(SREG,SREG_N,(R16&0x8000) >> 15);
-			UPDATE_S;
-			set_bit_inv(SREG,SREG_Z,R16);
-			set_bit_1(SREG,SREG_C,((R16&~Rd16)&0x8000) >> 15);
-			update_hardware();
-			break;
+			LAZY_SYNC(SREG_HM);
+			LAZY_FLAGS16(LF_SBIW, SREG_CM | SREG_ZM | SREG_NM | SREG_VM | SREG_SM);
+			UPDATE_HARDWARE;
+			END_INSN;
 
-		case  69: // 1111 110r rrrr 0bbb		(1/2/3) SBRC Rr,b
+		INSN(69): // 1111 110r rrrr 0bbb		(1/2/3) SBRC Rr,b
 			Rd = r[arg1_8];
 			if (((Rd >> (arg2_8)) & 1U) == 0)
 			{
@@ -1774,13 +2554,13 @@ unsigned int avr8::exec()
 				pc += icc;
 				while (icc != 0U)
 				{
-					update_hardware();
+					UPDATE_HARDWARE;
 					icc --;
 				}
 			}
-			break;
+			END_INSN;
 
-		case  70: // 1111 111r rrrr 0bbb		(1/2/3) SBRS Rr,b
+		INSN(70): // 1111 111r rrrr 0bbb		(1/2/3) SBRS Rr,b
 			Rd = r[arg1_8];
 			if (((Rd >> (arg2_8)) & 1U) == 1)
 			{
@@ -1788,146 +2568,482 @@ unsigned int avr8::exec()
 				pc += icc;
 				while (icc != 0U)
 				{
-					update_hardware();
+					UPDATE_HARDWARE;
 					icc --;
 				}
 			}
-			break;
+			END_INSN;
 
-		case  71: // 1001 0101 1000 1000		(?) SLEEP
+		INSN(71): // 1001 0101 1000 1000		(?) SLEEP
 			elapsedCyclesSleep=cycleCounter-lastCyclesSleep;
 			lastCyclesSleep=cycleCounter;
-			break;
+			END_INSN;
 
-		case  72: // 1001 0101 1110 1000		(?) SPM Z (writes R1:R0)
-			update_hardware();
-			update_hardware(); // Cycle count undocumented?!?!?
-			update_hardware(); // (4 cycles emulated)
+		INSN(72): // 1001 0101 1110 1000		(?) SPM Z (writes R1:R0)
+			UPDATE_HARDWARE;
+			UPDATE_HARDWARE; // Cycle count undocumented?!?!?
+			UPDATE_HARDWARE; // (4 cycles emulated)
 			if (Z >= progSize/2)
 			{
 				fprintf(stderr,"illegal write to progmem addr %x\n",Z);
 				shutdown(1);
 			}else{
+				if (!flashWritten) keep_rom();
 				progmem[Z] = r0 | (r1<<8);
 				decodeFlash(Z-1);
 				decodeFlash(Z);
 			}
-			break;
+			END_INSN;
 
-		case  73: // 1001 001r rrrr 1110		(2) ST -X,Rr
-			update_hardware();
+		INSN(73): // 1001 001r rrrr 1110		(2) ST -X,Rr
+			UPDATE_HARDWARE;
 			DEC_X;
-			write_sram_io(X,r[arg1_8]);
-			break;
+			WRITE_DATA(X, r[arg1_8]);
+			END_INSN;
 
-		case  74: // 1001 001r rrrr 1010		(2) ST -Y,Rr
-			update_hardware();
+		INSN(74): // 1001 001r rrrr 1010		(2) ST -Y,Rr
+			UPDATE_HARDWARE;
 			DEC_Y;
-			write_sram_io(Y,r[arg1_8]);
-			break;
+			WRITE_DATA(Y, r[arg1_8]);
+			END_INSN;
 
-		case  75: // 1001 001r rrrr 0010		(2) ST -Z,Rr
-			update_hardware();
+		INSN(75): // 1001 001r rrrr 0010		(2) ST -Z,Rr
+			UPDATE_HARDWARE;
 			DEC_Z;
-			write_sram_io(Z,r[arg1_8]);
-			break;
+			WRITE_DATA(Z, r[arg1_8]);
+			END_INSN;
 
-		case  76: // 1001 001r rrrr 1100		(2) ST X,Rr
-			update_hardware();
-			write_sram_io(X,r[arg1_8]);
-			break;
+		INSN(76): // 1001 001r rrrr 1100		(2) ST X,Rr
+			UPDATE_HARDWARE;
+			WRITE_DATA(X, r[arg1_8]);
+			END_INSN;
 
-		case  77: // 1001 001r rrrr 1101		(2) ST X+,Rr
-			update_hardware();
-			write_sram_io(X,r[arg1_8]);
+		INSN(77): // 1001 001r rrrr 1101		(2) ST X+,Rr
+			UPDATE_HARDWARE;
+			WRITE_DATA(X, r[arg1_8]);
 			INC_X;
-			break;
+			END_INSN;
 
-		case  78: // 1001 001r rrrr 1001		(2) ST Y+,Rr
-			update_hardware();
-			write_sram_io(Y,r[arg1_8]);
+		INSN(78): // 1001 001r rrrr 1001		(2) ST Y+,Rr
+			UPDATE_HARDWARE;
+			WRITE_DATA(Y, r[arg1_8]);
 			INC_Y;
-			break;
+			END_INSN;
 
-		case  79: // 10q0 qq1d dddd 1qqq		(2) STD Y+q,Rd
+		INSN(79): // 10q0 qq1d dddd 1qqq		(2) STD Y+q,Rd
 			Rd = arg1_8;
 			Rr = arg2_8;
-			update_hardware();
-			write_sram_io(Y + Rr, r[Rd]);
-			break;
+			UPDATE_HARDWARE;
+			WRITE_DATA(Y + Rr, r[Rd]);
+			END_INSN;
 
-		case  80: // 1001 001r rrrr 0001		(2) ST Z+,Rr
-			update_hardware();
-			write_sram_io(Z,r[arg1_8]);
+		INSN(80): // 1001 001r rrrr 0001		(2) ST Z+,Rr
+			UPDATE_HARDWARE;
+			WRITE_DATA(Z, r[arg1_8]);
 			INC_Z;
-			break;
+			END_INSN;
 
-		case  81: // 10q0 qq1d dddd 0qqq		(2) STD Z+q,Rd
+		INSN(81): // 10q0 qq1d dddd 0qqq		(2) STD Z+q,Rd
 			Rd = arg1_8;
 			Rr = arg2_8;
-			update_hardware();
-			write_sram_io(Z + Rr, r[Rd]);
-			break;
+			UPDATE_HARDWARE;
+			WRITE_DATA(Z + Rr, r[Rd]);
+			END_INSN;
 
-		case  82: // 1001 001d dddd 0000		(2) STS k,Rr (next word is rest of address)
-			update_hardware();
-			write_sram_io(arg2_8,r[arg1_8]);
+		INSN(82): // 1001 001d dddd 0000		(2) STS k,Rr (next word is rest of address)
+			UPDATE_HARDWARE;
+			WRITE_DATA(arg2_8, r[arg1_8]);
 			pc++;
-			break;
+			END_INSN;
 
-		case  83: // 0001 10rd dddd rrrr		(1) SUB Rd,Rr
+		INSN(83): // 0001 10rd dddd rrrr		(1) SUB Rd,Rr
 			Rd = r[arg1_8];
 			Rr = r[arg2_8];
 			R = Rd - Rr;
-			clr_bits(SREG, SREG_CM | SREG_ZM | SREG_NM | SREG_VM | SREG_SM | SREG_HM);
-			UPDATE_HC_SUB; UPDATE_SVN_SUB; UPDATE_Z;
+			LAZY_FLAGS(LF_SUB, SREG_CM | SREG_ZM | SREG_NM | SREG_VM | SREG_SM | SREG_HM);
 			r[arg1_8] = R;
-			break;
+			END_INSN;
 
-		case  84: // 0101 KKKK dddd KKKK		(1) SUBI Rd,K
+		INSN(84): // 0101 KKKK dddd KKKK		(1) SUBI Rd,K
 			Rd = r[arg1_8];
 			Rr = arg2_8;
 			R = Rd - Rr;
-			clr_bits(SREG, SREG_CM | SREG_ZM | SREG_NM | SREG_VM | SREG_SM | SREG_HM);
-			UPDATE_HC_SUB; UPDATE_SVN_SUB; UPDATE_Z;
+			LAZY_FLAGS(LF_SUB, SREG_CM | SREG_ZM | SREG_NM | SREG_VM | SREG_SM | SREG_HM);
 			r[arg1_8] = R;
-			break;
+			END_INSN;
 
-		case  85: // 1001 010d dddd 0010		(1) SWAP Rd
+		INSN(85): // 1001 010d dddd 0010		(1) SWAP Rd
 			Rd = r[arg1_8];
 			r[arg1_8] = (Rd >> 4) | (Rd << 4);
-			break;
+			END_INSN;
 
-		case  86: // 1001 0101 1010 1000		(1) WDR
+		INSN(86): // 1001 0101 1010 1000		(1) WDR
 			//watchdog is based on a RC oscillator
 			//so add some random variation to simulate entropy
-			watchdogTimer=rand()%1024;
+			HOT_SAVE;
+			watchdog_set(watchdog_entropy()%1024);
+			HOT_LOAD;
 			if(prevWDR){
-				printf("WDR measured %u cycles\n", cycleCounter - prevWDR);
+				printf("WDR measured %u cycles\n", (unsigned int)(cycleCounter - prevWDR));
 				prevWDR = 0;
 			}else{
 				prevWDR = cycleCounter + 1;
 			}
-			break;
+			END_INSN;
+
+		// Fused instruction pairs, assigned by fuseInsn. The first
+		// instruction is the same as its plain handler, the second is
+		// run by jumping to its plain handler.
+
+		INSN(87): // CP Rd,Rr + BRBC / BRBS
+			Rd = r[arg1_8];
+			Rr = r[arg2_8];
+			R = Rd - Rr;
+			LAZY_FLAGS(LF_SUB, SREG_CM | SREG_ZM | SREG_NM | SREG_VM | SREG_SM | SREG_HM);
+			FUSE_NEXT;
+			if (opNum == 9) goto insn_9;
+			goto insn_10;
+
+		INSN(88): // CPC Rd,Rr + BRBC / BRBS
+			LAZY_SYNC(SREG_CM | SREG_ZM);
+			Rd = r[arg1_8];
+			Rr = r[arg2_8];
+			R = Rd - Rr - C;
+			LAZY_FLAGS(LF_SUB, SREG_CM | SREG_NM | SREG_VM | SREG_SM | SREG_HM);
+			UPDATE_CLEAR_Z;
+			FUSE_NEXT;
+			if (opNum == 9) goto insn_9;
+			goto insn_10;
+
+		INSN(89): // CPI Rd,K + BRBC / BRBS
+			Rd = r[arg1_8];
+			Rr = arg2_8;
+			R = Rd - Rr;
+			LAZY_FLAGS(LF_SUB, SREG_CM | SREG_ZM | SREG_NM | SREG_VM | SREG_SM | SREG_HM);
+			FUSE_NEXT;
+			if (opNum == 9) goto insn_9;
+			goto insn_10;
+
+		INSN(90): // SBIW Rd+1:Rd,K + BRBC / BRBS
+			Rd = arg1_8;
+			Rr = arg2_8;
+			Rd16 = r[Rd] | (r[Rd+1]<<8);
+			R16 = Rd16 - Rr;
+			r[Rd] = (u8)R16;
+			r[Rd+1] = (u8)(R16>>8);
+			LAZY_SYNC(SREG_HM);
+			LAZY_FLAGS16(LF_SBIW, SREG_CM | SREG_ZM | SREG_NM | SREG_VM | SREG_SM);
+			UPDATE_HARDWARE;
+			FUSE_NEXT;
+			if (opNum == 9) goto insn_9;
+			goto insn_10;
+
+		INSN(91): // LDI Rd,K + OUT A,Rr
+			r[arg1_8] = arg2_8;
+			FUSE_NEXT;
+			goto insn_55;
+
+		INSN(92): // LD Rd,X+ + OUT A,Rr (pixel output loops)
+			UPDATE_HARDWARE;
+			READ_DATA(r[arg1_8], X);
+			INC_X;
+			FUSE_NEXT;
+			goto insn_55;
+
+		INSN(93): // PUSH Rd + PUSH Rr (the second may be fused as well)
+			UPDATE_HARDWARE;
+			write_sram(SP,r[arg1_8]);
+			DEC_SP;
+			FUSE_NEXT;
+			if (opNum == 93) goto insn_93;
+			goto insn_57;
+
+		// Idle loop variants, assigned by markIdleLoop. These are the
+		// plain instructions, with the pass checked first (IDLE_LOOP)
+		// and the recorded pass dropped once the loop is left.
+
+		INSN(94): // BRBC s,k closing an idle loop
+			IDLE_LOOP;
+			if (!(SREG & (1<<(arg1_8))))
+			{
+				UPDATE_HARDWARE;
+				pc += arg2_8;
+			}
+			else
+			{
+				idlePc = IDLE_NONE;
+			}
+			END_INSN;
+
+		INSN(95): // BRBS s,k closing an idle loop
+			IDLE_LOOP;
+			if (SREG & (1<<(arg1_8)))
+			{
+				UPDATE_HARDWARE;
+				pc += arg2_8;
+			}
+			else
+			{
+				idlePc = IDLE_NONE;
+			}
+			END_INSN;
+
+		INSN(96): // RJMP k closing an idle loop
+			IDLE_LOOP;
+			UPDATE_HARDWARE;
+			pc += arg2_8;
+			END_INSN;
+
+		INSN(97): // SBIC A,b before the RJMP closing an idle loop
+			IDLE_LOOP;
+			HOT_SAVE;
+			if (!(read_io(arg1_8) & (1<<(arg2_8))))
+				IDLE_SKIP;
+			END_INSN;
+
+		INSN(98): // SBIS A,b before the RJMP closing an idle loop
+			IDLE_LOOP;
+			HOT_SAVE;
+			if (read_io(arg1_8) & (1<<(arg2_8)))
+				IDLE_SKIP;
+			END_INSN;
+
+		INSN(99): // SBRC Rr,b before the RJMP closing an idle loop
+			IDLE_LOOP;
+			if (((r[arg1_8] >> (arg2_8)) & 1U) == 0)
+				IDLE_SKIP;
+			END_INSN;
+
+		INSN(100): // SBRS Rr,b before the RJMP closing an idle loop
+			IDLE_LOOP;
+			if (((r[arg1_8] >> (arg2_8)) & 1U) == 1)
+				IDLE_SKIP;
+			END_INSN;
+
+		// Specialised variants, assigned by specialize from the static
+		// analysis of the program: the plain instructions without the
+		// flag updates no instruction reads, and LDS / STS of a constant
+		// SRAM address without the I/O checks.
+
+		INSN(101): // ADD Rd,Rr, flags dead
+			r[arg1_8] += r[arg2_8];
+			END_INSN;
+
+		INSN(102): // ADC Rd,Rr, flags dead
+			LAZY_SYNC(SREG_CM);
+			r[arg1_8] += r[arg2_8] + C;
+			END_INSN;
+
+		INSN(103): // SUB Rd,Rr, flags dead
+			r[arg1_8] -= r[arg2_8];
+			END_INSN;
+
+		INSN(104): // SUBI Rd,K, flags dead
+			r[arg1_8] -= arg2_8;
+			END_INSN;
+
+		INSN(105): // SBC Rd,Rr, flags dead
+			LAZY_SYNC(SREG_CM);
+			r[arg1_8] -= r[arg2_8] + C;
+			END_INSN;
+
+		INSN(106): // SBCI Rd,K, flags dead
+			LAZY_SYNC(SREG_CM);
+			r[arg1_8] -= arg2_8 + C;
+			END_INSN;
+
+		INSN(107): // AND Rd,Rr, flags dead
+			r[arg1_8] &= r[arg2_8];
+			END_INSN;
+
+		INSN(108): // ANDI Rd,K, flags dead
+			r[arg1_8] &= arg2_8;
+			END_INSN;
+
+		INSN(109): // OR Rd,Rr, flags dead
+			r[arg1_8] |= r[arg2_8];
+			END_INSN;
+
+		INSN(110): // ORI Rd,K, flags dead
+			r[arg1_8] |= arg2_8;
+			END_INSN;
+
+		INSN(111): // EOR Rd,Rr, flags dead
+			r[arg1_8] ^= r[arg2_8];
+			END_INSN;
+
+		INSN(112): // INC Rd, flags dead
+			r[arg1_8]++;
+			END_INSN;
+
+		INSN(113): // DEC Rd, flags dead
+			r[arg1_8]--;
+			END_INSN;
+
+		INSN(114): // LDS Rd,k with k in SRAM
+			UPDATE_HARDWARE;
+			r[arg1_8] = read_sram(arg2_8);
+			pc++;
+			END_INSN;
+
+		INSN(115): // STS k,Rr with k in SRAM
+			UPDATE_HARDWARE;
+			write_sram(arg2_8, r[arg1_8]);
+			pc++;
+			END_INSN;
 
-		default: // Illegal op.
+		default:
+		INSN( 0): // Illegal op.
 			ILLEGAL_OP;
-			break;
+			END_INSN;
 	}
 
 	// Process hardware for the last instruction cycle
 
-	update_hardware_fast();
+	UPDATE_HARDWARE;
 
 	// Run instruction precise emulation tasks
 
-	update_hardware_ins();
+	UPDATE_HARDWARE_INS;
+
+	// Continue until the deadline, then return cycles consumed.
 
-	// Done, return cycles consumed during the processing of this instruction.
+	if (cycleCounter >= stop)
+		goto exec_end;
+	goto next_insn;
 
+#ifndef NOGDB
+	// Stop in front of a breakpoint for run_debug to report it
+
+break_hit:
+	pc = currentPc;
+	gdbBreakpointFound = true;
+	goto exec_end;
+#endif // NOGDB
+
+#ifdef ENABLE_JIT
+	// Run a translated block, or interpret if it can not be entered now
+
+jit_block:
+	HOT_SAVE;
+	if (!jit_exec(stop - cycleCounter))
+		goto fetch_insn;
+	HOT_LOAD;
+
+	UPDATE_HARDWARE_INS;
+
+	if (cycleCounter < stop)
+		goto next_insn;
+#endif
+
+exec_end:
+	HOT_SAVE;
 	return cycleCounter - startcy;
 }
 
+#ifndef NOGDB
+// Execution under the debugger. Between polls of the gdb connection, every
+// GDB_POLL_CYCLES or on breakpoints, the program runs at full speed in the
+// debugger variant of run_until. While gdb holds the core, instructions are
+// run one at a time as it lets them.
+u64 avr8::run_debug(u64 target)
+{
+	const u64 startcy = cycleCounter;
+
+	while ((s64)(target - cycleCounter) > 0)
+	{
+		// Blocks until gdb lets the program go on
+		if (gdbBreakpointFound || gdb->stopped() || (s64)(cycleCounter - gdbPollAt) >= 0)
+		{
+			gdb->exec();
+			gdbPollAt = cycleCounter + GDB_POLL_CYCLES;
+		}
+
+		if (state == CPU_STOPPED)
+			break;
+
+		u64 until = target;
+		if (gdb->stopped())
+			until = cycleCounter + 1U; // Single step
+		else if ((s64)(gdbPollAt - until) < 0)
+			until = gdbPollAt;
+
+		// Stopped short on a breakpoint or the end of a frame
+		if (run_until_t<FEATURE_GDB>(until) == 0U || (s64)(until - cycleCounter) > 0)
+			break;
+	}
+
+	return cycleCounter - startcy;
+}
+#endif // NOGDB
+
+void avr8::setBreakpoint(u16 address, bool set)
+{
+	if (address >= (progSize/2))
+		return;
+
+	if (set)
+	{
+		breakpoints[address / 32U] |= 1U << (address % 32U);
+		progmemDecoded[address].opNum |= OP_BREAKPOINT;
+	}
+	else
+	{
+		breakpoints[address / 32U] &= ~(1U << (address % 32U));
+		progmemDecoded[address].opNum &= ~OP_BREAKPOINT;
+	}
+}
+
+void avr8::useFeatures(unsigned int features)
+{
+	// Indexed by FEATURE_GDB and FEATURE_PROFILE, the debugger wins
+#ifndef NOGDB
+	static u64 (avr8::*const runners[])(u64) = {
+		&avr8::run_until_t<0U>, &avr8::run_debug,
+		&avr8::run_until_t<FEATURE_PROFILE>, &avr8::run_debug
+	};
+#else
+	static u64 (avr8::*const runners[])(u64) = {
+		&avr8::run_until_t<0U>, &avr8::run_until_t<0U>,
+		&avr8::run_until_t<FEATURE_PROFILE>, &avr8::run_until_t<FEATURE_PROFILE>
+	};
+#endif // NOGDB
+	static void (avr8::*const writers[])(u8, u8) = {
+		&avr8::write_io_x<0x0U>, &avr8::write_io_x<0x1U>, &avr8::write_io_x<0x2U>,
+		&avr8::write_io_x<0x3U>, &avr8::write_io_x<0x4U>, &avr8::write_io_x<0x5U>,
+		&avr8::write_io_x<0x6U>, &avr8::write_io_x<0x7U>, &avr8::write_io_x<0x8U>,
+		&avr8::write_io_x<0x9U>, &avr8::write_io_x<0xAU>, &avr8::write_io_x<0xBU>,
+		&avr8::write_io_x<0xCU>, &avr8::write_io_x<0xDU>, &avr8::write_io_x<0xEU>,
+		&avr8::write_io_x<0xFU>
+	};
+
+	runUntil = runners[(features & FEATURE_GDB) | ((features & FEATURE_PROFILE) >> 3)];
+	profiling = (runUntil == &avr8::run_until_t<FEATURE_PROFILE>);
+	writeIoX = writers[features & FEATURES_ALL];
+}
+
+void avr8::selectFeatures()
+{
+	unsigned int features = 0U;
+
+#ifndef NOGDB
+	if (enableGdb)
+		features |= FEATURE_GDB;
+#endif // NOGDB
+	if (SD_ENABLED())
+		features |= FEATURE_SPI;
+#ifndef __EMSCRIPTEN__
+	if (recordMovie)
+		features |= FEATURE_RECORD;
+#endif // __EMSCRIPTEN__
+	if (captureMode != CAPTURE_NONE)
+		features |= FEATURE_CAPTURE;
+	if (profile != NULL && (features & FEATURE_GDB) == 0U)
+		features |= FEATURE_PROFILE;
+
+	useFeatures(features);
+}
+
 u16 avr8::decodeArg(u16 flash, u16 argMask, u8 argNeg){
 
 	u16 argMaskShift = 0x0001;
@@ -1957,13 +3073,8 @@ u16 avr8::decodeArg(u16 flash, u16 argMask, u8 argNeg){
 
 void avr8::instructionDecode(u16 address){
 
-	int i = 0;
-	u16 rawFlash;
-	u16 thisMask;
-	u16 arg1;
-	u16 arg2;
-
-	rawFlash = progmem[address];
+	const u16 rawFlash = progmem[address];
+	const u8 i = decodeTable.insn[rawFlash];
 
 	instructionDecode_t thisInst;
 
@@ -1971,45 +3082,344 @@ void avr8::instructionDecode(u16 address){
 	thisInst.arg1  = 0;
 	thisInst.arg2  = 0;
 
-	while(instructionList[i].opNum != 0){
-		thisMask = ~(instructionList[i].arg1Mask | instructionList[i].arg2Mask);
+	if (i != 0U){
+		const instructionList_t &insn = instructionList[i - 1U];
+		u16 arg1;
+		u16 arg2;
 
-		if((rawFlash & thisMask) == instructionList[i].mask){
+		arg1 = (decodeArg(rawFlash, insn.arg1Mask, insn.arg1Neg) * insn.arg1Mul) + insn.arg1Offset;
+		arg2 = (decodeArg(rawFlash, insn.arg2Mask, insn.arg2Neg) * insn.arg2Mul) + insn.arg2Offset;
 
-			arg1 = (decodeArg(rawFlash, instructionList[i].arg1Mask, instructionList[i].arg1Neg) * instructionList[i].arg1Mul) + instructionList[i].arg1Offset;
-			arg2 = (decodeArg(rawFlash, instructionList[i].arg2Mask, instructionList[i].arg2Neg) * instructionList[i].arg2Mul) + instructionList[i].arg2Offset;
+		if (insn.words == 2) { // the 2 word instructions have k16 as the 2nd word of total 32bit instruction
+			arg2 = progmem[address+1];
+		}
 
-			if (instructionList[i].words == 2) { // the 2 word instructions have k16 as the 2nd word of total 32bit instruction
-				arg2 = progmem[address+1];
-			}
+		thisInst.opNum = insn.opNum;
+		thisInst.arg1  = arg1;
+		thisInst.arg2  = arg2;
+	}
 
-			//fprintf(stdout, instructionList[i].opName, arg1, arg2);
-			//fprintf(stdout, "\n");
+	if (isBreakpoint(address))
+		thisInst.opNum |= OP_BREAKPOINT;
 
-			thisInst.opNum = instructionList[i].opNum;
-			thisInst.arg1  = arg1;
-			thisInst.arg2  = arg2;
-					
-			progmemDecoded[address] = thisInst;	
-			return;
+	progmemDecoded[address] = thisInst;
+}
+
+// Superinstructions: if the instruction at the address starts a frequent
+// pair, its opcode is replaced with a fused one, so run_until() runs both with
+// a single dispatch. The second instruction is left intact, so it remains
+// a valid jump target. Needs the next instruction already decoded (and
+// fused, for PUSH chains).
+void avr8::fuseInsn(u16 address){
+
+	if (address + 1U >= (progSize/2)) {
+		return;
+	}
+
+	instructionDecode_t &head = progmemDecoded[address];
+	const u8 tail = progmemDecoded[address + 1U].opNum;
+	const bool branch = (tail == 9 || tail == 10);
+
+	switch (head.opNum){
+		case 17: if (branch)     head.opNum = 87; break; // CP   + BRBC / BRBS
+		case 18: if (branch)     head.opNum = 88; break; // CPC  + BRBC / BRBS
+		case 19: if (branch)     head.opNum = 89; break; // CPI  + BRBC / BRBS
+		case 68: if (branch)     head.opNum = 90; break; // SBIW + BRBC / BRBS
+		case 40: if (tail == 55) head.opNum = 91; break; // LDI  + OUT
+		case 35: if (tail == 55) head.opNum = 92; break; // LD X+ + OUT
+		case 57: if (tail == 57 || tail == 93) head.opNum = 93; break; // PUSH + PUSH
+		default: break;
+	}
+}
+
+// I/O registers an idle loop may poll: those only changing on I/O
+// writes, events and interrupts, and having no side effects on reads.
+static bool idle_io(unsigned int addr)
+{
+	return addr != ports::TCNT1L && addr != ports::TCNT1H && addr != ports::SPDR;
+}
+
+// Tells whether an instruction may be part of an idle loop body: it only
+// writes registers and SREG, reads nothing else than these, flash, SRAM
+// and polled I/O registers, and does not transfer control. The registers
+// it reads and writes are returned in 'use' and 'def', with bit 32 standing
+// for SREG. Specialised variants count as their plain instruction.
+#define IDLE_R(n)   (1ULL << (n))
+#define IDLE_SREG   IDLE_R(32)
+static bool idle_insn(const instructionDecode_t &insn, u64 &use, u64 &def)
+{
+	const u64 d = IDLE_R(insn.arg1);
+	const u64 r = IDLE_R(insn.arg2 & 0x1FU);
+
+	switch (avr8::specializedBase(insn.opNum)){
+		case  1: // ADC
+		case 63: // SBC
+			use = d | r | IDLE_SREG; def = d | IDLE_SREG; return true;
+		case  2: // ADD
+		case  4: // AND
+		case 22: // EOR
+		case 53: // OR
+		case 83: // SUB
+			use = d | r;             def = d | IDLE_SREG; return true;
+		case 17: // CP
+			use = d | r;             def = IDLE_SREG;     return true;
+		case 18: // CPC
+			use = d | r | IDLE_SREG; def = IDLE_SREG;     return true;
+		case 23: // FMUL
+		case 24: // FMULS
+		case 25: // FMULSU
+		case 48: // MUL
+		case 49: // MULS
+		case 50: // MULSU
+			use = d | r;             def = IDLE_R(0) | IDLE_R(1) | IDLE_SREG; return true;
+		case 46: // MOV
+			use = r;                 def = d;             return true;
+		case 47: // MOVW
+			use = r | (r << 1);      def = d | (d << 1);  return true;
+		case  5: // ANDI
+		case  6: // ASR
+		case 16: // COM
+		case 21: // DEC
+		case 29: // INC
+		case 45: // LSR
+		case 51: // NEG
+		case 54: // ORI
+		case 84: // SUBI
+			use = d;                 def = d | IDLE_SREG; return true;
+		case 62: // ROR
+		case 64: // SBCI
+			use = d | IDLE_SREG;     def = d | IDLE_SREG; return true;
+		case 19: // CPI
+			use = d;                 def = IDLE_SREG;     return true;
+		case  3: // ADIW
+		case 68: // SBIW
+			use = d | (d << 1);      def = d | (d << 1) | IDLE_SREG; return true;
+		case 85: // SWAP
+			use = d;                 def = d;             return true;
+		case  8: // BLD
+			use = d | IDLE_SREG;     def = d;             return true;
+		case 13: // BST
+			use = d;                 def = IDLE_SREG;     return true;
+		case  7: // BCLR (not the I flag)
+		case 12: // BSET
+			use = 0U;                def = IDLE_SREG;     return insn.arg1 != SREG_I;
+		case 40: // LDI
+			use = 0U;                def = d;             return true;
+		case 52: // NOP
+			use = 0U;                def = 0U;            return true;
+		case 28: // IN
+			use = (insn.arg2 == ports::SREG) ? IDLE_SREG : 0U;
+			def = d;
+			return idle_io(insn.arg2);
+		case 41: // LDS (not the register file)
+			use = 0U;                def = d;
+			return (u16)insn.arg2 >= SRAMBASE ||
+			       ((u16)insn.arg2 >= IOBASE && idle_io((u16)insn.arg2 - IOBASE));
+		case 42: // LPM
+			use = IDLE_R(30) | IDLE_R(31); def = IDLE_R(0); return true;
+		case 43: // LPM Rd,Z
+			use = IDLE_R(30) | IDLE_R(31); def = d;         return true;
+		default:
+			return false;
+	}
+}
+
+// Idle loops: short loops polling memory or I/O for a change only an
+// interrupt or a peripheral can make, like the kernel's WaitVsync, or
+// waiting on TIFR1 or SPSR flags. If the instruction at the address closes
+// one, the instruction deciding whether the loop goes on gets its idle
+// variant, so run_until() can fast-forward the loop (see IDLE_LOOP).
+// Loops of these shapes are recognized:
+//
+// head: body...  BRBC / BRBS head
+// head: body...  SBIC / SBIS / SBRC / SBRS, RJMP head
+// head: body...  RJMP head
+//
+// The body is straight code of instructions accepted by idle_insn, so a
+// pass can only end on the deciding instruction by running through it
+// all. No register may carry a value from one pass to the next (like the
+// counter of a delay loop), so the loop is in the same state on each pass
+// as long as the memory and I/O it reads do not change. Needs the loop
+// decoded, but not yet fused.
+void avr8::markIdleLoop(u16 address){
+
+	instructionDecode_t &tail = progmemDecoded[address];
+	const u8 op = tail.opNum;
+
+	if ((op != 9 && op != 10 && op != 61) || tail.arg2 >= 0 ||
+	    (-tail.arg2) > (s16)IDLE_LOOP_WORDS) {
+		return;
+	}
+
+	// Walk the body up to the first instruction not accepted, collecting
+	// the registers read before written in a pass, and those written
+	const u16 head = address + 1U + tail.arg2;
+	u16 i = head;
+	u64 use, def;
+	u64 inputs = 0U;
+	u64 defs = 0U;
+	while (i < address && idle_insn(progmemDecoded[i], use, def)){
+		inputs |= use & ~defs;
+		defs |= def;
+		i += get_insn_size(progmemDecoded[i].opNum);
+	}
+
+	if ((inputs & defs) != 0U) {
+		return;
+	}
+
+	if (i == address){
+		switch (op){
+			case  9: tail.opNum = 94; break; // BRBC
+			case 10: tail.opNum = 95; break; // BRBS
+			default: tail.opNum = 96; break; // RJMP
 		}
-		i++;
+		return;
+	}
+
+	// Otherwise a skip right before a RJMP may decide
+	if (op != 61 || i != (u16)(address - 1U)){
+		return;
+	}
+	instructionDecode_t &skip = progmemDecoded[i];
+	switch (skip.opNum){
+		case 66: if (idle_io(skip.arg1)) skip.opNum = 97; break; // SBIC
+		case 67: if (idle_io(skip.arg1)) skip.opNum = 98; break; // SBIS
+		case 69: skip.opNum = 99;  break; // SBRC
+		case 70: skip.opNum = 100; break; // SBRS
+		default: break;
+	}
+}
+
+// Picks the specialised variant of the instruction at the address if the
+// static analysis allows it: arithmetic and logic instructions whose flags
+// are all dead, and LDS / STS of a constant SRAM address. The analysis
+// covers the whole program, so it is only valid as long as flash does not
+// change (see decodeFlash). Needs the instruction decoded, but not yet
+// marked by markIdleLoop nor fused.
+void avr8::specialize(u16 address){
+
+	instructionDecode_t &insn = progmemDecoded[address];
+	const bool dead = analysis->flagsLive[address] == 0U;
+	const bool deadZNVS = (analysis->flagsLive[address] &
+	                       (FLAG_Z | FLAG_N | FLAG_V | FLAG_S)) == 0U;
+	const bool sram = analysis->addrClass[address] == ADDR_SRAM;
+
+	switch (insn.opNum){
+		case  2: if (dead)     insn.opNum = 101; break; // ADD
+		case  1: if (dead)     insn.opNum = 102; break; // ADC
+		case 83: if (dead)     insn.opNum = 103; break; // SUB
+		case 84: if (dead)     insn.opNum = 104; break; // SUBI
+		case 63: if (dead)     insn.opNum = 105; break; // SBC
+		case 64: if (dead)     insn.opNum = 106; break; // SBCI
+		case  4: if (deadZNVS) insn.opNum = 107; break; // AND
+		case  5: if (deadZNVS) insn.opNum = 108; break; // ANDI
+		case 53: if (deadZNVS) insn.opNum = 109; break; // OR
+		case 54: if (deadZNVS) insn.opNum = 110; break; // ORI
+		case 22: if (deadZNVS) insn.opNum = 111; break; // EOR
+		case 29: if (deadZNVS) insn.opNum = 112; break; // INC
+		case 21: if (deadZNVS) insn.opNum = 113; break; // DEC
+		case 41: if (sram)     insn.opNum = 114; break; // LDS
+		case 82: if (sram)     insn.opNum = 115; break; // STS
+		default: break;
 	}
-	return;
 }
 
 void avr8::decodeFlash(void){
 	for(u16 i=0; i<(progSize/2); i++){
-		decodeFlash(i);
+		instructionDecode(i);
+	}
+	// While a program is being written by SPM the analysis would be
+	// outdated by the next write, it is redone once it is done (run_frame)
+	if (!flashModified){
+		if (analysis == NULL)
+			analysis = new Analysis();
+		analysis->run(progmemDecoded, pc);
+		// Breakpoints and single stepping should see the flags
+		if (enableGdb == false){
+			for(u16 i=0; i<(progSize/2); i++){
+				specialize(i);
+			}
+		}
+	}
+	// Single stepping and breakpoints need each instruction on its own
+	if (enableGdb == false){
+		for(u16 i=0; i<(progSize/2); i++){
+			markIdleLoop(i);
+		}
+		// Backwards, so PUSH chains fuse up entirely
+		for(u16 i=(progSize/2); i>0; i--){
+			fuseInsn(i - 1U);
+		}
 	}
+#ifdef ENABLE_JIT
+	// The dispatcher expects the translator present once flash is decoded
+	if (jit == NULL)
+		jit = new JIT();
+	// Breakpoints and single stepping need every instruction interpreted
+	if (enableGdb == false && jit->init())
+		jit->translate(progmemDecoded);
+#endif
+}
+// Copy of the program as loaded, for the states from before the first SPM
+void avr8::keep_rom(){
+	if (romImage.empty())
+		romImage.assign(progmem, progmem + (progSize/2));
 }
+
 void avr8::decodeFlash(u16 address){
 	
 	if (address < (progSize/2)) {
-		instructionDecode(address);
+		flashModifiedAt = cycleCounter;
+		flashWritten = true;
+		if (!flashModified) {
+			// The specialised variants rely on the analysis of the
+			// whole program: go back to the plain instructions
+			flashModified = true;
+			decodeFlash();
+			return;
+		}
+
+		// The previous instruction may start a fused pair with this, the
+		// following ones may close an idle loop containing it
+		const unsigned int lo = (address > 0) ? (address - 1U) : 0U;
+		const unsigned int hi = std::min(address + IDLE_LOOP_WORDS, (progSize/2) - 1U);
+		for (unsigned int i = lo; i <= hi; i++) {
+			instructionDecode(i);
+		}
+		if (enableGdb == false) {
+			for (unsigned int i = lo; i <= hi; i++) {
+				markIdleLoop(i);
+			}
+			for (unsigned int i = hi + 1U; i > lo; i--) {
+				fuseInsn(i - 1U);
+			}
+		}
+#ifdef ENABLE_JIT
+		jit->invalidate(progmemDecoded, address);
+#endif
 	}
 }
 
+bool avr8::dumpCFG(const char *filename){
+	return analysis != NULL && analysis->dumpCFG(filename);
+}
+
+// Text of an instruction, variants (fused, idle, specialised) are shown as
+// the plain instruction they stand for
+void avr8::disassemble(const instructionDecode_t &insn, char *text, size_t size){
+	const unsigned int op = plainInsn(insn.opNum);
+	if (op == 0U || op > 86U){
+		snprintf(text, size, "???");
+		return;
+	}
+	const instructionList_t &i = instructionList[op - 1U];
+	if (i.arg1Type == 0U)
+		snprintf(text, size, i.opName, insn.arg2);
+	else
+		snprintf(text, size, i.opName, insn.arg1, insn.arg2);
+}
+
 void avr8::trigger_interrupt(unsigned int location)
 {
 
@@ -2025,6 +3435,18 @@ void avr8::trigger_interrupt(unsigned int location)
 		// jump to new location (which jumps to the real handler)
 		pc = location;
 
+		// the handler is a root of the call graph (FEATURE_PROFILE)
+		if (profiling)
+		{
+			const instructionDecode_t &vector = progmemDecoded[location];
+			u16 handler = location;
+			if (vector.opNum == 30)      // JMP
+				handler = (u16)vector.arg2;
+			else if (vector.opNum == 61) // RJMP
+				handler = (u16)(location + 1 + vector.arg2);
+			profile->interrupt(handler, SP, cycleCounter);
+		}
+
 		// bill the cycles consumed (3 cycles).
 		// Note  that there is an error in the Atmega644 datasheet where
 		// it specifies the IRQ cycles as 5.
@@ -2058,8 +3480,18 @@ bool avr8::init_sd()
 	return true;
 }
 
+// Sets up video, audio and input. Headless, only the frame buffer (surface)
+// is created: no SDL subsystem is used.
 bool avr8::init_gui()
 {
+	startTicks = SDL_GetTicks();
+	startCycle = cycleCounter;
+
+	if (headless) {
+		enableSound = false;
+		return init_surface();
+	}
+
 	if (SDL_Init(SDL_INIT_AUDIO | SDL_INIT_VIDEO | SDL_INIT_JOYSTICK) != 0) {
 		fprintf(stderr, "Unable to init SDL: %s\n", SDL_GetError());
 		return false;
@@ -2082,61 +3514,80 @@ bool avr8::init_gui()
 		return false;
 	}
 
-	renderer = SDL_CreateRenderer(window, -1, sdl_flags);
-	if (!renderer) {
-		SDL_DestroyWindow(window);
-		fprintf(stderr, "CreateRenderer failed: %s\n", SDL_GetError());
-		return false;
-	}
-
-	SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "nearest");
-	SDL_RenderSetLogicalSize(renderer, monitorWidth, monitorHeight);
-
-	surface = SDL_CreateRGBSurface(0, VIDEO_DISP_WIDTH, 224, 32,
-                               0x00FF0000,
-                               0x0000FF00,
-                               0x000000FF,
-                               0xFF000000);
-	if (!surface) {
-		fprintf(stderr, "CreateRGBSurface failed: %s\n", SDL_GetError());
+	if (!init_surface())
 		return false;
-	}
 
-	texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888,
-		SDL_TEXTUREACCESS_STREAMING, VIDEO_DISP_WIDTH, 224);
-	if (!texture) {
+	// The renderer stays on this thread, the window's (see Presenter)
+	presenter = new Presenter();
+	if (!presenter->init(window, sdl_flags, monitorWidth, monitorHeight, surface,
+	                     initial_scaler_mode, orientation, mirror)) {
+		delete presenter;
+		presenter = NULL;
 		SDL_FreeSurface(surface);
-		SDL_DestroyRenderer(renderer);
 		SDL_DestroyWindow(window);
-		fprintf(stderr, "CreateTexture failed: %s\n", SDL_GetError());
 		return false;
 	}
 
-	SDL_RenderClear(renderer);
-	SDL_RenderCopy(renderer, texture, NULL, NULL);
-	SDL_RenderPresent(renderer);
-
 	if (fullscreen) {
 		SDL_ShowCursor(0);
 	}
 
-	SDL_AudioSpec desired;
+	// Float or 16 bit samples at the native rate of the device, resampled
+	// by audio_callback, any other format is left to SDL to convert
+	SDL_AudioSpec desired, obtained;
 	memset(&desired, 0, sizeof(desired));
-	desired.freq = 15734;
-	desired.format = AUDIO_U8;
+	desired.freq = AUDIO_RATE;
+	desired.format = AUDIO_F32SYS;
 	desired.callback = audio_callback_stub;
 	desired.userdata = this;
 	desired.channels = 1;
-	desired.samples = 512;
+	desired.samples = AUDIO_SAMPLES;
 	if (enableSound) {
-		if (SDL_OpenAudio(&desired, NULL) < 0) {
+		audioDevice = SDL_OpenAudioDevice(NULL, 0, &desired, &obtained,
+			SDL_AUDIO_ALLOW_FREQUENCY_CHANGE | SDL_AUDIO_ALLOW_FORMAT_CHANGE);
+		if (audioDevice != 0 && obtained.format != AUDIO_F32SYS && obtained.format != AUDIO_S16SYS) {
+			SDL_CloseAudioDevice(audioDevice);
+			audioDevice = SDL_OpenAudioDevice(NULL, 0, &desired, &obtained,
+				SDL_AUDIO_ALLOW_FREQUENCY_CHANGE);
+		}
+		if (audioDevice == 0) {
 			fprintf(stderr, "Unable to open audio device, no sound will play.\n");
 			enableSound = false;
 		} else {
-			SDL_PauseAudio(0);
+			audioFloat = (obtained.format == AUDIO_F32SYS);
+			resampler = new Resampler();
+			resampler->init((double)CPU_CLOCK / HSYNC_PERIOD, obtained.freq);
+			// No allocation in the callback
+			audioIn.resize(AUDIO_RING);
+			audioOut.resize(obtained.samples);
+			SDL_PauseAudioDevice(audioDevice, 0);
 		}
 	}
 
+	SDL_Surface *slogo = SDL_CreateRGBSurfaceFrom((void *)&logo, 32, 32, 32, 32 * 4, 0xFF, 0xff00, 0xff0000, 0xff000000);
+	SDL_SetWindowIcon(window, slogo);
+	SDL_FreeSurface(slogo);
+
+	// Not while debugging, gdb controls the execution
+	if (rewindBudget != 0U && !enableGdb)
+		rewindBuffer = new Rewind(rewindBudget);
+
+	return true;
+}
+
+// Frame buffer and the emulation state depending on it, movie recording
+bool avr8::init_surface()
+{
+	surface = SDL_CreateRGBSurface(0, VIDEO_DISP_WIDTH, 224, 32,
+                               0x00FF0000,
+                               0x0000FF00,
+                               0x000000FF,
+                               0xFF000000);
+	if (!surface) {
+		fprintf(stderr, "CreateRGBSurface failed: %s\n", SDL_GetError());
+		return false;
+	}
+
 	left_edge_cycle = cycleCounter;
 	scanline_top = -33 - 5;
 	scanline_count = -999;
@@ -2198,42 +3649,36 @@ bool avr8::init_gui()
 	}
 #endif
 
-	SDL_Surface *slogo = SDL_CreateRGBSurfaceFrom((void *)&logo, 32, 32, 32, 32 * 4, 0xFF, 0xff00, 0xff0000, 0xff000000);
-	SDL_SetWindowIcon(window, slogo);
-	SDL_FreeSurface(slogo);
-
-#ifdef ENABLE_SCALER
-	extern SDL_Texture *scaledTexture;
-	extern int currentTextureScale;
-	extern SDL_Renderer *renderer;
-	extern int SCREEN_WIDTH;
-	extern int SCREEN_HEIGHT;
-
-	SCREEN_WIDTH = VIDEO_DISP_WIDTH;
-	SCREEN_HEIGHT = 224;
-	currentTextureScale = 1;
-	SetScaler(initial_scaler_mode);
-#endif
-
 	return true;
 }
 
 
 void avr8::uzekb_handle_key(SDL_Event &ev)
 {
-	if(ev.type==SDL_KEYUP)uzeKbScanCodeQueue.push(0xf0);
+	// A replayed movie has the keyboard input
+	if (captureMode == CAPTURE_READ) return;
+
+	if(ev.type==SDL_KEYUP)uzekb_queue(0xf0);
 
 	u16 i;
 	for(i = 0; uzeKbScancodes[i][1]!=ev.key.keysym.sym && uzeKbScancodes[i][1]; i++);
 	if (uzeKbScancodes[i][1] == ev.key.keysym.sym)
 	{
-		uzeKbScanCodeQueue.push(uzeKbScancodes[i][0]);
+		uzekb_queue(uzeKbScancodes[i][0]);
 	}
 }
 
+// Key presses the game does not read are dropped once the queue is full
+void avr8::uzekb_queue(u8 code)
+{
+	if (uzeKbScanCodeQueue.size() >= KB_QUEUE_SIZE)
+		return;
+	uzeKbScanCodeQueue.push(code);
+	if (captureMode == CAPTURE_WRITE) movie->key(code);
+}
+
 void avr8::handle_key_down(SDL_Event &ev)
 {
-	static int ssnum = 0;
 	char ssbuf[32];
 	static const char *pad_mode_strings[4] = {"NES pad.","SNES pad.","SNES 2p pad.","SNES mouse."};
 
@@ -2288,7 +3733,7 @@ void avr8::handle_key_down(SDL_Event &ev)
                 shutdown(0);
                 /* no break */
 			case SDLK_PRINTSCREEN:
-				sprintf(ssbuf,"uzem_%03d.bmp",ssnum++);
+				sprintf(ssbuf,"uzem_%03d.bmp",screenshotCount++);
 				printf("saving screenshot to '%s'...\n",ssbuf);
                                 {
                                   SDL_Surface* surfBMP;
@@ -2318,6 +3763,18 @@ void avr8::handle_key_down(SDL_Event &ev)
 			case SDLK_0:
 				PIND = PIND & ~0b00001100;
 				break;
+			case SDLK_F2:
+			case SDLK_F4:
+				if (captureMode != CAPTURE_NONE) {
+					puts("No savestates while recording or replaying a movie.");
+					break;
+				}
+				// In the middle of an instruction here: done between frames
+				stateKey = ev.key.keysym.sym;
+				break;
+			case SDLK_BACKSPACE:
+				rewinding = (rewindBuffer != NULL) && (captureMode == CAPTURE_NONE);
+				break;
 			case SDLK_F1:
 				puts("1/2 - Adjust left edge lock");
 				puts("3/4 - Adjust top edge lock");
@@ -2325,6 +3782,9 @@ void avr8::handle_key_down(SDL_Event &ev)
 				puts(" 6  - Mouse sensitivity scale factor");
 				puts(" 7  - Re-map joystick");
 				puts(" F1 - This help text");
+				puts(" F2 - Save state");
+				puts(" F4 - Load state");
+				puts("Backspace - Rewind (hold)");
 				puts("Esc - Quit emulator");
 				puts(" 0  - Soft Power switch");
 				puts("");
@@ -2340,11 +3800,49 @@ void avr8::handle_key_down(SDL_Event &ev)
 	}
 }
 
+// Feeds the device, resampling the ring at a ratio nudged by up to
+// AUDIO_MAX_SKEW to keep it at AUDIO_TARGET (dynamic rate control): above
+// it the samples are consumed slightly faster, below slightly slower. This
+// absorbs the drift between the host clock, which paces the emulation, and
+// the device clock, without audible pitch changes. The samples needed are
+// read at once, when the ring runs short (an underrun) the last one is held.
 void avr8::audio_callback(Uint8 *stream,int len)
 {
-	// printf("want %d bytes (have %d)\n",len,audioRing.getUsed());
-	while (len--)
-		*stream++ = audioRing.pop();
+	const double ratio = 1.0 + AUDIO_MAX_SKEW *
+		((int)audioRing.getUsed() - AUDIO_TARGET) / (double)AUDIO_TARGET;
+	const u32 count = len / (audioFloat ? sizeof(float) : sizeof(s16));
+
+	const u32 need = resampler->needed(count, ratio);
+	if (audioIn.size() < need)
+		audioIn.resize(need);
+	const u32 got = audioRing.read(audioIn.data(), need);
+	if (got < need)
+		audioRing.underruns.fetch_add(1, std::memory_order_relaxed);
+
+	if (audioFloat)
+	{
+		resampler->run(audioIn.data(), got, (float*)stream, count, ratio);
+		return;
+	}
+	if (audioOut.size() < count)
+		audioOut.resize(count);
+	resampler->run(audioIn.data(), got, audioOut.data(), count, ratio);
+	s16 *out = (s16*)stream;
+	for (u32 i = 0U; i < count; i++)
+	{
+		const float s = audioOut[i] * 32767.0f;
+		out[i] = (s16)((s > 32767.0f) ? 32767.0f : ((s < -32768.0f) ? -32768.0f : s));
+	}
+}
+
+// Publishes the batch of samples to the audio callback
+void avr8::audio_flush()
+{
+	if (audioBatchSize != 0U)
+	{
+		audioRing.write(audioBatch, audioBatchSize);
+		audioBatchSize = 0U;
+	}
 }
 
 void avr8::handle_key_up(SDL_Event &ev)
@@ -2356,17 +3854,18 @@ void avr8::handle_key_up(SDL_Event &ev)
 
 	update_buttons(ev.key.keysym.sym,false);
 	if (ev.key.keysym.sym == SDLK_0) PIND |= 0b00001100;		//return soft power switch to normal (pullup)
+	if (ev.key.keysym.sym == SDLK_BACKSPACE) rewinding = false;
 }
 
 struct keymap { u32 key; u8 player, bit; };
 #define END_OF_MAP { 0,0,0 }
-keymap nes_one_player[] = 
+static const keymap nes_one_player[] = 
 {	
 	{ SDLK_a, 0, NES_A }, { SDLK_s, 0, NES_B }, { SDLK_TAB, 0, PAD_SELECT }, { SDLK_RETURN, 0, PAD_START },
 	{ SDLK_UP, 0, PAD_UP }, { SDLK_DOWN, 0, PAD_DOWN }, { SDLK_LEFT, 0, PAD_LEFT }, { SDLK_RIGHT, 0, PAD_RIGHT },
 	END_OF_MAP
 };
-keymap snes_one_player[] =
+static const keymap snes_one_player[] =
 {
 	{ SDLK_s, 0, SNES_B }, { SDLK_z, 0, SNES_Y }, { SDLK_TAB, 0, PAD_SELECT }, { SDLK_RETURN, 0, PAD_START },
 	{ SDLK_UP, 0, PAD_UP }, { SDLK_DOWN, 0, PAD_DOWN }, { SDLK_LEFT, 0, PAD_LEFT }, { SDLK_RIGHT, 0, PAD_RIGHT },
@@ -2374,7 +3873,7 @@ keymap snes_one_player[] =
 	END_OF_MAP
 };
 
-keymap snes_two_players[] =
+static const keymap snes_two_players[] =
 {
    // P1
    { SDLK_a, 0, PAD_LEFT }, { SDLK_s, 0, PAD_DOWN }, { SDLK_d, 0, PAD_RIGHT }, { SDLK_w, 0, PAD_UP },
@@ -2387,15 +3886,15 @@ keymap snes_two_players[] =
    END_OF_MAP
 };
 
-keymap snes_mouse[] =
+static const keymap snes_mouse[] =
 {
 	END_OF_MAP
 };
-keymap *keymaps[] = { nes_one_player, snes_one_player, snes_two_players, snes_mouse };
+static const keymap *const keymaps[] = { nes_one_player, snes_one_player, snes_two_players, snes_mouse };
 
 void avr8::update_buttons(int key,bool down)
 {
-	keymap *k = keymaps[pad_mode];
+	const keymap *k = keymaps[pad_mode];
 	while (k->key)
 	{
 		if (key == k->key)
@@ -2410,16 +3909,8 @@ void avr8::update_buttons(int key,bool down)
 	}
 }
 
-// Joysticks
-struct joyButton joy_btns_p1[] =
-{
-	{ JOY_SNES_START, PAD_START }, { JOY_SNES_SELECT, PAD_SELECT },
-	{ JOY_SNES_A, SNES_A }, { JOY_SNES_B, SNES_B },
-	{ JOY_SNES_X, SNES_X }, { JOY_SNES_Y, SNES_Y },
-	{ JOY_SNES_LSH, SNES_LSH }, { JOY_SNES_RSH, SNES_RSH }
-};
-
-struct joyButton joy_btns_p2[] =
+// Joysticks, default button mapping of each player (see joyButtons)
+static const struct joyButton joy_btns_default[NUM_JOYSTICK_BUTTONS] =
 {
 	{ JOY_SNES_START, PAD_START }, { JOY_SNES_SELECT, PAD_SELECT },
 	{ JOY_SNES_A, SNES_A }, { JOY_SNES_B, SNES_B },
@@ -2427,9 +3918,10 @@ struct joyButton joy_btns_p2[] =
 	{ JOY_SNES_LSH, SNES_LSH }, { JOY_SNES_RSH, SNES_RSH }
 };
 
-struct joyButton *joyButtons[] =  { joy_btns_p1, joy_btns_p2 };
-
 void avr8::init_joysticks() {
+	for (int i = 0; i < MAX_JOYSTICKS; ++i)
+		memcpy(joyButtons[i], joy_btns_default, sizeof(joy_btns_default));
+
 	if (SDL_JoystickEventState(SDL_QUERY) != SDL_ENABLE && SDL_JoystickEventState(SDL_ENABLE) != SDL_ENABLE)
 	{
 		printf("No supported joysticks found.\n");
@@ -2733,6 +4225,14 @@ void avr8::LoadEEPROMFile(const char* filename){
 }
 
 void avr8::shutdown(int errcode){
+    if(headless){
+        // Throughput of the run, for benchmarks
+        const u32 ms = SDL_GetTicks() - startTicks;
+        const u64 cycles = cycleCounter - startCycle;
+        printf("%llu cycles, %u frames in %u.%03u s (%.2f MHz)\n",
+            (unsigned long long)cycles, frameCounter, ms / 1000U, ms % 1000U,
+            (ms != 0U) ? ((double)cycles / ms / 1000.0) : 0.0);
+    }
 #if defined(__WIN32__)
     if(hDisk != INVALID_HANDLE_VALUE){
         CloseHandle (hDisk);        
@@ -2753,8 +4253,21 @@ void avr8::shutdown(int errcode){
         }
     }
 
-    if(captureFile!=NULL){
-    	fclose(captureFile);
+    if(movie!=NULL){
+    	movie->close();
+    }
+
+    if(profile!=NULL && profileFile!=NULL){
+        if(profile->report(profileFile,progmemDecoded,cycleCounter-startCycle))
+            printf("Profile written to %s\n",profileFile);
+        else
+            fprintf(stderr,"Warning: Unable to write profile %s\n",profileFile);
+    }
+    if(profile!=NULL && callgrindFile!=NULL){
+        if(profile->callgrind(callgrindFile,romName,progmemDecoded,cycleCounter))
+            printf("Call graph written to %s\n",callgrindFile);
+        else
+            fprintf(stderr,"Warning: Unable to write call graph %s\n",callgrindFile);
     }
 
 #ifndef __EMSCRIPTEN__
@@ -2794,6 +4307,12 @@ void avr8::shutdown(int errcode){
         }
 	}
 
+    // Stops the scaler thread before SDL_Quit (atexit) destroys the window
+    if(presenter!=NULL){
+        delete presenter;
+        presenter=NULL;
+    }
+
     exit(errcode);
 }
 
@@ -27,7 +27,9 @@ THE SOFTWARE.
 #define AVR8_H
 
 #include <vector>
+#include <atomic>
 #include <stdint.h>
+#include <string.h>
 #include <queue>
 #ifndef NOGDB
 	#include "gdbserver.h"
@@ -70,6 +72,7 @@ THE SOFTWARE.
 #define KB_SEND_DEVICE_ID 0x02
 #define KB_SEND_FIRMWARE_REV 0x03
 #define KB_RESET 0x7f
+#define KB_QUEUE_SIZE 32U // Scancodes waiting for the game at most (savestates)
 
 
 // Joysticks
@@ -118,6 +121,38 @@ enum { SNES_B, SNES_Y, SNES_A=8, SNES_X, SNES_LSH, SNES_RSH };
 
 enum {CAPTURE_NONE,CAPTURE_READ,CAPTURE_WRITE};
 
+// Peripheral events kept by the scheduler (avr8::schedule)
+enum { EV_TIMER1, EV_SPI, EV_WATCHDOG, EV_EEPROM, EV_COUNT };
+#define EVENT_NEVER 0xFFFFFFFFFFFFFFFFULL
+
+// Emulator features with code on the instruction or I/O paths. The core runs
+// through variants specialised on these, so what is not in use costs
+// nothing (see selectFeatures). Until a variant is picked all are enabled,
+// and then only depend on the runtime settings.
+#define FEATURE_GDB     0x01U   // gdb server (enableGdb)
+#define FEATURE_SPI     0x02U   // SPI bus to SD card and SPI RAM (SDpath)
+#define FEATURE_RECORD  0x04U   // Movie recording (recordMovie)
+#define FEATURE_CAPTURE 0x08U   // Controller capture or replay (captureMode)
+#define FEATURES_ALL    0x0FU
+#define FEATURE_PROFILE 0x10U   // Per instruction profile (profile), never assumed
+
+#define IDLE_LOOP_WORDS 16U     // Longest loop considered for fast-forward
+#define IDLE_NONE       0xFFFFU // No idle loop pass recorded
+#define OP_BREAKPOINT   0x80U   // Breakpoint flag of decoded opNums (setBreakpoint)
+#define PIXEL_EVENTS    2048U   // Pixel output changes kept (a power of 2)
+
+// Sound: the samples written to OCR2A (15734 Hz, one per scanline) are
+// published to audioRing by batches and at the end of each frame. The audio
+// callback resamples them to the rate of the device, keeping the ring around
+// the target fill (see audio_callback). The emulation is paced on the host
+// clock (pace_frame).
+#define AUDIO_RING      2048U   // Samples buffered (~130 ms), a power of 2
+#define AUDIO_TARGET    512     // Fill the rate control keeps (~33 ms)
+#define AUDIO_RATE      48000   // Device rate asked for, the native one is taken
+#define AUDIO_SAMPLES   512     // Device buffer (~11 ms at 48 kHz)
+#define AUDIO_BATCH     16U     // Samples (scanlines) published at once (~1 ms)
+#define AUDIO_MAX_SKEW  0.005   // Largest change of the resampling ratio
+
 #if 1	// 644P
 const unsigned eepromSize = 2048;
 const unsigned sramSize = 4096;
@@ -172,6 +207,8 @@ typedef uint16_t u16;
 typedef int16_t s16;
 typedef uint32_t u32;
 typedef int32_t s32;
+typedef uint64_t u64;
+typedef int64_t s64;
 
 typedef struct {
 	s16  arg2;
@@ -179,6 +216,12 @@ typedef struct {
 	u8   opNum;
 } __attribute__((packed)) instructionDecode_t;
 
+// Change of the pixel output (PORTC), see avr8::pixel_event
+typedef struct {
+	u32  cycle;    // First cycle showing the value (low bits)
+	u8   value;
+} pixelEvent_t;
+
 typedef struct {
 	u8   opNum;
 	char opName[32];
@@ -221,57 +264,68 @@ enum cpu_state {
 };
 
 class GdbServer;
-
-class ringBuffer
+class Presenter;
+struct JIT;
+struct Analysis;
+class Rewind;
+class Movie;
+class Profile;
+class Resampler;
+
+// Wait-free single producer (emulation), single consumer (audio callback)
+// ring of samples. Each side owns one index and only reads the other: the
+// producer publishes samples with a release store of head, the consumer
+// frees them with a release store of tail, and each loads the other's index
+// with acquire. The indices run freely (the size is a power of 2) and have
+// a cache line each, so the two threads do not contend for one.
+class sampleRing
 {
 public:
-	ringBuffer(int s) : head(0), tail(0), avail(s), size(s),last(127)
-	{
-		buffer = new u8[size];
-	}
-	~ringBuffer()
-	{
-		delete[] buffer;
-	}
-	bool isFull() const
-	{
-		return avail == 0;
-	}
-	void push(u8 data)
+	sampleRing() : underruns(0), overruns(0), head(0), tail(0) {}
+
+	// Producer: the samples that do not fit are dropped (an overrun)
+	void write(const u8 *data, u32 count)
 	{
-		if (avail)
+		const u32 h = head.load(std::memory_order_relaxed);
+		const u32 room = AUDIO_RING - (h - tail.load(std::memory_order_acquire));
+		if (count > room)
 		{
-			buffer[head++] = data;
-			if (head == size) 
-				head = 0;
-			--avail;
+			overruns.fetch_add(1, std::memory_order_relaxed);
+			count = room;
 		}
+		const u32 at = h % AUDIO_RING;
+		const u32 first = (count < AUDIO_RING - at) ? count : (AUDIO_RING - at);
+		memcpy(&buffer[at], data, first);
+		memcpy(&buffer[0], data + first, count - first);
+		head.store(h + count, std::memory_order_release);
 	}
-	bool isEmpty() const
+	// Consumer: reads up to count samples, returns how many
+	u32 read(u8 *data, u32 count)
 	{
-		return avail == size;
+		const u32 t = tail.load(std::memory_order_relaxed);
+		const u32 used = head.load(std::memory_order_acquire) - t;
+		if (count > used)
+			count = used;
+		const u32 at = t % AUDIO_RING;
+		const u32 first = (count < AUDIO_RING - at) ? count : (AUDIO_RING - at);
+		memcpy(data, &buffer[at], first);
+		memcpy(data + first, &buffer[0], count - first);
+		tail.store(t + count, std::memory_order_release);
+		return count;
 	}
-	int getUsed() const
+	// Either side, a snapshot
+	u32 getUsed() const
 	{
-		return size - avail;
-	}
-	u8 pop()
-	{
-		if (avail != size)
-		{
-			++avail;
-			u8 result = buffer[tail++];
-			last=result;
-			if (tail == size) tail = 0;
-			return result;
-		}
-		else
-			return last;//128;
+		return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire);
 	}
+
+	std::atomic<u32> underruns;   // Reads short of samples (consumer)
+	std::atomic<u32> overruns;    // Writes short of room (producer)
+
 private:
-	int head, tail, size, avail;
-	u8 *buffer;
-	u8 last;
+	alignas(64) std::atomic<u32> head;  // Written by the producer
+	alignas(64) std::atomic<u32> tail;  // Written by the consumer
+	alignas(64) u8 buffer[AUDIO_RING];
 };
 
 
@@ -281,23 +335,24 @@ struct avr8
 	avr8() :
 		/*Core*/
 		pc(0), watchdogTimer(0), prevPortB(0), prevWDR(0), eepromFile("eeprom.bin"),enableGdb(false),
-		dly_out(0), itd_TIFR1(0), elapsedCyclesSleep(0),hsyncHelp(false),
+		dly_out(0), itd_TIFR1(0), deadline(0), frameStop(false), lazyMask(0), elapsedCyclesSleep(0),hsyncHelp(false),
 #ifndef __EMSCRIPTEN__
 		recordMovie(false),
 #endif // __EMSCRIPTEN__
-		timer1_next(0), timer1_base(0), TCNT1(0),
+		TCNT1(0), watchdogStart(0), nextEvent(0), idlePc(IDLE_NONE),
 		//to align with AVR Simulator 2 since it has a bug that the first JMP
 		//at the reset vector takes only 2 cycles
-		cycleCounter(-1),
+		cycleCounter(-1), timer1_start(-1),
 
 		/*SDL*/
-		window(0),renderer(0),surface(0),texture(0),
+		window(0),surface(0),presenter(0),
 
 		/*Video*/
 		fullscreen(false),inset(0),
 
 		/*Audio*/
-		audioRing(1024),enableSound(true),
+		audioBatchSize(0),resampler(0),audioDevice(0),audioFloat(true),
+		enableSound(true),paceDeadline(0),
 
 		/*Joystick*/
 		joystickFile(0),pad_mode(SNES_PAD), new_input_mode(false),
@@ -312,7 +367,7 @@ struct avr8
 		uzeKbState(0),uzeKbEnabled(false),
 
 		/*Capture & savestates*/
-		captureFile(NULL),captureData(NULL),captureMode(CAPTURE_NONE),
+		movie(NULL),captureMode(CAPTURE_NONE),
 
 		/*SPI Emulation*/
 		spiByte(0), spiClock(0), spiTransfer(0), spiState(SD_IDLE_STATE), spiResponsePtr(0), spiResponseEnd(0),
@@ -331,41 +386,162 @@ struct avr8
 		memset(progmem,0,progSize/2);
 		memset(progmemDecoded,0,progSize/2);
 		memset(romName,0,sizeof(romName));
+		memset(breakpoints,0,sizeof(breakpoints));
+		pixelHead = 0U;
+		pixelTail = 0U;
+		pixelTailValue = 0U;
+		pixel_raw = 0U;
+		headless = false;
+		frameCounter = 0U;
+		frameLimit = 0U;
+		cycleLimit = 0U;
+		startTicks = 0U;
+		startCycle = 0U;
+		rewindBuffer = NULL;
+		rewindBudget = 16U << 20; // Minutes of play for most games
+		rewinding = false;
+		stateKey = 0;
+		runAhead = 0U;
+		profile = NULL;
+		profileFile = NULL;
+		callgrindFile = NULL;
+		profiling = false;
+		speculative = false;
+		hideFrame = false;
+		for (unsigned int i = 0U; i < EV_COUNT; i++)
+			eventAt[i] = EVENT_NEVER;
+		eventAt[EV_TIMER1] = 0U; // Calculate the Timer1 state on the first cycle
+		analysis = NULL;
+		initial_scaler_mode = 0;
+		screenshotCount = 0;
+#ifndef __EMSCRIPTEN__
+		avconv_video = NULL;
+		avconv_audio = NULL;
+		accumulated_error = 0.0;
+#endif // __EMSCRIPTEN__
+		flashModified = false;
+		flashWritten = false;
+		useFeatures(FEATURES_ALL);
+#ifdef ENABLE_JIT
+		jit = NULL;
+#endif
+#ifndef NOGDB
+		gdbPollAt = 0U;
+#endif // NOGDB
 	}
 
 	/*Core*/
 	u16 progmem[progSize/2];
 	instructionDecode_t progmemDecoded[progSize/2];
+	u32 breakpoints[progSize/2/32]; // gdb breakpoints, bit per word address
 	u16 pc,currentPc;
 private:
-	unsigned int cycleCounter;
-	unsigned int elapsedCycles,prevCyclesCounter,elapsedCyclesSleep,lastCyclesSleep;
-	unsigned int prevPortB, prevWDR;
-	unsigned int watchdogTimer;
-	unsigned int cycle_ctr_ins;  // Used in update_hardware_ins to track elapsed cycles between calls
+	u64 cycleCounter;         // Absolute cycle count, never wraps
+	unsigned int elapsedCycles,elapsedCyclesSleep;
+	u64 prevCyclesCounter,lastCyclesSleep;
+	unsigned int prevPortB;
+	u64 prevWDR;
+	unsigned int watchdogTimer; // Watchdog count while disabled
 	// u8 eeClock; TODO: Only set at one location, never used. Maybe a never completed EEPROM timing code.
 	unsigned int T16_latch;   // Latch for 16-bit timers (16 bits used)
 	unsigned int TCNT1;	   // Timer 1 counter (used instead of TCNT1H:TCNT1L)
-	unsigned int timer1_next; // Cycles remaining until next timer1 event
-	unsigned int timer1_base; // Where the between-events timer started (to reproduce TCNT1)
+	u64 timer1_start;         // Cycle TCNT1 was last brought up to date at
+	u64 watchdogStart;        // Cycle the watchdog count was zero at while enabled
 	unsigned int itd_TIFR1;   // Interrupt delaying for TIFR1 (8 bits used)
 	unsigned int dly_out;	 // Delayed output flags
 	unsigned int dly_TCCR1B;  // Delayed Timer1 controls
 	unsigned int dly_TCNT1L;  // Delayed Timer1 count (low)
 	unsigned int dly_TCNT1H;  // Delayed Timer1 count (high)
+	u64 deadline;             // Cycle run_until() returns at
+	bool frameStop;           // End exec() on frame completion (run_frame)
+	bool hardware_ins_pending();
+	// Peripheral event scheduler. Timer1, SPI transfers, the watchdog and
+	// EEPROM accesses register the absolute cycle of their next event, so
+	// the core only has to compare the cycle counter with the earliest one.
+	u64 eventAt[EV_COUNT];    // Cycle of each event, EVENT_NEVER if none
+	u64 nextEvent;            // Earliest of eventAt
+	inline void schedule(unsigned int ev, u64 cycle)
+	{
+		eventAt[ev] = cycle;
+		nextEvent = eventAt[0];
+		for (unsigned int i = 1U; i < EV_COUNT; i++)
+			if (nextEvent > eventAt[i]) nextEvent = eventAt[i];
+	}
+	void run_events();
+	void update_timer1();
+	unsigned int timer1_elapsed();
+	void timer1_resync();
+	void watchdog_set(unsigned int count);
+	void write_wdtcsr(u8 value);
+	// Idle loop fast-forward (see markIdleLoop)
+	u16 idlePc;               // Deciding instruction of the last pass, IDLE_NONE if none
+	u64 idleCycle;            // Cycle that pass reached it at
+	u8  idleRegs[32];         // Register file and SREG at that point
+	u8  idleSREG;
+	void idle_forward();
+	unsigned int lazyMask;    // SREG bits pending lazy evaluation
+	unsigned int lazyKind;    // Last arithmetic operation (LF_ADD, ...) for C and H
+	unsigned int lazyRd, lazyRr, lazyR; // Its operands and result
+	unsigned int lazyZKind;   // Last flag producing operation for Z, N, V and S
+	unsigned int lazyZR;      // Its result
+	void flags_eval(unsigned int mask);
+	void flags_eval_fast(unsigned int mask);
+	Analysis *analysis;       // Static analysis of the program
+	bool flashModified;       // SPM changed the program since the last analysis
+	u64 flashModifiedAt;      // Cycle of the last change
+	bool flashWritten;        // SPM changed the program (saved with states)
+	std::vector<u16> romImage; // Program before the first SPM (keep_rom)
+	void keep_rom();
+	void specialize(u16 address);
+	// Core variants specialised on the features in use (selectFeatures)
+	u64 (avr8::*runUntil)(u64 target);
+	void (avr8::*writeIoX)(u8 addr, u8 value);
+	template <unsigned int F> u64 run_until_t(u64 target);
+	void useFeatures(unsigned int features);
+#ifndef NOGDB
+	u64 run_debug(u64 target);
+	u64 gdbPollAt;            // Cycle the gdb connection is next polled at
+#endif // NOGDB
+#ifdef ENABLE_JIT
+	JIT *jit;                 // Basic-block translator
+	bool jit_exec(u64 budget);
+#endif
 public:
 	bool enableGdb;
-	int randomSeed;
+	u32 randomSeed;           // Watchdog entropy (state of watchdog_entropy)
+	// Variation of the watchdog RC oscillator: xorshift on randomSeed, so
+	// movies and savestates see the same values
+	inline unsigned int watchdog_entropy()
+	{
+		u32 x = (randomSeed != 0U) ? randomSeed : 0x9E3779B9U;
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		randomSeed = x;
+		return x;
+	}
 	const char* eepromFile;
 	bool hsyncHelp;
 #ifndef __EMSCRIPTEN__
 	bool recordMovie;
+	FILE *avconv_video;       // ffmpeg pipes of the recording
+	FILE *avconv_audio;
+	double accumulated_error; // Audio drift of the recording (see write_io_x)
 #endif // __EMSCRIPTEN__
 	char romName[256];
 	u16 decodeArg(u16 flash, u16 argMask, u8 argNeg);
 	void instructionDecode(u16 address);
 	void decodeFlash(void);
 	void decodeFlash(u16 address);
+	void fuseInsn(u16 address);
+	void markIdleLoop(u16 address);
+	bool dumpCFG(const char *filename);
+	static void disassemble(const instructionDecode_t &insn, char *text, size_t size);
+	void setBreakpoint(u16 address, bool set);
+	inline bool isBreakpoint(u16 address) const
+	{
+		return (breakpoints[address / 32U] >> (address % 32U)) & 1U;
+	}
 
 	struct
 	{
@@ -420,11 +596,18 @@ public:
 
 	/*Video*/
 	char caption[128];
+	bool headless;            // No window, audio nor input (init_gui)
+	u32 frameCounter;         // Frames completed
+	u32 frameLimit;           // Exit once this many frames completed (0: none)
+	u64 cycleLimit;           // Exit on this cycle (0: none)
+	u32 startTicks;           // Time init_gui was called at
+	u64 startCycle;           // Cycle it was called on (savestates start later)
 
 	SDL_Window *window;
-	SDL_Renderer *renderer;
 	SDL_Surface *surface;
-	SDL_Texture *texture;
+	Presenter *presenter;     // Shows the frames, NULL headless
+	int initial_scaler_mode;  // SCALER_... mode to start with (0: none)
+	int screenshotCount;      // Screenshots saved, uzem_NNN.bmp
 	int sdl_flags;
 	int scanline_count;
 	unsigned int left_edge_cycle;
@@ -432,21 +615,46 @@ public:
 	unsigned int left_edge;
 	u32 inset;
 	u32 palette[256];
-	u8  scanline_buf[2048]; // For collecting pixels from a single scanline
+	u32 hsync_more_col, hsync_less_col;
+	pixelEvent_t pixelEvents[PIXEL_EVENTS]; // Pixel output changes (ring)
+	unsigned int pixelHead;   // Changes recorded
+	unsigned int pixelTail;   // First change not yet rendered
+	u8  pixelTailValue;	  // Pixel output before that change
 	u8  pixel_raw;		  // Raw (8 bit) input pixel
+	// Records a change of the pixel output made on the cycle, so it
+	// shows from the next one on
+	inline void pixel_event(u64 cycle, u8 value)
+	{
+		pixelEvent_t &ev = pixelEvents[pixelHead % PIXEL_EVENTS];
+		ev.cycle = (u32)(cycle + 1U);
+		ev.value = value;
+		pixelHead ++;
+	}
+	void render_line(u32 *dest, u32 start);
 	bool fullscreen;
 	bool jamma;
 	int orientation; //default: -1(no rotation), 90, 180, 270, mostly for JAMMA(.uze JAMMA settings can be overriden with flag)
 	SDL_RendererFlip mirror; //default: SDL_FLIP_NONE, 1: SDL_FLIP_HORIZONTAL, 2: SDL_FLIP_VERTICAL, 3: Both
 
 	/*Audio*/
-	ringBuffer audioRing;
+	sampleRing audioRing;
+	u8 audioBatch[AUDIO_BATCH];  // Samples not published yet
+	u32 audioBatchSize;
+	void audio_flush();
+	Resampler *resampler;     // To the rate of the device
+	SDL_AudioDeviceID audioDevice;
+	bool audioFloat;          // AUDIO_F32SYS, else AUDIO_S16SYS
+	std::vector<u8> audioIn;  // Samples read by the callback
+	std::vector<float> audioOut; // Resampled by it
 	void audio_callback(Uint8 *stream,int len);
 	static void audio_callback_stub(void *userdata, Uint8 *stream, int len){((avr8*)userdata)->audio_callback(stream,len);}
 	bool enableSound;
+	u64 paceDeadline;         // Host time the emulation has to wait for
+	void pace_frame(unsigned int cycles);
 
 	/*Joystick*/
 	joystickState joysticks[MAX_JOYSTICKS];
+	struct joyButton joyButtons[MAX_JOYSTICKS][NUM_JOYSTICK_BUTTONS];
 	joyMapSettings jmap;
 	// SNES bit order:  B, Y, Select, Start, Up, Down, Left, Right, A, X, L, R
 	// NES bit order:  A, B, Select, Start, Up, Down, Left, Right
@@ -475,17 +683,17 @@ public:
 	u8 uzeKbClock;
 
 	/*Input Capture*/
-	FILE* captureFile;
-	u8* captureData;
+	Movie *movie;             // Recorded or replayed (captureMode)
 	u8 captureMode;
-	long captureSize;
-	long capturePtr;
+	void movie_frame();
+	void movie_check();
+	bool movie_seek(u32 frame);
 
 
 	/*SPI Emulation*/
 	u8 spiByte;
 	u8 spiTransfer;
-	u16 spiClock;
+	u16 spiClock;      // Cycles left of a transfer paused by disabling SPI
 	u16 spiCycleWait;
 	u8 spiState;
 	u8 spiCommand;
@@ -532,7 +740,7 @@ private:
 	void write_io(u8 addr,u8 value);
 	u8 read_io(u8 addr);
 	// Should not be called directly (see write_io)
-	void write_io_x(u8 addr,u8 value);
+	template <unsigned int F> void write_io_x(u8 addr,u8 value);
 
 	inline u8 read_progmem(u16 addr)
 	{
@@ -584,25 +792,61 @@ private:
 		}
 	}
 
+public:
 	inline static unsigned int get_insn_size(unsigned int insn)
 	{
 		/* 41  LDS Rd,k (next word is rest of address)
 		   82  STS k,Rr (next word is rest of address)
 		   30  JMP k (next word is rest of address)
-		   14  CALL k (next word is rest of address) */
+		   14  CALL k (next word is rest of address)
+		   114 / 115 are the SRAM variants of LDS / STS */
 		// This code is simplified by assuming upper k bits are zero on 644
 		
-		if (insn == 14 || insn == 30 || insn == 41 || insn == 82) {
+		insn &= ~OP_BREAKPOINT;
+		if (insn == 14 || insn == 30 || insn == 41 || insn == 82 ||
+		    insn == 114 || insn == 115) {
 			return 2U;
 		} else {
 			return 1U;
 		}
 	}
 
-public:
+	// Plain instruction of a variant picked by specialize (101 - 115),
+	// others are returned as they are
+	inline static unsigned int specializedBase(unsigned int insn)
+	{
+		static const u8 base[] = {
+			2, 1, 83, 84, 63, 64, 4, 5, 53, 54, 22, 29, 21, // Flag-free ALU
+			41, 82                                          // SRAM LDS / STS
+		};
+
+		if (insn >= 101U && insn <= 115U) {
+			return base[insn - 101U];
+		} else {
+			return insn;
+		}
+	}
+
+	// Plain instruction of a decoded opNum: the variants picked by
+	// specialize, fuseInsn (the first of the pair) and markIdleLoop
+	inline static unsigned int plainInsn(unsigned int insn)
+	{
+		static const u8 plain[] = {
+			17, 18, 19, 68, 40, 35, 57,  // Fused heads (fuseInsn)
+			9, 10, 61, 66, 67, 69, 70    // Idle loops (markIdleLoop)
+		};
+
+		insn = specializedBase(insn & ~OP_BREAKPOINT);
+		if (insn >= 87U && insn <= 100U) {
+			return plain[insn - 87U];
+		} else {
+			return insn;
+		}
+	}
 
 	bool init_sd();
 	bool init_gui();
+	bool init_surface();
 	void init_joysticks();
 	void handle_key_down(SDL_Event &ev);
 	void handle_key_up(SDL_Event &ev);
@@ -613,10 +857,27 @@ public:
 	void load_joystick_file(const char* filename);
 	void draw_memorymap();
 	void trigger_interrupt(unsigned int location);
+	// Brings SREG up to date, needed before reading it outside of exec
+	inline void flags_sync()
+	{
+		if (lazyMask != 0U) flags_eval(0xFFU);
+	}
+	// Emulation entry points, all return the number of cycles executed. They
+	// stop on the first instruction boundary at or past the requested cycle
+	// (or earlier when stopped by the debugger).
+	inline u64 run_until(u64 target)
+	{
+		return (this->*runUntil)(target);
+	}
+	// Runs until the end of the next video frame
+	unsigned int run_frame();
 	unsigned int exec();
+	unsigned int exec(unsigned int cycles);
+	// Picks the core variants for the features in use, to call once the
+	// emulator is set up (see FEATURE_GDB...)
+	void selectFeatures();
 	void spi_calculateClock();
 	void update_hardware();
-	void update_hardware_fast();
 	void update_hardware_ins();
 	void update_spi();
 	void SDLoadImage(char *filename);
@@ -630,6 +891,29 @@ public:
 	void shutdown(int errcode);
 	void idle(void);
 	void uzekb_handle_key(SDL_Event &ev);
+	void uzekb_queue(u8 code);
+
+	/*Savestates (Savestate.cpp)*/
+	size_t saveStateSize();
+	size_t saveState(u8 *dest);
+	bool loadState(const u8 *src, size_t size);
+	bool saveStateFile(const char *filename);
+	bool loadStateFile(const char *filename);
+	SDL_Keycode stateKey;     // F2 (save) or F4 (load) pressed, 0: none
+	void state_key();
+	Rewind *rewindBuffer;     // Frames to rewind to, NULL if disabled
+	size_t rewindBudget;      // Memory it may use (0: no rewind)
+	bool rewinding;           // Rewind key held
+	void rewind_frame();
+	unsigned int runAhead;    // Frames to run ahead of the input (0: none)
+	bool speculative;         // Running ahead: no sound, input nor counting
+	bool hideFrame;           // Do not show the frame (run-ahead)
+	std::vector<u8> runAheadState; // State the frames ahead started from
+	unsigned int frame_cycles();
+	Profile *profile;         // Per instruction profile, NULL if disabled
+	const char *profileFile;  // Its report, written on exit
+	const char *callgrindFile; // Its call graph, written on exit
+	bool profiling;           // The profile variant runs (useFeatures)
 
 };
 #endif
@@ -0,0 +1,24 @@
+#!/bin/sh
+# Runs the benchmark ROMs headless for a fixed number of cycles (CYCLES,
+# default 300000000) and reports the emulated MHz and the host time per
+# AVR instruction. The instruction count is the cycle count divided by the
+# CPI each ROM states in its source, which is exact for these loops.
+#
+# Usage: bench.sh [path to uzem]
+
+UZEM=${1:-./uzem}
+CYCLES=${CYCLES:-300000000}
+DIR=$(dirname "$0")
+
+printf '%-8s %10s %10s\n' ROM MHz ns/insn
+for rom in "$DIR"/*.hex; do
+	name=$(basename "$rom" .hex)
+	cpi=$(sed -n 's/^; CPI: *\([0-9.]*\).*/\1/p' "$DIR/$name.S")
+	"$UZEM" -H -C "$CYCLES" "$rom" | tail -n 1 | awk -v name="$name" -v cpi="$cpi" '
+		# "<cycles> cycles, <frames> frames in <s> s (<MHz> MHz)"
+		{
+			cycles = $1; s = $6;
+			if (s <= 0) s = 0.001;
+			printf "%-8s %10.2f %10.3f\n", name, cycles / s / 1e6, s * 1e9 * cpi / cycles;
+		}'
+done
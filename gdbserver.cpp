@@ -171,13 +171,13 @@ void GdbServer::avr_core_flash_write_lo8( unsigned int addr, byte_t val) {
 }
 
 void GdbServer::avr_core_remove_breakpoint(dword_t pc) {
-    Breakpoints::iterator ii;
-    if ((ii= find(BP.begin(), BP.end(), pc)) != BP.end()) 
-        BP.erase(ii);
+    if (pc < (progSize/2))
+        core->setBreakpoint(pc, false);
 }
 
 void GdbServer::avr_core_insert_breakpoint(dword_t pc) {
-    BP.push_back(pc);
+    if (pc < (progSize/2))
+        core->setBreakpoint(pc, true);
 }
 
 int GdbServer::signal_has_occurred(int signo) {(void)signo; return 0;}
@@ -386,6 +386,7 @@ void GdbServer::gdb_read_registers( )
     }
 
     /* GDB thinks SREG is register number 32 */
+    core->flags_sync();
     val = core->SREG;
     buf[i*2]   = HEX_DIGIT[(val >> 4) & 0xf];
     buf[i*2+1] = HEX_DIGIT[val & 0xf];
@@ -450,6 +451,7 @@ void GdbServer::gdb_write_registers( char *pkt )
     /* GDB thinks SREG is register number 32 */
     bval  = hex2nib(*pkt++) << 4;
     bval += hex2nib(*pkt++);
+    core->flags_sync();
     core->SREG=bval;
 
     /* GDB thinks SP is register number 33 */
@@ -532,6 +534,7 @@ void GdbServer::gdb_read_register( char *pkt )
     }
     else if (reg == 32)         /* sreg */
     {
+        core->flags_sync();
         byte_t val = core->SREG;
         snprintf( reply, sizeof(reply)-1, "%02x", val );
     }
@@ -583,6 +586,7 @@ void GdbServer::gdb_write_register( char *pkt )
         /* r0 to r31 and SREG */
         if (reg == 32)          /* gdb thinks SREG is register 32 */
         {
+            core->flags_sync();
             core->SREG=val&0xff;
         }
         else
@@ -718,6 +722,7 @@ void GdbServer::gdb_read_memory( char *pkt )
 		// Trying to access one of the IOs (below SRAMBASE)
         	else if (addr < SRAMBASE )
 		{
+			core->flags_sync();
 			bval = core->io[addr - IOBASE];
                 	buf[0]   = HEX_DIGIT[bval >> 4];
                 	buf[1] = HEX_DIGIT[bval & 0xf];
@@ -853,6 +858,7 @@ void GdbServer::gdb_write_memory( char *pkt )
 		addr -= IOBASE;
                 bval  = hex2nib(*pkt++) << 4;
                 bval += hex2nib(*pkt++);
+                core->flags_sync();
                 core->io[addr]=bval;
 	}
 	else
@@ -1285,20 +1291,15 @@ bool GdbServer::TryConnectGdb() {
 }
 
 void GdbServer::exec(void) {
-    static int wait = 0;
     char reply[MAX_BUF+1];
     bool leave = false;
 
     if ((conn<0) && (TryConnectGdb() == false))
 	   return;
 
-    // If we check for gdb packets after eachinstruction, it takes much time.
-    // So, if the user sends a 'continue', try to execute a bunch of instructions before check gdb again.
-    if (wait)
-    {
-	wait--;
-	return;
-    }
+    // While the program runs, this is only called every few cycles (see
+    // avr8::run_debug), checking for gdb packets after each instruction
+    // would take much time.
 
     if (core->gdbBreakpointFound == true) 
     {
@@ -1362,10 +1363,6 @@ void GdbServer::exec(void) {
             }
 
         } while (leave==false);
-
-	// Reload wait counter
-	if (runMode == GDB_RET_CONTINUE)
-		wait = 100000000;
 }
 
 void GdbServer::SendPosition(int signo) {
@@ -1378,6 +1375,7 @@ void GdbServer::SendPosition(int signo) {
     gdb_debug("Sending position [signo:%i]\n",signo);
     bytes = snprintf( reply, MAX_BUF, "T%02x", signo );
 
+    core->flags_sync();
     /* SREG, SP & PC */
     snprintf( reply+bytes, MAX_BUF-bytes,
             "20:%02x;" "21:%02x%02x;" "22:%02x%02x%02x%02x;",
@@ -57,9 +57,6 @@ typedef uint8_t byte_t;
 typedef uint16_t word_t;
 typedef uint32_t dword_t;
 
-class Breakpoints: public std::vector<dword_t> {
-};
-
 #define MAX_BUF 400 /* Maximum size of read/write buffers. */
 
 #define GET_LITTLE_ENDIAN16(byte1,byte2)	((byte1 << 8) | byte2)
@@ -149,8 +146,9 @@ class GdbServer {
     public:
         GdbServer( avr8*, int port, int debugOn, int WaitForGdbConnection=true);
         virtual ~GdbServer();
-	Breakpoints BP;
 	void exec(void);
+	// True while gdb holds the core (not connected, stopped or stepping)
+	bool stopped() const { return runMode != GDB_RET_CONTINUE; }
         bool TryConnectGdb();
 };
 
@@ -29,6 +29,7 @@ THE SOFTWARE.
     #include "gdbserver.h"
 #endif // NOGDB
 #include "uzerom.h"
+#include "Presenter.h"
 #include <getopt.h>
 #include <limits.h>
 #include <string.h>
@@ -39,6 +40,8 @@ THE SOFTWARE.
 #endif
 #include "SPIRAMEmulator.h"
 #include "Scaler.h"
+#include "Movie.h"
+#include "Profile.h"
 
 static const struct option longopts[] ={
     { "help"       , no_argument      , NULL, 'h' },
@@ -66,13 +69,24 @@ static const struct option longopts[] ={
     { "capture"    , no_argument,       NULL, 'c' },
     { "loadcap"    , no_argument,       NULL, 'l' },
     { "synchelp"   , no_argument,       NULL, 'z' },
+    { "cfg"        , required_argument, NULL, 'a' },
+    { "headless"   , no_argument,       NULL, 'H' },
+    { "frames"     , required_argument, NULL, 'F' },
+    { "cycles"     , required_argument, NULL, 'C' },
+    { "loadstate"  , required_argument, NULL, 'S' },
+    { "rewind"     , required_argument, NULL, 'R' },
+    { "runahead"   , required_argument, NULL, 'A' },
+    { "seek"       , required_argument, NULL, 'P' },
+    { "profile"    , required_argument, NULL, 'Q' },
+    { "elf"        , required_argument, NULL, 'E' },
+    { "callgrind"  , required_argument, NULL, 'G' },
 #if defined(__WIN32__)
     { "sd"         , required_argument, NULL, 's' },
 #endif 
     {NULL          , 0                , NULL, 0}
 };
 
-   static const char* shortopts = "hnfczlwm2jo:i:re:p:bdt:k:s:vx:";
+   static const char* shortopts = "hnfczlwm2jo:i:re:p:bdt:k:s:vx:a:HF:C:S:R:A:P:Q:E:G:";
 
 #define printerr(fmt,...) fprintf(stderr,fmt,##__VA_ARGS__)
 
@@ -115,9 +129,20 @@ void showHelp(char* programName){
     printerr("\t--gdbserver -d      Debug mode. Start the built-in gdb support.\n");
     printerr("\t--port -t <port>    Port used by gdb (default 1284).\n");
 #endif // NOGDB
-    printerr("\t--capture -c        Captures controllers data to file.\n");
-    printerr("\t--loadcap -l        Load and replays controllers data from file.\n");
+    printerr("\t--capture -c        Records the input to a movie (ROMNAME.uzm).\n");
+    printerr("\t--loadcap -l        Replays the movie ROMNAME.uzm.\n");
+    printerr("\t--seek -P <frame>   Start the replayed movie at the frame.\n");
     printerr("\t--synchelp -z       Displays and logs information to help troubleshooting HSYNC timing issues.\n");
+    printerr("\t--cfg -a <file>     Write the control flow graph of the program to file (Graphviz dot) and exit.\n");
+    printerr("\t--headless -H       Run without window, sound or input (batch runs, benchmarks).\n");
+    printerr("\t--frames -F <n>     Exit after n frames.\n");
+    printerr("\t--cycles -C <n>     Exit after n cpu cycles.\n");
+    printerr("\t--loadstate -S <file> Start from a savestate (F2 saves one to ROMNAME.uzs, F4 loads it).\n");
+    printerr("\t--rewind -R <MB>    Memory for rewinding with Backspace (default 16, 0 disables).\n");
+    printerr("\t--runahead -A <n>   Run n frames (1-4) ahead of the input to hide the input lag of the game.\n");
+    printerr("\t--profile -Q <file> Count the instructions and cycles of each address, write the hot spots to file on exit.\n");
+    printerr("\t--elf -E <file>     ELF file of the game, names the functions and source lines of the profile.\n");
+    printerr("\t--callgrind -G <file> Profile the calls and interrupts, write the call graph to file on exit (KCachegrind).\n");
     printerr("\t--record -r         Record a movie in mp4/720p(60fps) format. (ffmpeg executable must be in the same directory as uzem or system path)\n");
 }
 
@@ -139,12 +164,7 @@ avr8 uzebox;
 
 #ifdef __EMSCRIPTEN__
 void one_iter() {
-       const int cycles=700000;
-       static int left;
-
-       left = cycles;
-       while (left > 0)
-               left -= uzebox.exec();
+       uzebox.run_frame();
 }
 #endif // __EMSCRIPTEN__
 
@@ -168,6 +188,10 @@ int main(int argc,char **argv)
 
     int opt;
     char* heximage = NULL;
+    const char* cfgFile = NULL;
+    const char* stateFile = NULL;
+    const char* elfFile = NULL;
+    u32 seekFrame = 0;
     uzebox.orientation = -1;
 
     while((opt = getopt_long(argc, argv,shortopts,longopts,NULL)) != -1) {
@@ -214,18 +238,18 @@ int main(int argc,char **argv)
 			exit(1);
 		}
 		switch (val) {
-			case 1: initial_scaler_mode = SCALER_NONE; break;
+			case 1: uzebox.initial_scaler_mode = SCALER_NONE; break;
 #ifdef ENABLE_SCALE2X
-			case 2: initial_scaler_mode = SCALER_SCALE2X; break;
+			case 2: uzebox.initial_scaler_mode = SCALER_SCALE2X; break;
 #endif
 #ifdef ENABLE_SCALE3X
-			case 3: initial_scaler_mode = SCALER_SCALE3X; break;
+			case 3: uzebox.initial_scaler_mode = SCALER_SCALE3X; break;
 #endif
 #ifdef ENABLE_SCALE4X
-			case 4: initial_scaler_mode = SCALER_SCALE4X; break;
+			case 4: uzebox.initial_scaler_mode = SCALER_SCALE4X; break;
 #endif
 #ifdef ENABLE_CRT
-			case 17: initial_scaler_mode = SCALER_CRT | SCALER_NONE; break;
+			case 17: uzebox.initial_scaler_mode = SCALER_CRT | SCALER_NONE; break;
 #endif
 			default:
 				fprintf(stderr, "Unsupported scaler mode: %ld\n", val);
@@ -280,6 +304,41 @@ int main(int argc,char **argv)
         case 'z':
             uzebox.hsyncHelp=true;
             break;
+        case 'a':
+            cfgFile = optarg;
+            break;
+        case 'H':
+            uzebox.headless = true;
+            break;
+        case 'F':
+            uzebox.frameLimit = strtoul(optarg,NULL,10);
+            break;
+        case 'C':
+            uzebox.cycleLimit = strtoull(optarg,NULL,10);
+            break;
+        case 'S':
+            stateFile = optarg;
+            break;
+        case 'R':
+            uzebox.rewindBudget = (size_t)strtoul(optarg,NULL,10) << 20;
+            break;
+        case 'A':
+            uzebox.runAhead = strtoul(optarg,NULL,10);
+            if (uzebox.runAhead > 4)
+                uzebox.runAhead = 4;
+            break;
+        case 'P':
+            seekFrame = strtoul(optarg,NULL,10);
+            break;
+        case 'Q':
+            uzebox.profileFile = optarg;
+            break;
+        case 'E':
+            elfFile = optarg;
+            break;
+        case 'G':
+            uzebox.callgrindFile = optarg;
+            break;
 #ifndef NOGDB
         case 'd':
             uzebox.enableGdb = true;
@@ -379,6 +438,14 @@ int main(int argc,char **argv)
         }
 
 	uzebox.decodeFlash();
+
+	if(cfgFile){
+		if(!uzebox.dumpCFG(cfgFile)){
+			printerr("Error: cannot write '%s'.\n",cfgFile);
+			return 1;
+		}
+		return 0;
+	}
 	
     	//get rom name without extension
     	char *pfile = heximage + strlen(heximage);
@@ -398,71 +465,6 @@ int main(int argc,char **argv)
 		}
 
 
-    	//build the capture file name
-		int len=strlen(uzebox.romName);
-		char capfname[len+5];
-		strcpy(capfname,uzebox.romName);
-		capfname[len+0]='.';
-		capfname[len+1]='c';
-		capfname[len+2]='a';
-		capfname[len+3]='p';
-		capfname[len+4]=0;
-
-		/*
-		char capfname[256];
-    	char *pfile = heximage + strlen(heximage);
-		for (;; pfile--)
-		{
-			if ((*pfile == '\\') || (*pfile == '/') || pfile==heximage)
-			{
-				if(pfile!=heximage)pfile++; //skip the slash character
-
-				for(int i=0;i<256;i++){
-					if(*pfile=='.'){
-						capfname[i+0]='.';
-						capfname[i+1]='c';
-						capfname[i+2]='a';
-						capfname[i+3]='p';
-						capfname[i+4]=0;
-						break;
-					}
-					capfname[i]=*pfile;
-					pfile++;
-				}
-				break;
-			}
-		}
-		 */
-
-        if(uzebox.captureMode==CAPTURE_READ)
-        {
-            uzebox.captureFile=fopen(capfname,"rb");
-            if(uzebox.captureFile==0){
-            	uzebox.captureMode=CAPTURE_NONE;
-            	printerr("Warning: Cannot open capture file %s. Capture replay ignored.\n\n",capfname);
-            }else{
-            	fseek(uzebox.captureFile, 0L, SEEK_END);
-				long fz = ftell(uzebox.captureFile);
-				rewind(uzebox.captureFile);
-				uzebox.captureData=new u8[fz];
-				uzebox.captureSize=fz;
-				uzebox.capturePtr=0;
-				size_t clen = fread(uzebox.captureData,1,fz,uzebox.captureFile);
-				fclose(uzebox.captureFile);
-				uzebox.captureFile = 0;
-            }
-        }
-        else if(uzebox.captureMode==CAPTURE_WRITE)
-        {
-            uzebox.captureFile=fopen(capfname,"wb");
-            if(uzebox.captureFile==0){
-            	uzebox.captureMode=CAPTURE_NONE;
-            	printerr("Error: Cannot open capture file %s.\n\n",capfname);
-            	return 1;
-            }
-        }
-
-
         //if user did not specify a path for the sd card, use the rom's path
     	if(uzebox.SDpath == NULL){
     		//extract path
@@ -499,6 +501,55 @@ int main(int argc,char **argv)
 		}
 	}
 
+	//movies are of the ROM as loaded, the state may hold a flash it wrote
+	const u64 romHash=Movie::hash(uzebox.progmem,sizeof(uzebox.progmem));
+
+	if(stateFile){
+		if(!uzebox.loadStateFile(stateFile)){
+			printerr("Error: cannot load savestate '%s'.\n\n",stateFile);
+			return 1;
+		}
+		printf("Loaded savestate '%s'.\n",stateFile);
+	}
+
+	//watchdog timer entropy, replaced by the one of a replayed movie
+	if(!stateFile){
+		uzebox.randomSeed=time(NULL);
+	}
+
+	//movie file name: rom name with .uzm extension
+	char moviefname[sizeof(uzebox.romName)+4];
+	sprintf(moviefname,"%s.uzm",uzebox.romName);
+
+	if(uzebox.captureMode==CAPTURE_READ)
+	{
+		uzebox.movie=new Movie();
+		if(!uzebox.movie->open(moviefname,romHash)){
+			uzebox.captureMode=CAPTURE_NONE;
+			printerr("Warning: Cannot open movie %s (missing or of an other ROM). Replay ignored.\n\n",moviefname);
+		}else{
+			uzebox.randomSeed=uzebox.movie->seed;
+		}
+	}
+	else if(uzebox.captureMode==CAPTURE_WRITE)
+	{
+		uzebox.movie=new Movie();
+		if(!uzebox.movie->create(moviefname,romHash,uzebox.randomSeed)){
+			uzebox.captureMode=CAPTURE_NONE;
+			printerr("Error: Cannot open movie %s.\n\n",moviefname);
+			return 1;
+		}
+	}
+
+	//profiling: the frames run ahead would count twice
+	if(uzebox.profileFile || uzebox.callgrindFile){
+		uzebox.profile=new Profile();
+		uzebox.runAhead=0;
+		if(elfFile && !uzebox.profile->loadElf(elfFile)){
+			printerr("Warning: Cannot read symbols from ELF file %s.\n\n",elfFile);
+		}
+	}
+
 	sprintf(uzebox.caption,"Uzebox Emulator " VERSION " (ESC=quit, F1=help)");
 
 	// init the GUI
@@ -520,8 +571,13 @@ int main(int argc,char **argv)
             uzebox.state = CPU_RUNNING;
 #endif // NOGDB
 
-   	uzebox.randomSeed=time(NULL);
-   	srand(uzebox.randomSeed);	//used for the watchdog timer entropy
+	uzebox.selectFeatures();
+
+	//the replay starts from the first keyframe of the movie (the state the
+	//recording started with) or the one before the frame to seek to
+	if(uzebox.captureMode==CAPTURE_READ && !uzebox.movie_seek(seekFrame) && seekFrame!=0){
+		printerr("Warning: Cannot seek to frame %u of the movie.\n\n",seekFrame);
+	}
 	const int cycles=100000000;
 	int left, now;
 
@@ -531,7 +587,8 @@ int main(int argc,char **argv)
 #else // __EMSCRIPTEN__
 	while (true)
 	{
-		if (uzebox.fullscreen){
+		//headless: no caption, the speed is printed on exit (shutdown)
+		if (uzebox.fullscreen && !uzebox.headless){
 			puts(uzebox.caption);
 		}else{
 			if (uzebox.window) SDL_SetWindowTitle(uzebox.window,uzebox.caption);
@@ -540,11 +597,27 @@ int main(int argc,char **argv)
 		left = cycles;
 		now = SDL_GetTicks();
 		while (left > 0)
-			left -= uzebox.exec();
+			left -= uzebox.run_frame();
 		
+		if (uzebox.headless) continue;
+
 		now = SDL_GetTicks() - now;
+		//idle loops fast-forwarded, the batch can take less than a tick
+		if (now == 0) now = 1;
 
 		sprintf(uzebox.caption,"Uzebox Emulator " VERSION " (ESC=quit, F1=help)  %02d.%03d Mhz",cycles/now/1000,(cycles/now)%1000);
+		//audio underruns (device starved) and overruns (samples dropped)
+		if(uzebox.enableSound){
+			const size_t at=strlen(uzebox.caption);
+			snprintf(uzebox.caption+at,sizeof(uzebox.caption)-at,"  audio %u/%u under/overruns",
+				uzebox.audioRing.underruns.load(),uzebox.audioRing.overruns.load());
+		}
+		//frames the scaler had no time for (see Presenter)
+		if(uzebox.presenter){
+			const size_t at=strlen(uzebox.caption);
+			snprintf(uzebox.caption+at,sizeof(uzebox.caption)-at,"  %u frames dropped",
+				uzebox.presenter->dropped.load());
+		}
 	}
 #endif // __EMSCRIPTEN__
 